@@ -0,0 +1,235 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "event-loop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 32  // Handled per wakeup; more are left for the next.
+
+struct Registration {
+    int fd;  // -1 if slot unused.
+    bool is_timer;
+    EventHandler handler;
+    TimerHandler timer_handler;
+    void *user_data;
+    int64_t lateness_usec;  // Timers: of the expiration being handled.
+    uint64_t removed_in;    // Wakeup in which it was removed.
+};
+
+// Registrations are allocated one by one, as epoll refers to them, and are
+// reused once removed. So the loop only grows with the number of file
+// descriptors used at the same time. Events for a registration removed by a
+// handler can still be in the batch being dispatched, so it is only reused
+// once that batch is done; otherwise they'd go to the new file descriptor.
+struct EventLoop {
+    int epoll_fd;
+    bool running;
+    bool dispatching_batch;
+    struct Registration **registrations;
+    int count;
+    struct Registration *dispatching;  // Handler currently called.
+    uint64_t wakeups;
+};
+
+struct EventLoop *new_EventLoop(void) {
+    struct EventLoop *result =
+      (struct EventLoop *)calloc(1, sizeof(struct EventLoop));
+    result->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (result->epoll_fd < 0) {
+        perror("epoll_create1()");
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+void delete_EventLoop(struct EventLoop **loop) {
+    for (int i = 0; i < (*loop)->count; ++i) {
+        struct Registration *r = (*loop)->registrations[i];
+        if (r->fd >= 0 && r->is_timer) close(r->fd);
+        free(r);
+    }
+    free((*loop)->registrations);
+    close((*loop)->epoll_fd);
+    free(*loop);
+    *loop = NULL;
+}
+
+static struct Registration *UnusedRegistration(struct EventLoop *loop) {
+    for (int i = 0; i < loop->count; ++i) {
+        struct Registration *r = loop->registrations[i];
+        if (r->fd >= 0) continue;
+        if (loop->dispatching_batch && r->removed_in == loop->wakeups) {
+            continue;  // Might still have events in this batch.
+        }
+        return r;
+    }
+    struct Registration **grown = (struct Registration **)realloc(
+      loop->registrations, (loop->count + 1) * sizeof(*grown));
+    if (grown == NULL) return NULL;
+    loop->registrations = grown;
+    struct Registration *r =
+      (struct Registration *)calloc(1, sizeof(struct Registration));
+    if (r == NULL) return NULL;
+    r->fd = -1;
+    loop->registrations[loop->count++] = r;
+    return r;
+}
+
+static struct Registration *Register(struct EventLoop *loop, int fd) {
+    struct Registration *r = UnusedRegistration(loop);
+    if (r == NULL) {
+        fprintf(stderr, "Out of memory for event loop\n");
+        return NULL;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = r;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl()");
+        return NULL;
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    return r;
+}
+
+bool EventLoopAddFd(struct EventLoop *loop, int fd, EventHandler handler,
+                    void *user_data) {
+    struct Registration *r = Register(loop, fd);
+    if (r == NULL) return false;
+    r->handler = handler;
+    r->user_data = user_data;
+    return true;
+}
+
+void EventLoopRemoveFd(struct EventLoop *loop, int fd) {
+    for (int i = 0; i < loop->count; ++i) {
+        struct Registration *r = loop->registrations[i];
+        if (r->fd != fd) continue;
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+        if (r->is_timer) close(fd);
+        r->fd = -1;
+        r->removed_in = loop->wakeups;
+    }
+}
+
+static bool SetInterval(int timer_fd, int first_ms, int interval_ms) {
+    struct itimerspec spec;
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+    spec.it_value.tv_sec = first_ms / 1000;
+    spec.it_value.tv_nsec = (first_ms % 1000) * 1000000L;
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) < 0) {
+        perror("timerfd_settime()");
+        return false;
+    }
+    return true;
+}
+
+int EventLoopAddTimer(struct EventLoop *loop, int interval_ms,
+                      TimerHandler handler, void *user_data) {
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("timerfd_create()");
+        return -1;
+    }
+    if (!SetInterval(fd, interval_ms, interval_ms)) {
+        close(fd);
+        return -1;
+    }
+    struct Registration *r = Register(loop, fd);
+    if (r == NULL) {
+        close(fd);
+        return -1;
+    }
+    r->is_timer = true;
+    r->timer_handler = handler;
+    r->user_data = user_data;
+    return fd;
+}
+
+bool EventLoopSetTimerInterval(struct EventLoop *loop, int timer_fd,
+                               int interval_ms) {
+    (void)loop;
+    return SetInterval(timer_fd, interval_ms, interval_ms);
+}
+
+bool EventLoopRestartTimer(struct EventLoop *loop, int timer_fd,
+                           int first_ms, int interval_ms) {
+    (void)loop;
+    if (first_ms < 1) first_ms = 1;  // 0 would disarm it.
+    return SetInterval(timer_fd, first_ms, interval_ms);
+}
+
+static void Dispatch(struct Registration *r) {
+    if (!r->is_timer) {
+        r->handler(r->user_data);
+        return;
+    }
+    uint64_t expirations;
+    if (read(r->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    // The next expiration is one interval after the last one, so the time
+    // remaining until then tells how long ago the first one we handle now
+    // was due.
+    struct itimerspec spec;
+    if (timerfd_gettime(r->fd, &spec) == 0) {
+        const int64_t interval_usec = spec.it_interval.tv_sec * 1000000LL +
+                                      spec.it_interval.tv_nsec / 1000;
+        const int64_t remaining_usec =
+          spec.it_value.tv_sec * 1000000LL + spec.it_value.tv_nsec / 1000;
+        r->lateness_usec =
+          (int64_t)expirations * interval_usec - remaining_usec;
+    }
+    r->timer_handler(expirations, r->user_data);
+}
+
+void EventLoopRun(struct EventLoop *loop) {
+    struct epoll_event events[MAX_EVENTS];
+    loop->running = true;
+    while (loop->running) {
+        const int n = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait()");
+            break;
+        }
+        loop->wakeups++;
+        loop->dispatching_batch = true;
+        for (int i = 0; i < n && loop->running; ++i) {
+            struct Registration *r = (struct Registration *)events[i].data.ptr;
+            if (r->fd < 0) continue;  // Might've been removed meanwhile.
+            loop->dispatching = r;
+            Dispatch(r);
+            loop->dispatching = NULL;
+        }
+        loop->dispatching_batch = false;
+    }
+}
+
+void EventLoopStop(struct EventLoop *loop) { loop->running = false; }
+
+int64_t EventLoopTimerLateness(const struct EventLoop *loop, int timer_fd) {
+    const struct Registration *r = loop->dispatching;
+    if (r && r->fd == timer_fd && r->is_timer) return r->lateness_usec;
+    for (int i = 0; i < loop->count; ++i) {
+        r = loop->registrations[i];
+        if (r->fd == timer_fd && r->is_timer) return r->lateness_usec;
+    }
+    return -1;
+}
+
+uint64_t EventLoopWakeups(const struct EventLoop *loop) {
+    return loop->wakeups;
+}
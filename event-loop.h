@@ -0,0 +1,55 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Simple epoll() based event loop, waiting for all our file descriptors
+// (joystick, machine, timers) at once. There is no limit on how many.
+struct EventLoop;
+
+// Called when the registered file descriptor is readable.
+typedef void (*EventHandler)(void *user_data);
+
+// Called for timers with the number of expirations since the last call
+// (more than one if we have been late).
+typedef void (*TimerHandler)(uint64_t expirations, void *user_data);
+
+struct EventLoop *new_EventLoop(void);
+void delete_EventLoop(struct EventLoop **loop);
+
+// Call "handler" whenever "fd" becomes readable. Returns false on failure.
+bool EventLoopAddFd(struct EventLoop *loop, int fd, EventHandler handler,
+                    void *user_data);
+void EventLoopRemoveFd(struct EventLoop *loop, int fd);
+
+// Add a periodic timer on the monotonic clock firing every "interval_ms".
+// As the timer is re-armed by the kernel, there is no drift.
+// Returns timer file descriptor or -1 on failure.
+int EventLoopAddTimer(struct EventLoop *loop, int interval_ms,
+                      TimerHandler handler, void *user_data);
+
+// Change the interval of a timer created with EventLoopAddTimer().
+bool EventLoopSetTimerInterval(struct EventLoop *loop, int timer_fd,
+                               int interval_ms);
+
+// Change the interval, with the next expiration "first_ms" from now.
+bool EventLoopRestartTimer(struct EventLoop *loop, int timer_fd,
+                           int first_ms, int interval_ms);
+
+// From within the timer handler: how many microseconds after the (first)
+// expiration the handler got called. A measure of scheduling jitter.
+int64_t EventLoopTimerLateness(const struct EventLoop *loop, int timer_fd);
+
+// Run until EventLoopStop() is called from a handler.
+void EventLoopRun(struct EventLoop *loop);
+void EventLoopStop(struct EventLoop *loop);
+
+// Number of times the loop woke up to handle events.
+uint64_t EventLoopWakeups(const struct EventLoop *loop);
+
+#endif  // EVENT_LOOP_H
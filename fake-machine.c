@@ -0,0 +1,737 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+// A simulated Marlin or GRBL machine on a pseudo terminal, so that
+// machine-jog can be run and tuned without hardware. It models what makes a
+// real machine push back: the time bytes need on the serial line, a receive
+// buffer that overflows if the host sends too much, a command queue and
+// planner of limited size, moves that take time to accelerate, and 'ok's
+// that are sent only once a command found room in the planner. Optionally,
+// bytes get corrupted on the way in, as they do on a noisy line.
+
+#include <ctype.h>
+#include <math.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event-loop.h"
+#include "machine-jog.h"
+#include "machine-port.h"
+
+#define MAX_LINE        256
+#define MAX_BLOCKS      64
+#define OUT_BUFFER_SIZE 16384
+#define TICK_MS         1  // Granularity of our simulation.
+
+// Size of buffers and behavior of the firmware we pretend to be.
+struct Dialect {
+    const char *name;
+    int rx_buffer_size;  // Bytes of the serial receive buffer.
+    int command_slots;   // Lines buffered before being executed.
+    int planner_blocks;  // Moves buffered in the planner.
+    bool grbl;
+};
+
+static const struct Dialect kDialects[] = {
+    {"marlin", 128, 4, 16, false},
+    {"grbl", 128, 1, 15, true},
+};
+
+// A linear move in the planner.
+struct Block {
+    struct Vector start;
+    struct Vector target;
+    float unit[NUM_AXIS];  // Direction.
+    float length;          // mm
+    float feed;            // mm/s
+    float done;            // mm already travelled.
+    bool jog;              // GRBL $J= move.
+};
+
+// What keeps the firmware from acknowledging the oldest command.
+enum Wait {
+    WAIT_NONE,
+    WAIT_RETRY,  // Try again later, e.g. once there is room in the planner.
+    WAIT_IDLE,   // Done, but acknowledged only once the machine is at rest.
+};
+
+static struct Dialect dialect;
+static int baud = 115200;         // 0: unlimited.
+static int64_t ok_delay_usec = 0;  // Time to process each command.
+static float acceleration = 1000;  // mm/s^2
+static int busy_interval_ms = 2000;
+static bool verbose = false;
+static double error_rate = 0;     // Probability of a received byte to flip.
+
+static int fd = -1;
+static int64_t last_tick_usec;
+
+// Serial line and receive buffer.
+static double in_budget, out_budget;  // Bytes the line transports now.
+static char rx[MAX_LINE * 8];
+static int rx_len;
+static char isr_line[MAX_LINE];  // Line as seen by the emergency parser.
+static int isr_line_len;
+static char out[OUT_BUFFER_SIZE];
+static int out_len;
+
+// Command queue.
+static char queue[8][MAX_LINE];
+static int queue_len;
+static int64_t busy_until_usec;  // Still processing the last command.
+static bool ok_pending;          // ... and will send 'ok' then.
+static enum Wait waiting;        // ... for the oldest command.
+static int64_t last_busy_usec;   // Last 'busy:' sent while waiting.
+static int64_t dwell_usec;       // G4 after the machine came to rest.
+static int64_t report_interval_usec;  // M154 position auto-report.
+static int64_t next_report_usec;
+static bool halted;              // Marlin after M112.
+static bool rejected;            // GRBL replied error instead of 'ok'.
+static long last_line;           // Marlin: last line number received.
+
+// Motion.
+static struct Block blocks[MAX_BLOCKS];
+static int block_head, block_count;
+static struct Vector position;  // Where the tool actually is.
+static struct Vector planned;   // Where it will be after the last block.
+static float speed;             // mm/s
+static int64_t emptied_usec;    // When the planner ran out of blocks.
+static bool absolute = true;
+static struct Vector soft_limit;  // Software endstops; clamp if > 0.
+static float feedrate = 1000 / 60.0f;  // mm/s
+static bool hold;                // GRBL feed hold.
+static bool stopping;            // Jog cancel: decelerate, then flush.
+
+static struct {
+    uint64_t lines, moves, overruns, lost_output, starved;
+    uint64_t corrupted, line_errors;
+    int max_blocks;
+} stats;
+
+static volatile sig_atomic_t interrupted = 0;
+static void InterruptHandler(int signo) {
+    (void)signo;
+    interrupted = 1;
+}
+
+static int64_t NowUsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void Reply(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void Reply(const char *fmt, ...) {
+    char line[MAX_LINE];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line) - 1, fmt, ap);
+    va_end(ap);
+    if (len > (int)sizeof(line) - 2) len = sizeof(line) - 2;
+    line[len++] = '\n';
+    if (verbose) fprintf(stderr, "    -> %.*s", len, line);
+    if (out_len + len > OUT_BUFFER_SIZE) {
+        stats.lost_output++;
+        return;
+    }
+    memcpy(out + out_len, line, len);
+    out_len += len;
+}
+
+static void ReplyBanner(void) {
+    if (dialect.grbl) {
+        Reply("\r\nGrbl 1.1h ['$' for help]");
+    } else {
+        Reply("start");
+        Reply("echo: fake-machine (Marlin)");
+    }
+}
+
+static struct Block *HeadBlock(void) {
+    return block_count ? &blocks[block_head] : NULL;
+}
+
+static void FlushPlanner(void) {
+    block_count = 0;
+    speed = 0;
+    planned = position;
+}
+
+static bool QueueMove(const struct Vector *target, float feed, bool jog) {
+    if (block_count == dialect.planner_blocks) return false;
+    struct Block *b = &blocks[(block_head + block_count) % MAX_BLOCKS];
+    float sum = 0;
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+        b->unit[a] = target->axis[a] - planned.axis[a];
+        sum += b->unit[a] * b->unit[a];
+    }
+    b->length = sqrtf(sum);
+    if (b->length < 1e-4) return true;  // Nothing to do.
+    if (block_count == 0 && last_tick_usec - emptied_usec < 100000) {
+        stats.starved++;  // Had to stop, as this move came too late.
+    }
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) b->unit[a] /= b->length;
+    b->start = planned;
+    b->target = *target;
+    b->feed = feed;
+    b->done = 0;
+    b->jog = jog;
+    planned = *target;
+    block_count++;
+    if (block_count > stats.max_blocks) stats.max_blocks = block_count;
+    stats.moves++;
+    return true;
+}
+
+// Speed with which we may leave the head block: what the next block allows
+// in the corner between them, or zero if there is none (yet).
+static float ExitSpeed(const struct Block *b) {
+    if (hold || stopping || block_count < 2) return 0;
+    const struct Block *next = &blocks[(block_head + 1) % MAX_BLOCKS];
+    float cosine = 0;
+    for (int a = AXIS_X; a < NUM_AXIS; ++a)
+        cosine += b->unit[a] * next->unit[a];
+    if (cosine <= 0) return 0;
+    return fminf(b->feed, next->feed) * cosine;
+}
+
+static void Move(float dt) {
+    while (dt > 0) {
+        struct Block *b = HeadBlock();
+        if (b == NULL) {
+            speed = 0;
+            return;
+        }
+        const float remaining = b->length - b->done;
+        const float exit_speed = ExitSpeed(b);
+        const float braking =
+          (speed * speed - exit_speed * exit_speed) / (2 * acceleration);
+        if (remaining <= braking || hold || stopping) {
+            speed = fmaxf(speed - acceleration * dt, exit_speed);
+            if (speed <= 0 && (hold || stopping)) {
+                speed = 0;
+                if (stopping) {
+                    FlushPlanner();
+                    stopping = false;
+                }
+                return;
+            }
+        } else {
+            speed = fminf(speed + acceleration * dt, b->feed);
+        }
+        // Don't get stuck right before the end of the block.
+        const float step = fmaxf(speed, acceleration * TICK_MS / 1000.0f) * dt;
+        if (step < remaining) {
+            b->done += step;
+            for (int a = AXIS_X; a < NUM_AXIS; ++a)
+                position.axis[a] = b->start.axis[a] + b->unit[a] * b->done;
+            return;
+        }
+        position = b->target;
+        dt -= remaining / fmaxf(speed, 1e-3);
+        block_head = (block_head + 1) % MAX_BLOCKS;
+        if (--block_count == 0) emptied_usec = last_tick_usec;
+    }
+}
+
+static bool FindWord(const char *line, char letter, float *value) {
+    for (const char *p = line; *p; ++p) {
+        if (*p == letter && (p == line || p[-1] == ' ')) {
+            char *end;
+            *value = strtof(p + 1, &end);
+            return end != p + 1;
+        }
+    }
+    return false;
+}
+
+// Parse the axis words of a move; return false if there are none.
+static bool MoveTarget(const char *line, struct Vector *target) {
+    static const char kAxisLetter[NUM_AXIS] = {'X', 'Y', 'Z'};
+    bool any = false;
+    *target = planned;
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+        float v;
+        if (!FindWord(line, kAxisLetter[a], &v)) continue;
+        target->axis[a] = absolute ? v : planned.axis[a] + v;
+        if (soft_limit.axis[a] > 0) {  // Quietly, as Marlin does.
+            if (target->axis[a] < 0) target->axis[a] = 0;
+            if (target->axis[a] > soft_limit.axis[a])
+                target->axis[a] = soft_limit.axis[a];
+        }
+        any = true;
+    }
+    return any;
+}
+
+// Normalize line into upper case words separated by single space; strip
+// comments. Returns length.
+static int Normalize(const char *in, char *line) {
+    int len = 0;
+    bool in_paren = false;
+    for (; *in && *in != ';' && len < MAX_LINE - 2; ++in) {
+        char c = *in;
+        if (c == '(') in_paren = true;
+        if (in_paren) {
+            if (c == ')') in_paren = false;
+            continue;
+        }
+        if (c == '\r' || c == '\t') c = ' ';
+        if (c == ' ') {
+            if (len == 0 || line[len - 1] == ' ') continue;
+        } else if (len > 0 && isalpha((unsigned char)c) &&
+                   (isdigit((unsigned char)line[len - 1]) ||
+                    line[len - 1] == '.')) {
+            line[len++] = ' ';  // "G1X1Y2" -> "G1 X1 Y2"
+        }
+        line[len++] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+    }
+    while (len > 0 && line[len - 1] == ' ') --len;
+    line[len] = '\0';
+    return len;
+}
+
+static void ReplyPosition(void) {
+    Reply("X:%.2f Y:%.2f Z:%.2f E:0.00 Count X:%.2f Y:%.2f Z:%.2f",
+          planned.axis[AXIS_X], planned.axis[AXIS_Y], planned.axis[AXIS_Z],
+          position.axis[AXIS_X], position.axis[AXIS_Y],
+          position.axis[AXIS_Z]);
+}
+
+static void ReplyGrblStatus(void) {
+    const char *state = "Idle";
+    if (hold) {
+        state = speed > 0 ? "Hold:1" : "Hold:0";
+    } else if (block_count > 0) {
+        state = HeadBlock()->jog ? "Jog" : "Run";
+    }
+    Reply("<%s|MPos:%.3f,%.3f,%.3f|FS:%.0f,0>", state, position.axis[AXIS_X],
+          position.axis[AXIS_Y], position.axis[AXIS_Z], speed * 60);
+}
+
+// Execute a motion or setting command. Returns what we still wait for.
+static enum Wait ExecuteGCode(const char *line, bool jog) {
+    float g = -1, m = -1, f;
+    if (FindWord(line, 'F', &f) && f > 0) feedrate = f / 60;
+    if (FindWord(line, 'G', &g)) {
+        if (g == 90) absolute = true;
+        if (g == 91) absolute = false;
+        // G90/G91 might be given together with a move, e.g. in $J=G90 ...
+        float second;
+        const char *rest = strchr(line, ' ');
+        if ((g == 90 || g == 91) && rest && FindWord(rest, 'G', &second)) {
+            g = second;
+        }
+    }
+    FindWord(line, 'M', &m);
+    struct Vector target;
+    if (jog || g == 0 || g == 1 || (g < 0 && m < 0 && strchr(line, 'X'))) {
+        if (!MoveTarget(line, &target)) return WAIT_NONE;
+        return QueueMove(&target, feedrate, jog) ? WAIT_NONE : WAIT_RETRY;
+    }
+    if (g == 4) {
+        float p = 0, s = 0;
+        FindWord(line, 'P', &p);
+        FindWord(line, 'S', &s);
+        dwell_usec = (int64_t)(p * 1000 + s * 1e6);
+        return WAIT_IDLE;
+    }
+    if (g == 28) {
+        struct Vector home = {{0, 0, 0}};
+        return QueueMove(&home, 50, false) ? WAIT_IDLE : WAIT_RETRY;
+    }
+    if (g == 92) {
+        if (block_count > 0) return WAIT_RETRY;
+        MoveTarget(line, &position);
+        planned = position;
+        return WAIT_NONE;
+    }
+    if (g == 17 || g == 21 || g == 90 || g == 91 || g == 94) return WAIT_NONE;
+    if (dialect.grbl) {
+        Reply("error:20");  // Unsupported command.
+        rejected = true;
+        return WAIT_NONE;
+    }
+    switch ((int)m) {
+    case 17: case 18: case 84: case 105: break;  // Nothing to do.
+    case 110: {
+        float n;
+        if (FindWord(line, 'N', &n)) last_line = (long)n;
+        break;
+    }
+    case 400: return WAIT_IDLE;
+    case 114: ReplyPosition(); break;
+    case 154: {  // Report where the tool actually is every S seconds.
+        float seconds = 0;
+        FindWord(line, 'S', &seconds);
+        report_interval_usec = (int64_t)(seconds * 1e6);
+        next_report_usec = NowUsec() + report_interval_usec;
+        break;
+    }
+    case 115:
+        Reply("FIRMWARE_NAME:Marlin fake-machine PROTOCOL_VERSION:1.0");
+        break;
+    case 410: FlushPlanner(); break;  // Usually done by emergency parser.
+    case 112:
+        FlushPlanner();
+        halted = true;
+        Reply("Error:Printer halted. kill() called!");
+        break;
+    default: Reply("echo:Unknown command: \"%s\"", line); break;
+    }
+    return WAIT_NONE;
+}
+
+static enum Wait ExecuteGrblSystem(const char *line) {
+    if (strncmp(line, "$J=", 3) == 0) {
+        float f;
+        if (!FindWord(line + 3, 'F', &f)) {
+            Reply("error:22");  // Feed rate has not yet been set.
+            rejected = true;
+            return WAIT_NONE;
+        }
+        const bool was_absolute = absolute;
+        const float old_feed = feedrate;
+        const enum Wait wait = ExecuteGCode(line + 3, true);
+        absolute = was_absolute;  // Jogs don't change the modal state.
+        feedrate = old_feed;
+        return wait;
+    }
+    if (strcmp(line, "$I") == 0) {
+        Reply("[VER:1.1h.20190830:fake-machine]");
+        Reply("[OPT:V,%d,%d]", dialect.planner_blocks,
+              dialect.rx_buffer_size);
+    }
+    if (strcmp(line, "$H") == 0) {
+        struct Vector home = {{0, 0, 0}};
+        return QueueMove(&home, 50, false) ? WAIT_IDLE : WAIT_RETRY;
+    }
+    return WAIT_NONE;
+}
+
+// Try to execute the oldest command; returns what it still waits for.
+static enum Wait Execute(const char *raw, int64_t now) {
+    char line[MAX_LINE];
+    Normalize(raw, line);
+    if (line[0] == '\0') return WAIT_NONE;
+    enum Wait wait;
+    if (dialect.grbl && line[0] == '$') {
+        wait = ExecuteGrblSystem(line);
+    } else {
+        wait = ExecuteGCode(line, false);
+    }
+    if (wait == WAIT_IDLE) last_busy_usec = now;
+    return wait;
+}
+
+// Handle a received byte right away, as an interrupt handler would: GRBL
+// real-time commands and Marlin's emergency parser.
+static bool HandleRealtime(char c) {
+    if (dialect.grbl) {
+        switch ((unsigned char)c) {
+        case '?': ReplyGrblStatus(); return true;
+        case '!': hold = (block_count > 0); return true;
+        case '~': hold = false; return true;
+        case 0x85:
+            if (HeadBlock() && HeadBlock()->jog) stopping = true;
+            return true;
+        case 0x18:
+            FlushPlanner();
+            hold = stopping = false;
+            rx_len = queue_len = 0;
+            ok_pending = false;
+            waiting = WAIT_NONE;
+            ReplyBanner();
+            return true;
+        }
+        return (unsigned char)c >= 0x80;
+    }
+    if (c == '\n' || c == '\r') {
+        isr_line[isr_line_len] = '\0';
+        if (strncmp(isr_line, "M410", 4) == 0) FlushPlanner();
+        if (strncmp(isr_line, "M112", 4) == 0) {
+            FlushPlanner();
+            halted = true;
+        }
+        isr_line_len = 0;
+    } else if (isr_line_len < MAX_LINE - 1) {
+        isr_line[isr_line_len++] = c;
+    }
+    return false;
+}
+
+// Bytes arriving on the serial line, as fast as the baud rate allows.
+static void ReceiveBytes(double dt) {
+    char buffer[4096];
+    int allowed = sizeof(buffer);
+    if (baud > 0) {
+        in_budget += baud / 10.0 * dt;
+        if (in_budget < 1) return;
+        if (in_budget < allowed) allowed = (int)in_budget;
+    }
+    const int r = read(fd, buffer, allowed);
+    if (r <= 0) {
+        in_budget = 0;  // Idle line doesn't save up for later.
+        return;
+    }
+    in_budget -= r;
+    if (r < allowed) in_budget = 0;
+    for (int i = 0; i < r; ++i) {
+        if (HandleRealtime(buffer[i])) continue;
+        if (rx_len >= dialect.rx_buffer_size) {
+            stats.overruns++;  // Nobody there to catch it.
+            continue;
+        }
+        if (error_rate > 0 && drand48() < error_rate) {
+            buffer[i] ^= 1 << (lrand48() % 7);
+            stats.corrupted++;
+        }
+        rx[rx_len++] = buffer[i];
+    }
+}
+
+static void SendBytes(double dt) {
+    if (out_len == 0) {
+        out_budget = 0;
+        return;
+    }
+    int allowed = out_len;
+    if (baud > 0) {
+        out_budget += baud / 10.0 * dt;
+        if (out_budget < allowed) allowed = (int)out_budget;
+    }
+    if (allowed == 0) return;
+    const int w = write(fd, out, allowed);
+    if (w <= 0) return;
+    if (baud > 0) out_budget -= w;
+    memmove(out, out + w, out_len - w);
+    out_len -= w;
+}
+
+// Marlin asks for a line again if it arrived damaged, and for the line it
+// expected if one got lost. Returns false.
+static bool RequestResend(const char *error) {
+    Reply("Error:%s, Last Line: %ld", error, last_line);
+    Reply("Resend: %ld", last_line + 1);
+    Reply("ok");
+    stats.line_errors++;
+    return false;
+}
+
+// Marlin checks line numbers and checksums ("N<line> ...*<checksum>") as
+// lines arrive, and strips them. Returns false if the line is rejected.
+static bool CheckLine(char *line) {
+    char *star = strrchr(line, '*');
+    if (line[0] != 'N') {
+        if (star) return RequestResend("No Line Number with checksum");
+        return true;
+    }
+    char *command;
+    long number = strtol(line + 1, &command, 10);
+    const char *m110 = strstr(line, "M110");
+    if (m110) {  // Sets the line number instead.
+        const char *n = strchr(m110 + 4, 'N');
+        if (n) number = strtol(n + 1, NULL, 10);
+    } else if (number != last_line + 1) {
+        return RequestResend("Line Number is not Last Line Number+1");
+    }
+    if (star == NULL) return RequestResend("No Checksum with line number");
+    unsigned char checksum = 0;
+    for (const char *c = line; c < star; ++c) checksum ^= *c;
+    if (strtol(star + 1, NULL, 10) != checksum)
+        return RequestResend("checksum mismatch");
+    last_line = number;
+    *star = '\0';
+    while (*command == ' ') ++command;
+    memmove(line, command, strlen(command) + 1);
+    return true;
+}
+
+// Move complete lines from the receive buffer into the command queue.
+static void FetchCommands(void) {
+    while (queue_len < dialect.command_slots) {
+        const char *newline = memchr(rx, '\n', rx_len);
+        if (newline == NULL) {
+            if (rx_len < dialect.rx_buffer_size) return;
+            newline = rx + rx_len - 1;  // Overlong garbage; take it all.
+        }
+        const int len = newline - rx + 1;
+        const int copy = len < MAX_LINE ? len - 1 : MAX_LINE - 1;
+        memcpy(queue[queue_len], rx, copy);
+        queue[queue_len][copy] = '\0';
+        if (dialect.grbl || CheckLine(queue[queue_len])) queue_len++;
+        memmove(rx, rx + len, rx_len - len);
+        rx_len -= len;
+    }
+}
+
+static void ProcessCommands(int64_t now) {
+    for (;;) {
+        if (now < busy_until_usec) return;
+        if (ok_pending) {
+            Reply("ok");
+            ok_pending = false;
+        }
+        if (waiting == WAIT_IDLE) {
+            if (block_count > 0) {
+                const bool busy_due =
+                  now - last_busy_usec >= busy_interval_ms * 1000LL;
+                if (!dialect.grbl && busy_due) {
+                    Reply("echo:busy: processing");
+                    last_busy_usec = now;
+                }
+                return;
+            }
+            waiting = WAIT_NONE;
+            busy_until_usec = now + dwell_usec + ok_delay_usec;
+            dwell_usec = 0;
+            ok_pending = true;
+            continue;
+        }
+        FetchCommands();
+        if (queue_len == 0 || halted) return;
+        if (waiting == WAIT_NONE && verbose) {
+            fprintf(stderr, "%s\n", queue[0]);
+        }
+        waiting = Execute(queue[0], now);
+        if (waiting == WAIT_RETRY) return;
+        stats.lines++;
+        queue_len--;
+        memmove(queue[0], queue[1], queue_len * sizeof(queue[0]));
+        if (waiting == WAIT_IDLE) continue;
+        busy_until_usec = now + ok_delay_usec;
+        ok_pending = !rejected;
+        rejected = false;
+    }
+}
+
+static void OnTick(uint64_t expirations, void *user_data) {
+    (void)expirations;
+    if (interrupted) {
+        EventLoopStop((struct EventLoop *)user_data);
+        return;
+    }
+    const int64_t now = NowUsec();
+    const double dt = (now - last_tick_usec) / 1e6;
+    last_tick_usec = now;
+    ReceiveBytes(dt);
+    Move(dt);
+    ProcessCommands(now);
+    if (report_interval_usec > 0 && now >= next_report_usec) {
+        Reply("X:%.2f Y:%.2f Z:%.2f E:0.00", position.axis[AXIS_X],
+              position.axis[AXIS_Y], position.axis[AXIS_Z]);
+        next_report_usec = now + report_interval_usec;
+    }
+    SendBytes(dt);
+}
+
+static int usage(const char *progname) {
+    fprintf(stderr,
+            "Usage: %s [options] <pty-link>\n"
+            "Simulated machine on a pseudo terminal; <pty-link> is the "
+            "device to\nconnect to, e.g. with machine-jog -d <pty-link>.\n"
+            "Options:\n"
+            "  -f <firmware> : marlin or grbl (default marlin)\n"
+            "  -b <baud>     : Baud rate to simulate; 0: unlimited "
+            "(default 115200)\n"
+            "  -o <usec>     : Time to process each command until 'ok' "
+            "(default 0)\n"
+            "  -a <mm/s^2>   : Acceleration (default 1000)\n"
+            "  -r <bytes>    : Size of the receive buffer (default 128)\n"
+            "  -n <blocks>   : Size of the planner (default 16; GRBL 15)\n"
+            "  -l <x,y,z>    : Software endstops: clamp moves to 0..limit\n"
+            "  -e <rate>     : Probability of a received byte to be "
+            "corrupted\n"
+            "  -v            : Verbose; print commands and replies\n",
+            progname);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    dialect = kDialects[0];
+    int rx_buffer_size = -1, planner_blocks = -1;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:b:o:a:r:n:l:e:v")) != -1) {
+        switch (opt) {
+        case 'f': {
+            bool found = false;
+            for (size_t i = 0; i < sizeof(kDialects) / sizeof(kDialects[0]);
+                 ++i) {
+                if (strcasecmp(kDialects[i].name, optarg) == 0) {
+                    dialect = kDialects[i];
+                    found = true;
+                }
+            }
+            if (!found) {
+                fprintf(stderr, "Unknown firmware %s\n", optarg);
+                return usage(argv[0]);
+            }
+            break;
+        }
+        case 'b': baud = atoi(optarg); break;
+        case 'o': ok_delay_usec = atoll(optarg); break;
+        case 'a': acceleration = atof(optarg); break;
+        case 'r': rx_buffer_size = atoi(optarg); break;
+        case 'n': planner_blocks = atoi(optarg); break;
+        case 'l':
+            if (sscanf(optarg, "%f,%f,%f", &soft_limit.axis[AXIS_X],
+                       &soft_limit.axis[AXIS_Y],
+                       &soft_limit.axis[AXIS_Z]) != 3) {
+                return usage(argv[0]);
+            }
+            break;
+        case 'e': error_rate = atof(optarg); break;
+        case 'v': verbose = true; break;
+        default: return usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || acceleration <= 0) return usage(argv[0]);
+    if (rx_buffer_size > 0) {
+        if (rx_buffer_size > (int)sizeof(rx)) rx_buffer_size = sizeof(rx);
+        dialect.rx_buffer_size = rx_buffer_size;
+    }
+    if (planner_blocks > 0) {
+        if (planner_blocks > MAX_BLOCKS) planner_blocks = MAX_BLOCKS;
+        dialect.planner_blocks = planner_blocks;
+    }
+
+    const char *link_path = argv[optind];
+    int slave_fd;
+    fd = CreatePseudoTerminal(link_path, &slave_fd);
+    if (fd < 0) return 1;
+    fprintf(stderr, "%s on %s, %d baud\n", dialect.name, link_path, baud);
+
+    signal(SIGINT, InterruptHandler);
+    signal(SIGTERM, InterruptHandler);
+
+    srand48(NowUsec());
+    ReplyBanner();
+    struct EventLoop *loop = new_EventLoop();
+    last_tick_usec = NowUsec();
+    if (EventLoopAddTimer(loop, TICK_MS, &OnTick, loop) < 0) return 1;
+    EventLoopRun(loop);
+    delete_EventLoop(&loop);
+
+    fprintf(stderr,
+            "%llu lines, %llu moves; planner max %d/%d blocks, ran empty "
+            "while moving %llu times; %llu bytes overrun, %llu replies "
+            "lost; %llu bytes corrupted, %llu resend requests\n",
+            (unsigned long long)stats.lines, (unsigned long long)stats.moves,
+            stats.max_blocks, dialect.planner_blocks,
+            (unsigned long long)stats.starved,
+            (unsigned long long)stats.overruns,
+            (unsigned long long)stats.lost_output,
+            (unsigned long long)stats.corrupted,
+            (unsigned long long)stats.line_errors);
+    unlink(link_path);
+    close(slave_fd);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,142 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "firmware.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+static bool IsOk(const char *line) { return strncasecmp(line, "ok", 2) == 0; }
+
+// M114 reply: "X:1.00 Y:2.00 Z:3.00 E:0.00 Count X: ..." Klipper might
+// prefix it with the 'ok', so we look for the first X: in the line.
+static enum FirmwarePosition ParseM114(const char *line, struct Vector *pos) {
+    const char *x = strstr(line, "X:");
+    if (x == NULL) return FIRMWARE_NO_POSITION;
+    struct Vector result;
+    if (sscanf(x, "X:%f Y:%f Z:%f", &result.axis[AXIS_X], &result.axis[AXIS_Y],
+               &result.axis[AXIS_Z]) != 3) {
+        return FIRMWARE_NO_POSITION;
+    }
+    *pos = result;
+    return FIRMWARE_POSITION;
+}
+
+// GRBL acknowledges every line with either 'ok' or 'error:<code>'; both
+// free the space of the line in its receive buffer.
+static bool IsGrblAck(const char *line) {
+    return IsOk(line) || strncmp(line, "error:", 6) == 0;
+}
+
+static bool ParseGrblVector(const char *line, const char *key,
+                            struct Vector *v) {
+    const char *found = strstr(line, key);
+    return found != NULL &&
+           sscanf(found + strlen(key), "%f,%f,%f", &v->axis[AXIS_X],
+                  &v->axis[AXIS_Y], &v->axis[AXIS_Z]) == 3;
+}
+
+// Status report, GRBL 1.1: "<Idle|MPos:1.000,2.000,3.000|FS:0,0|WCO:...>"
+// or GRBL 0.9: "<Idle,MPos:1.000,2.000,3.000,WPos:1.000,2.000,3.000>".
+// We want work coordinates, as this is what G90 moves refer to.
+static enum FirmwarePosition ParseGrblStatus(const char *line,
+                                             struct Vector *pos) {
+    if (line[0] != '<') return FIRMWARE_NO_POSITION;
+    struct Vector result;
+    if (!ParseGrblVector(line, "WPos:", &result)) {
+        struct Vector offset;
+        if (!ParseGrblVector(line, "MPos:", &result))
+            return FIRMWARE_NO_POSITION;
+        if (ParseGrblVector(line, "WCO:", &offset)) {
+            for (int a = AXIS_X; a < NUM_AXIS; ++a)
+                result.axis[a] -= offset.axis[a];
+        }
+    }
+    *pos = result;
+    const char *state = line + 1;
+    if (strncmp(state, "Run", 3) == 0 || strncmp(state, "Jog", 3) == 0 ||
+        strncmp(state, "Home", 4) == 0 || strncmp(state, "Hold:1", 6) == 0) {
+        return FIRMWARE_MOVING;
+    }
+    return FIRMWARE_POSITION;
+}
+
+static const struct Firmware kFirmwares[] = {
+    {
+      // Prusa uses 'W' to indicate that we don't want bed-levelling on G28.
+      // M410 only bypasses the queue if Marlin is compiled with
+      // EMERGENCY_PARSER; it keeps the position, unlike M112.
+      .name = "marlin",
+      .home = "G28 W0\n",
+      .motor_off = "M84\n",
+      .probe = "M115\n",
+      .boot_banner = "start",
+      .query_position = "M114\n",
+      .parse_position = &ParseM114,
+      .report_position = "M154 S1\n",  // AUTO_REPORT_POSITION
+      .report_position_off = "M154 S0\n",
+      .line_numbers = true,
+      .is_ack = &IsOk,
+      .jog_command = "G1",
+      .finish_moves = "M400\n",
+      .quick_stop = "M410\n",
+    },
+    {
+      // Jogging with $J= is handled by GRBL as a separate state that can be
+      // cancelled immediately. Motors are switched off by GRBL itself.
+      .name = "grbl",
+      .home = "$H\n",
+      .probe = "$I\n",
+      .boot_banner = "Grbl ",
+      .query_position = "?",
+      .query_is_realtime = true,
+      .parse_position = &ParseGrblStatus,
+      .position_shows_motion = true,
+      .is_ack = &IsGrblAck,
+      .jog_command = "$J=G90",
+      .jog_needs_feedrate = true,
+      .jog_cancel = '\x85',
+      .finish_moves = "G4 P0\n",  // Dwell waits for the planner to drain.
+      // Feed-hold decelerates without losing position; a soft-reset once
+      // in hold flushes everything still queued.
+      .quick_stop = "!",
+      .stop_flush = "\x18",
+      .realtime_commands = "?!~\x18",
+      .rx_buffer_size = 128,
+    },
+    {
+      // Klipper handles M112 as soon as it arrives; it requires a
+      // FIRMWARE_RESTART afterwards.
+      .name = "klipper",
+      .home = "G28\n",
+      .motor_off = "M84\n",
+      .probe = "M115\n",
+      .query_position = "M114\n",
+      .parse_position = &ParseM114,
+      .is_ack = &IsOk,
+      .jog_command = "G1",
+      .finish_moves = "M400\n",
+      .quick_stop = "M112\n",
+    },
+    {
+      .name = "beagleg",
+      .home = "G28\n",
+      .motor_off = "M84\n",
+      .probe = "G21\n",
+      .query_position = "M114\n",
+      .parse_position = &ParseM114,
+      .is_ack = &IsOk,
+      .jog_command = "G1",
+    },
+};
+
+const struct Firmware *FirmwareByName(const char *name) {
+    for (size_t i = 0; i < sizeof(kFirmwares) / sizeof(kFirmwares[0]); ++i) {
+        if (strcasecmp(kFirmwares[i].name, name) == 0) return &kFirmwares[i];
+    }
+    return NULL;
+}
+
+const struct Firmware *FirmwareDefault(void) { return &kFirmwares[0]; }
@@ -0,0 +1,74 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef FIRMWARE_H
+#define FIRMWARE_H
+
+#include <stdbool.h>
+
+#include "machine-jog.h"
+
+// What a reply to a position query tells us.
+enum FirmwarePosition {
+    FIRMWARE_NO_POSITION,  // Line does not contain a position.
+    FIRMWARE_MOVING,       // Position reported, but machine is still moving.
+    FIRMWARE_POSITION,     // Position of the machine at rest.
+};
+
+// The dialect spoken by a particular machine firmware.
+struct Firmware {
+    const char *name;
+    const char *home;            // Homing command.
+    const char *motor_off;       // Switch off motors; NULL if not needed.
+    const char *probe;           // Harmless command to see if it is ready.
+    const char *boot_banner;     // Start of the line sent after reset.
+
+    const char *query_position;  // Command asking for the current position.
+    bool query_is_realtime;      // Query is answered right away, without 'ok'.
+    enum FirmwarePosition (*parse_position)(const char *line,
+                                            struct Vector *pos);
+
+    // Command to make the firmware report its position by itself now and
+    // then, and to stop that again; NULL if it can't. Otherwise, we poll
+    // with "query_position" if that is a real-time command.
+    const char *report_position;
+    const char *report_position_off;
+    bool position_shows_motion;  // Reports tell FIRMWARE_MOVING if so.
+
+    // Understands line numbers and checksums ("N<line> ...*<checksum>")
+    // and asks to resend lines that got corrupted.
+    bool line_numbers;
+
+    // Tells if the reply line acknowledges a command.
+    bool (*is_ack)(const char *line);
+
+    // Jog moves. "jog_command" is followed by the axes and the feedrate.
+    const char *jog_command;
+    bool jog_needs_feedrate;  // Feedrate needs to be given in each jog.
+    char jog_cancel;          // Real-time byte that stops jogging; 0: none.
+
+    // Command only acknowledged once all moves before it are done; NULL if
+    // the firmware has none.
+    const char *finish_moves;
+
+    // Stops the machine right away, bypassing queued commands; NULL if the
+    // firmware can't. "stop_flush" is sent once the machine came to rest, to
+    // get rid of commands still queued.
+    const char *quick_stop;
+    const char *stop_flush;
+
+    // Single byte commands the firmware handles as soon as they arrive, or
+    // NULL. Bytes >= 0x80 are always real-time commands then.
+    const char *realtime_commands;
+
+    int rx_buffer_size;  // Bytes the serial receive buffer holds; 0: unknown.
+};
+
+// Look up firmware by name (case insensitive). Returns NULL if unknown.
+const struct Firmware *FirmwareByName(const char *name);
+
+// The default firmware, if not given otherwise.
+const struct Firmware *FirmwareDefault(void);
+
+#endif  // FIRMWARE_H
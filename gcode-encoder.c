@@ -0,0 +1,121 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "gcode-encoder.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Feedrate changes below this fraction are not worth the bytes.
+static const float kFeedrateTolerance = 0.02;
+
+static const char kAxisLetter[NUM_AXIS] = {'X', 'Y', 'Z'};
+
+void GCodeEncoderInit(struct GCodeEncoder *encoder, int decimals) {
+    encoder->decimals = decimals;
+    encoder->scale = 1;
+    for (int i = 0; i < decimals; ++i) encoder->scale *= 10;
+    GCodeEncoderSetCommand(encoder, "G1", false);
+    encoder->moves = encoder->bytes = encoder->verbose_bytes = 0;
+}
+
+void GCodeEncoderSetCommand(struct GCodeEncoder *encoder, const char *command,
+                            bool always_feedrate) {
+    encoder->command = command;
+    encoder->always_feedrate = always_feedrate;
+    GCodeEncoderReset(encoder);
+}
+
+void GCodeEncoderReset(struct GCodeEncoder *encoder) {
+    encoder->known = false;
+}
+
+// Append integer without the help of printf().
+static char *AppendUnsigned(char *out, uint64_t value) {
+    char digits[24];
+    int n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    while (n) *out++ = digits[--n];
+    return out;
+}
+
+// Append fixed point "value" (in 1/scale) in its shortest form, i.e.
+// without trailing zeros after the decimal point.
+static char *AppendFixed(const struct GCodeEncoder *encoder, char *out,
+                         int64_t value) {
+    if (value < 0) {
+        *out++ = '-';
+        value = -value;
+    }
+    out = AppendUnsigned(out, value / encoder->scale);
+    int64_t fraction = value % encoder->scale;
+    if (fraction == 0) return out;
+    int digits = encoder->decimals;
+    while (fraction % 10 == 0) {
+        fraction /= 10;
+        --digits;
+    }
+    *out++ = '.';
+    char *end = out + digits;
+    for (char *d = end - 1; d >= out; --d) {
+        *d = '0' + fraction % 10;
+        fraction /= 10;
+    }
+    return end;
+}
+
+// Length of the number printed with "%.3f".
+static int VerboseNumberLength(float value) {
+    int len = (value < 0) ? 5 : 4;  // sign, '.' and three digits.
+    for (float v = fabsf(value); v >= 10; v /= 10) ++len;
+    return len + 1;
+}
+
+int GCodeEncodeMove(struct GCodeEncoder *encoder, const struct Vector *pos,
+                    float feedrate_mm_min, char *out, int len) {
+    const int command_len = strlen(encoder->command);
+    if (len < command_len + 80) return 0;  // Longest possible line.
+    char *p = out;
+    memcpy(p, encoder->command, command_len);
+    p += command_len;
+    bool any_axis = false;
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+        const int64_t value = llround((double)pos->axis[a] * encoder->scale);
+        if (encoder->known && value == encoder->last_axis[a]) continue;
+        *p++ = ' ';
+        *p++ = kAxisLetter[a];
+        p = AppendFixed(encoder, p, value);
+        encoder->last_axis[a] = value;
+        any_axis = true;
+    }
+    if (!any_axis) return 0;
+
+    int feedrate = lrintf(feedrate_mm_min);
+    if (feedrate < 1) feedrate = 1;
+    if (!encoder->known || encoder->always_feedrate ||
+        abs(feedrate - encoder->last_feedrate) >
+          encoder->last_feedrate * kFeedrateTolerance) {
+        *p++ = ' ';
+        *p++ = 'F';
+        p = AppendUnsigned(p, feedrate);
+        encoder->last_feedrate = feedrate;
+    }
+    *p++ = '\n';
+    *p = '\0';
+    encoder->known = true;
+
+    // "<command> X%.3f Y%.3f Z%.3f F%.3f\n"
+    encoder->verbose_bytes += command_len + 4 * 2 + 1;
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+        encoder->verbose_bytes += VerboseNumberLength(pos->axis[a]);
+    }
+    encoder->verbose_bytes += VerboseNumberLength(feedrate_mm_min);
+    encoder->moves++;
+    encoder->bytes += p - out;
+    return p - out;
+}
@@ -0,0 +1,50 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef GCODE_ENCODER_H
+#define GCODE_ENCODER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "machine-jog.h"
+
+// Creates compact G1 moves: axes and feedrate are modal in G-code, so we
+// leave out whatever did not change since the last move, and numbers are
+// printed in their shortest form at the configured resolution.
+struct GCodeEncoder {
+    int decimals;  // Digits after the decimal point.
+    int64_t scale;  // 10^decimals
+    const char *command;   // Command starting each move, "G1" by default.
+    bool always_feedrate;  // Feedrate is not modal with this command.
+
+    // Modal state: what the machine has seen last.
+    bool known;  // false if we can't rely on the modal state.
+    int64_t last_axis[NUM_AXIS];  // in 1/scale mm.
+    int last_feedrate;            // in mm/min.
+
+    // Statistics.
+    uint64_t moves;
+    uint64_t bytes;          // Bytes emitted.
+    uint64_t verbose_bytes;  // Bytes a move with all values would've taken.
+};
+
+void GCodeEncoderInit(struct GCodeEncoder *encoder, int decimals);
+
+// Use "command" instead of G1 for moves, e.g. a jog command. If
+// "always_feedrate" is set, the feedrate is emitted with each move.
+void GCodeEncoderSetCommand(struct GCodeEncoder *encoder, const char *command,
+                            bool always_feedrate);
+
+// Forget modal state. Needs to be called whenever the machine has been
+// moved by other means, e.g. homing.
+void GCodeEncoderReset(struct GCodeEncoder *encoder);
+
+// Encode a move to "pos" with "feedrate_mm_min" into "out" (including
+// newline, nul-terminated). Returns length or 0 if there is nothing to move
+// at the given resolution.
+int GCodeEncodeMove(struct GCodeEncoder *encoder, const struct Vector *pos,
+                    float feedrate_mm_min, char *out, int len);
+
+#endif  // GCODE_ENCODER_H
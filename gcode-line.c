@@ -0,0 +1,32 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "gcode-line.h"
+
+#include <ctype.h>
+#include <stdbool.h>
+
+int GCodeStripComments(const char *line, int len, char *out) {
+    int result = 0;  // Never more than read so far, so "out" can be "line".
+    bool in_comment = false;
+    for (int i = 0; i < len; ++i) {
+        const char c = line[i];
+        if (in_comment) {
+            in_comment = (c != ')');
+            continue;
+        }
+        if (c == ';') break;
+        if (c == '(') {
+            in_comment = true;  // An unclosed one goes to the end of line.
+            continue;
+        }
+        if (isspace((unsigned char)c) &&
+            (result == 0 || isspace((unsigned char)out[result - 1]))) {
+            continue;
+        }
+        out[result++] = c;
+    }
+    while (result > 0 && isspace((unsigned char)out[result - 1])) --result;
+    return result;
+}
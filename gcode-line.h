@@ -0,0 +1,16 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef GCODE_LINE_H
+#define GCODE_LINE_H
+
+// Reduce a line of G-code (without newline) of "len" bytes to what the
+// machine needs to see: comments, from ';' to the end of the line as well
+// as "( ... )" anywhere, are removed; so are blanks at either end and runs
+// of them. Firmware built without support for parenthesized comments
+// misreads them. The result is written to "out", which needs room for "len"
+// bytes and may be "line" itself. Returns its length; 0 if nothing is left.
+int GCodeStripComments(const char *line, int len, char *out);
+
+#endif  // GCODE_LINE_H
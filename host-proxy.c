@@ -0,0 +1,235 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "host-proxy.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "event-loop.h"
+#include "firmware.h"
+#include "gcode-line.h"
+#include "machine-link.h"
+#include "machine-port.h"
+
+#define HOST_OWNER       1  // Owner of the host commands in the MachineLink.
+#define HOST_BUFFER_SIZE 4096
+
+struct HostProxy {
+    struct MachineLink *link;
+    const struct Firmware *firmware;
+    struct EventLoop *loop;
+
+    int listen_fd;     // Socket accepting the host; -1 with a pty.
+    int host_fd;       // Connected host or pty master; -1 if none.
+    int pty_slave_fd;  // Kept open, so that the master survives host closes.
+    char *path;        // Socket or symbolic link to remove at the end.
+
+    char buffer[HOST_BUFFER_SIZE];  // Incomplete line received from host.
+    int buffer_len;
+    uint64_t command_count;
+};
+
+static void SetNonBlocking(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Replies for the host (and everything the machine sends unsolicited).
+static void OnMachineReply(int owner, const char *line, void *user_data) {
+    struct HostProxy *proxy = (struct HostProxy *)user_data;
+    if (proxy->host_fd < 0) return;
+    if (owner != HOST_OWNER && owner != MACHINE_LINK_UNSOLICITED) return;
+    struct iovec iov[2];
+    iov[0].iov_base = (void *)line;
+    iov[0].iov_len = strlen(line);
+    iov[1].iov_base = (void *)"\n";
+    iov[1].iov_len = 1;
+    // If the host doesn't read its replies, we don't wait for it.
+    if (writev(proxy->host_fd, iov, 2) < 0 && errno != EAGAIN) {
+        perror("Writing to host");
+    }
+}
+
+static bool IsRealtime(const struct Firmware *firmware, char c) {
+    if (firmware->realtime_commands == NULL || c == '\0') return false;
+    return (unsigned char)c >= 0x80 ||
+           strchr(firmware->realtime_commands, c) != NULL;
+}
+
+// Forward a line (without newline) of the host to the machine, unless there
+// is nothing in it the machine would acknowledge. Comments, ';' as well as
+// "( ... )", blanks and the line number and checksum the host might have
+// added are left out:
+// numbering lines on the link to the machine is up to us (-N).
+static void ForwardLine(struct HostProxy *proxy, char *line, int len) {
+    len = GCodeStripComments(line, len, line);
+    int start = 0;
+    if (len > 1 && (line[0] == 'N' || line[0] == 'n') &&
+        isdigit((unsigned char)line[1])) {
+        start = 1;
+        while (start < len && isdigit((unsigned char)line[start])) ++start;
+        while (start < len && (line[start] == ' ' || line[start] == '\t')) {
+            ++start;
+        }
+    }
+    int end = start;
+    while (end < len && line[end] != '*') ++end;
+    while (end > start && isspace((unsigned char)line[end - 1])) --end;
+    if (end == start) return;
+    line[end] = '\n';  // Replaces what we cut off, the newline or slack.
+    MachineLinkSendFor(proxy->link, HOST_OWNER, line + start, end - start + 1);
+    proxy->command_count++;
+}
+
+static void CloseHost(struct HostProxy *proxy) {
+    if (proxy->loop) EventLoopRemoveFd(proxy->loop, proxy->host_fd);
+    close(proxy->host_fd);
+    proxy->host_fd = -1;
+    proxy->buffer_len = 0;
+}
+
+static void OnHostReadable(void *user_data) {
+    struct HostProxy *proxy = (struct HostProxy *)user_data;
+    // Leave one byte of slack to append a newline to an overlong line.
+    const int r = read(proxy->host_fd, proxy->buffer + proxy->buffer_len,
+                       HOST_BUFFER_SIZE - 1 - proxy->buffer_len);
+    if (r < 0 && (errno == EAGAIN || errno == EINTR)) return;
+    if (r <= 0) {
+        if (proxy->listen_fd >= 0) CloseHost(proxy);  // Host disconnected.
+        return;
+    }
+    char *const buffer = proxy->buffer;
+    int end = proxy->buffer_len + r;
+    int start = 0;
+    for (int i = proxy->buffer_len; i < end; ++i) {
+        if (IsRealtime(proxy->firmware, buffer[i])) {
+            // Real-time commands can show up anywhere, even within a line.
+            MachineLinkSendRealtime(proxy->link, buffer + i, 1);
+            memmove(buffer + i, buffer + i + 1, end - i - 1);
+            --end;
+            --i;
+            continue;
+        }
+        if (buffer[i] == '\n') {
+            ForwardLine(proxy, buffer + start, i - start);
+            start = i + 1;
+        }
+    }
+    if (start == 0 && end == HOST_BUFFER_SIZE - 1) {
+        ForwardLine(proxy, buffer, end);  // No newline in sight.
+        start = end;
+    }
+    memmove(buffer, buffer + start, end - start);
+    proxy->buffer_len = end - start;
+}
+
+static void OnHostConnect(void *user_data) {
+    struct HostProxy *proxy = (struct HostProxy *)user_data;
+    const int fd = accept(proxy->listen_fd, NULL, NULL);
+    if (fd < 0) return;
+    if (proxy->host_fd >= 0) CloseHost(proxy);  // Newest host wins.
+    SetNonBlocking(fd);
+    proxy->host_fd = fd;
+    if (!EventLoopAddFd(proxy->loop, fd, &OnHostReadable, proxy)) {
+        CloseHost(proxy);
+    }
+}
+
+static bool ListenUnixSocket(struct HostProxy *proxy, const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) unlink(path);
+    proxy->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (proxy->listen_fd < 0 ||
+        bind(proxy->listen_fd, (struct sockaddr *)&address,
+             sizeof(address)) < 0 ||
+        listen(proxy->listen_fd, 1) < 0) {
+        perror(path);
+        return false;
+    }
+    return true;
+}
+
+static bool OpenPseudoTerminal(struct HostProxy *proxy, const char *path) {
+    proxy->host_fd = CreatePseudoTerminal(path, &proxy->pty_slave_fd);
+    if (proxy->host_fd < 0) return false;
+    fprintf(stderr, "Host connection on %s\n", path);
+    return true;
+}
+
+struct HostProxy *new_HostProxy(const char *spec, struct MachineLink *link,
+                                const struct Firmware *firmware) {
+    struct HostProxy *proxy =
+      (struct HostProxy *)calloc(1, sizeof(struct HostProxy));
+    proxy->link = link;
+    proxy->firmware = firmware;
+    proxy->listen_fd = proxy->host_fd = proxy->pty_slave_fd = -1;
+    bool success = false;
+    if (strncmp(spec, "unix:", 5) == 0) {
+        proxy->path = strdup(spec + 5);
+        success = ListenUnixSocket(proxy, proxy->path);
+    } else if (strncmp(spec, "pty:", 4) == 0) {
+        proxy->path = strdup(spec + 4);
+        success = OpenPseudoTerminal(proxy, proxy->path);
+    } else {
+        fprintf(stderr, "Expected unix:<path> or pty:<path>, got %s\n", spec);
+    }
+    if (!success) {
+        delete_HostProxy(&proxy);
+        return NULL;
+    }
+    MachineLinkSetReplyHandler(link, &OnMachineReply, proxy);
+    return proxy;
+}
+
+void delete_HostProxy(struct HostProxy **proxy) {
+    struct HostProxy *p = *proxy;
+    MachineLinkSetReplyHandler(p->link, NULL, NULL);
+    if (p->host_fd >= 0) close(p->host_fd);
+    if (p->pty_slave_fd >= 0) close(p->pty_slave_fd);
+    if (p->listen_fd >= 0) close(p->listen_fd);
+    if (p->path) {
+        unlink(p->path);
+        free(p->path);
+    }
+    free(p);
+    *proxy = NULL;
+}
+
+bool HostProxyAttach(struct HostProxy *proxy, struct EventLoop *loop) {
+    proxy->loop = loop;
+    if (proxy->listen_fd >= 0) {
+        return EventLoopAddFd(loop, proxy->listen_fd, &OnHostConnect, proxy);
+    }
+    return EventLoopAddFd(loop, proxy->host_fd, &OnHostReadable, proxy);
+}
+
+void HostProxyDetach(struct HostProxy *proxy) {
+    if (proxy->loop == NULL) return;
+    if (proxy->listen_fd >= 0) {
+        EventLoopRemoveFd(proxy->loop, proxy->listen_fd);
+    }
+    if (proxy->host_fd >= 0) EventLoopRemoveFd(proxy->loop, proxy->host_fd);
+    proxy->loop = NULL;
+}
+
+uint64_t HostProxyCommandCount(const struct HostProxy *proxy) {
+    return proxy->command_count;
+}
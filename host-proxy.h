@@ -0,0 +1,39 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef HOST_PROXY_H
+#define HOST_PROXY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct EventLoop;
+struct Firmware;
+struct MachineLink;
+
+// Lets a host program (e.g. a print server) share our connection to the
+// machine. Its commands are interleaved with the jog moves; replies go back
+// to whoever sent the command.
+struct HostProxy;
+
+// Create a proxy for "link". The "spec" is either
+//   unix:<path>  : Unix domain socket the host connects to.
+//   pty:<path>   : pseudo terminal; <path> is a symbolic link to it, so that
+//                  the host can open it like a serial line.
+// Returns NULL on failure.
+struct HostProxy *new_HostProxy(const char *spec, struct MachineLink *link,
+                                const struct Firmware *firmware);
+void delete_HostProxy(struct HostProxy **proxy);
+
+// Serve the host from the given event loop.
+bool HostProxyAttach(struct HostProxy *proxy, struct EventLoop *loop);
+
+// Stop serving the host from the event loop it is attached to.
+void HostProxyDetach(struct HostProxy *proxy);
+
+// Number of commands forwarded from the host so far. If this changed, the
+// host might have moved the machine or changed its modal state.
+uint64_t HostProxyCommandCount(const struct HostProxy *proxy);
+
+#endif  // HOST_PROXY_H
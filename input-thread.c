@@ -0,0 +1,109 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "input-thread.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "joystick-input.h"
+#include "realtime.h"
+#include "spsc-ring.h"
+
+#define EVENT_QUEUE_SIZE 1024
+
+struct InputThread {
+    struct JoystickInput *js;
+    struct SpscRing *events;
+    pthread_t thread;
+    int stop_fd;  // Readable when we're asked to stop.
+
+    atomic_bool ended;  // Joystick gone; set after the last event is queued.
+    atomic_uint_fast64_t dropped;
+    uint64_t queue_dropped;  // Only used by the thread.
+};
+
+static void *ReadLoop(void *user_data) {
+    struct InputThread *t = (struct InputThread *)user_data;
+    struct pollfd fds[2] = {
+        {.fd = JoystickInputFd(t->js), .events = POLLIN},
+        {.fd = t->stop_fd, .events = POLLIN},
+    };
+    struct JoystickEvent events[64];
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) continue;  // EINTR
+        if (fds[1].revents) break;
+        int count;
+        while ((count = JoystickInputRead(t->js, events, 64)) > 0) {
+            for (int i = 0; i < count; ++i) {
+                if (!SpscRingPush(t->events, &events[i])) t->queue_dropped++;
+            }
+        }
+        atomic_store(&t->dropped,
+                     JoystickInputDropped(t->js) + t->queue_dropped);
+        if (count < 0) break;
+    }
+    atomic_store_explicit(&t->ended, true, memory_order_release);
+    SpscRingWakeConsumer(t->events);
+    return NULL;
+}
+
+struct InputThread *new_InputThread(struct JoystickInput *js) {
+    struct InputThread *t =
+      (struct InputThread *)calloc(1, sizeof(struct InputThread));
+    t->js = js;
+    atomic_init(&t->ended, false);
+    atomic_init(&t->dropped, 0);
+    t->events = new_SpscRing(EVENT_QUEUE_SIZE, sizeof(struct JoystickEvent));
+    t->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (t->events == NULL || t->stop_fd < 0 ||
+        RealtimeCreateThread(&t->thread, &ReadLoop, t) != 0) {
+        perror("Starting input thread");
+        if (t->events) delete_SpscRing(&t->events);
+        if (t->stop_fd >= 0) close(t->stop_fd);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void delete_InputThread(struct InputThread **thread) {
+    struct InputThread *t = *thread;
+    const uint64_t one = 1;
+    if (write(t->stop_fd, &one, sizeof(one)) == sizeof(one)) {
+        pthread_join(t->thread, NULL);
+    }
+    close(t->stop_fd);
+    delete_SpscRing(&t->events);
+    free(t);
+    *thread = NULL;
+}
+
+int InputThreadFd(const struct InputThread *thread) {
+    return SpscRingFd(thread->events);
+}
+
+int InputThreadRead(struct InputThread *thread, struct JoystickEvent *events,
+                    int max) {
+    // Check before emptying the queue, so that we don't miss the last
+    // events queued before the end.
+    const bool ended =
+      atomic_load_explicit(&thread->ended, memory_order_acquire);
+    SpscRingClearWakeup(thread->events);
+    int count = 0;
+    while (count < max && SpscRingPop(thread->events, &events[count])) {
+        ++count;
+    }
+    return (count == 0 && ended) ? -1 : count;
+}
+
+uint64_t InputThreadDropped(const struct InputThread *thread) {
+    return atomic_load(&((struct InputThread *)thread)->dropped);
+}
@@ -0,0 +1,33 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef INPUT_THREAD_H
+#define INPUT_THREAD_H
+
+#include <stdint.h>
+
+struct JoystickEvent;
+struct JoystickInput;
+
+// Reads joystick events on a thread of its own, so that they are picked up
+// (and recorded) right away, even if the thread using them is busy.
+struct InputThread;
+
+// Start reading from "js", which must not be read by anyone else from now
+// on. Returns NULL on failure.
+struct InputThread *new_InputThread(struct JoystickInput *js);
+void delete_InputThread(struct InputThread **thread);
+
+// Readable when events are available.
+int InputThreadFd(const struct InputThread *thread);
+
+// Like JoystickInputRead(): fetch up to "max" events without blocking.
+// Returns the number of events or -1 once the joystick is gone.
+int InputThreadRead(struct InputThread *thread, struct JoystickEvent *events,
+                    int max);
+
+// Events lost, as the kernel or our queue ran over.
+uint64_t InputThreadDropped(const struct InputThread *thread);
+
+#endif  // INPUT_THREAD_H
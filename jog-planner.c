@@ -0,0 +1,109 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "jog-planner.h"
+
+#include <math.h>
+#include <string.h>
+
+void JogPlannerInit(struct JogPlanner *planner, const struct Vector *accel,
+                    const struct Vector *jerk) {
+    memset(planner, 0, sizeof(*planner));
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+        planner->max_accel[a] = accel->axis[a];
+        planner->max_jerk[a] = jerk->axis[a];
+    }
+}
+
+bool JogPlannerEnabled(const struct JogPlanner *planner) {
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+        if (planner->max_accel[a] > 0) return true;
+    }
+    return false;
+}
+
+void JogPlannerReset(struct JogPlanner *planner) {
+    memset(planner->velocity, 0, sizeof(planner->velocity));
+    memset(planner->accel, 0, sizeof(planner->accel));
+    memset(planner->at_limit, 0, sizeof(planner->at_limit));
+}
+
+static float Clamp(float value, float min, float max) {
+    if (value < min) return min;
+    if (value > max) return max;
+    return value;
+}
+
+// Highest speed in the given direction from which we can still stop
+// before reaching the limit.
+static float MaxSpeedBeforeLimit(float distance_to_limit, float max_accel,
+                                 float max_jerk, float current_speed,
+                                 float dt) {
+    // We only react at the next step and it takes a while until the
+    // braking acceleration is reached, so account for travel until then.
+    float reaction_time = dt;
+    if (max_jerk > 0) reaction_time += max_accel / max_jerk;
+    const float distance =
+      distance_to_limit - fabsf(current_speed) * reaction_time;
+    if (distance <= 0) return 0;
+    return sqrtf(2 * max_accel * distance);
+}
+
+// Advance one axis; returns the distance travelled.
+static float StepAxis(struct JogPlanner *planner, int a, float target,
+                      float pos, float limit, float dt) {
+    const float max_accel = planner->max_accel[a];
+    float *const v = &planner->velocity[a];
+    float *const acc = &planner->accel[a];
+    if (max_accel <= 0) {  // Not limited.
+        *v = target;
+        *acc = 0;
+        return target * dt;
+    }
+
+    const float max_jerk = planner->max_jerk[a];
+    const float requested = target;
+    target =
+      Clamp(target, -MaxSpeedBeforeLimit(pos, max_accel, max_jerk, *v, dt),
+            MaxSpeedBeforeLimit(limit - pos, max_accel, max_jerk, *v, dt));
+    planner->at_limit[a] = (target != requested);
+
+    const float dv = target - *v;
+    float wanted_accel;
+    if (max_jerk > 0) {
+        // Acceleration from which we can ramp down to zero just when
+        // reaching the target velocity.
+        wanted_accel = copysignf(sqrtf(2 * max_jerk * fabsf(dv)), dv);
+        wanted_accel = Clamp(wanted_accel, -max_accel, max_accel);
+        const float max_change = max_jerk * dt;
+        *acc += Clamp(wanted_accel - *acc, -max_change, max_change);
+    } else {
+        *acc = Clamp(dv / dt, -max_accel, max_accel);
+    }
+
+    const float v_before = *v;
+    *v += *acc * dt;
+    if ((dv >= 0 && *v >= target) || (dv <= 0 && *v <= target)) {
+        *v = target;  // Reached; don't overshoot.
+        *acc = 0;
+    }
+    const float travel = (v_before + *v) / 2 * dt;
+    if (pos + travel <= 0 || pos + travel >= limit) {
+        *v = *acc = 0;  // Ran into limit nevertheless.
+    }
+    return travel;
+}
+
+bool JogPlannerStep(struct JogPlanner *planner, const struct Vector *target,
+                    const struct Vector *pos, const struct Vector *limit,
+                    float dt, struct Vector *travel) {
+    bool reached_limit = false;
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+        const bool was_at_limit = planner->at_limit[a];
+        travel->axis[a] = StepAxis(planner, a, target->axis[a], pos->axis[a],
+                                   limit->axis[a], dt);
+        reached_limit |= planner->at_limit[a] && !was_at_limit;
+    }
+    return reached_limit;
+}
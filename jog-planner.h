@@ -0,0 +1,42 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef JOG_PLANNER_H
+#define JOG_PLANNER_H
+
+#include <stdbool.h>
+
+#include "machine-jog.h"
+
+// Ramps the velocity requested by the joystick with per-axis acceleration
+// and jerk limits, so that the machine never gets steps it has to brake
+// hard on. Also slows down ahead of the machine limits instead of running
+// into them at full speed.
+struct JogPlanner {
+    float max_accel[NUM_AXIS];  // mm/s^2; 0 disables the planner.
+    float max_jerk[NUM_AXIS];   // mm/s^3; 0 for unlimited jerk.
+
+    float velocity[NUM_AXIS];  // Currently commanded velocity in mm/s.
+    float accel[NUM_AXIS];     // Current acceleration in mm/s^2.
+    bool at_limit[NUM_AXIS];   // Slowed down by the machine limit.
+};
+
+void JogPlannerInit(struct JogPlanner *planner, const struct Vector *accel,
+                    const struct Vector *jerk);
+
+// Returns true if there are acceleration limits configured.
+bool JogPlannerEnabled(const struct JogPlanner *planner);
+
+// Stop immediately, e.g. after the position has been set otherwise.
+void JogPlannerReset(struct JogPlanner *planner);
+
+// Move the commanded velocity towards "target" (mm/s) for a time step of
+// "dt" seconds, starting at "pos" within the machine "limit".
+// Stores the resulting movement in "travel". Returns true if the machine
+// limit started to slow down an axis in this step.
+bool JogPlannerStep(struct JogPlanner *planner, const struct Vector *target,
+                    const struct Vector *pos, const struct Vector *limit,
+                    float dt, struct Vector *travel);
+
+#endif  // JOG_PLANNER_H
@@ -37,6 +37,10 @@ void WriteConfig(const char *config_dir, const char *js_name,
                 config->axis_config[i].zero, config->axis_config[i].max_value);
     }
     fprintf(out, "B:%d\n", config->home_button);
+    if (config->stop_button >= 0) fprintf(out, "S:%d\n", config->stop_button);
+    if (config->shift_button >= 0) {
+        fprintf(out, "K:%d\n", config->shift_button);
+    }
     fclose(out);
 }
 
@@ -56,20 +60,22 @@ int ReadConfig(const char *config_dir, const char *js_name,
         }
     }
     if (1 != fscanf(in, "B:%d\n", &config->home_button)) return 0;
+    // Older configurations don't have a stop button.
+    if (1 != fscanf(in, "S:%d\n", &config->stop_button))
+        config->stop_button = -1;
+    if (1 != fscanf(in, "K:%d\n", &config->shift_button))
+        config->shift_button = -1;
     fclose(in);
     return 1;
 }
 
-static int64_t GetMillis() {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (int64_t)tv.tv_sec * 1000LL + tv.tv_usec / 1000;
-}
+static int64_t GetMillis() { return JoystickInputNowUsec() / 1000; }
 
-static void FindLargestAxis(int js_fd, struct AxisConfig *axis_config) {
-    struct js_event e;
+static void FindLargestAxis(struct JoystickInput *js,
+                            struct AxisConfig *axis_config) {
+    struct JoystickEvent e;
     for (;;) {
-        if (JoystickWaitForEvent(js_fd, &e, 1000) <= 0) continue;
+        if (JoystickWaitForEvent(js, &e, 1000) <= 0) continue;
         if (e.type == JS_EVENT_AXIS && abs(e.value) > 32000) {
             axis_config->channel = e.number;
             axis_config->max_value = (e.value < 0 ? -1 : 1) * 32767;
@@ -78,11 +84,12 @@ static void FindLargestAxis(int js_fd, struct AxisConfig *axis_config) {
     }
 }
 
-static void WaitForReleaseAxis(int js_fd, int channel, int *zero) {
+static void WaitForReleaseAxis(struct JoystickInput *js, int channel,
+                               int *zero) {
     int zero_value = 1 << 17;
-    struct js_event e;
+    struct JoystickEvent e;
     for (;;) {
-        if (JoystickWaitForEvent(js_fd, &e, 1000) <= 0) continue;
+        if (JoystickWaitForEvent(js, &e, 1000) <= 0) continue;
         if (e.type == JS_EVENT_AXIS && e.number == channel &&
             abs(e.value) < 5000) {
             zero_value = e.value;
@@ -93,7 +100,7 @@ static void WaitForReleaseAxis(int js_fd, int channel, int *zero) {
     // is the 'zero' position.
     const int64_t end_time = GetMillis() + 100;
     while (GetMillis() < end_time) {
-        if (JoystickWaitForEvent(js_fd, &e, 100) <= 0) continue;
+        if (JoystickWaitForEvent(js, &e, 100) <= 0) continue;
         if (e.type == JS_EVENT_AXIS && e.number == channel) {
             zero_value = e.value;
         }
@@ -101,10 +108,11 @@ static void WaitForReleaseAxis(int js_fd, int channel, int *zero) {
     *zero = zero_value;
 }
 
-static void WaitAnyButtonPress(int js_fd, int *button_channel) {
-    struct js_event e;
+static void WaitAnyButtonPress(struct JoystickInput *js,
+                               int *button_channel) {
+    struct JoystickEvent e;
     for (;;) {
-        if (JoystickWaitForEvent(js_fd, &e, 1000) <= 0) continue;
+        if (JoystickWaitForEvent(js, &e, 1000) <= 0) continue;
         if (e.type == JS_EVENT_BUTTON && e.value > 0) {
             *button_channel = e.number;
             return;
@@ -112,42 +120,56 @@ static void WaitAnyButtonPress(int js_fd, int *button_channel) {
     }
 }
 
-static void WaitForButtonRelease(int js_fd, int channel) {
-    struct js_event e;
+static void WaitForButtonRelease(struct JoystickInput *js, int channel) {
+    struct JoystickEvent e;
     for (;;) {
-        if (JoystickWaitForEvent(js_fd, &e, 1000) <= 0) continue;
+        if (JoystickWaitForEvent(js, &e, 1000) <= 0) continue;
         if (e.type == JS_EVENT_BUTTON && e.number == channel && e.value == 0)
             return;
     }
 }
 
-static void GetAxisConfig(int js_fd, const char *msg,
+static void GetAxisConfig(struct JoystickInput *js, const char *msg,
                           struct AxisConfig *axis_config) {
     fprintf(stderr, "%s", msg);
     fflush(stderr);
-    FindLargestAxis(js_fd, axis_config);
+    FindLargestAxis(js, axis_config);
     fprintf(stderr, "Thanks. Move back to center.\n");
-    WaitForReleaseAxis(js_fd, axis_config->channel, &axis_config->zero);
+    WaitForReleaseAxis(js, axis_config->channel, &axis_config->zero);
 }
 
-static void GetButtonConfig(int js_fd, const char *msg, int *channel) {
+static void GetButtonConfig(struct JoystickInput *js, const char *msg,
+                            int *channel) {
     fprintf(stderr, "%s", msg);
     fflush(stderr);
-    WaitAnyButtonPress(js_fd, channel);
+    WaitAnyButtonPress(js, channel);
     fprintf(stderr, "Thanks. Now release.");
     fflush(stderr);
-    WaitForButtonRelease(js_fd, *channel);
+    WaitForButtonRelease(js, *channel);
     fprintf(stderr, "\n");
 }
 
 // Create configuration
-int CreateConfig(int js_fd, struct Configuration *config) {
-    GetAxisConfig(js_fd, "Move X all the way to the right ->  ",
+int CreateConfig(struct JoystickInput *js, struct Configuration *config) {
+    GetAxisConfig(js, "Move X all the way to the right ->  ",
                   &config->axis_config[AXIS_X]);
-    GetAxisConfig(js_fd, "Move Y all the way up            ^  ",
+    GetAxisConfig(js, "Move Y all the way up            ^  ",
                   &config->axis_config[AXIS_Y]);
-    GetAxisConfig(js_fd, "Move Z all the way up            ^  ",
+    GetAxisConfig(js, "Move Z all the way up            ^  ",
                   &config->axis_config[AXIS_Z]);
-    GetButtonConfig(js_fd, "Press HOME button.", &config->home_button);
+    GetButtonConfig(js, "Press HOME button.", &config->home_button);
+    for (;;) {
+        GetButtonConfig(js, "Press STOP button.", &config->stop_button);
+        if (config->stop_button != config->home_button) break;
+        fprintf(stderr, "That is the HOME button. Choose another one.\n");
+    }
+    GetButtonConfig(js,
+                    "Press SHIFT button to switch banks of saved points "
+                    "(HOME: none).",
+                    &config->shift_button);
+    if (config->shift_button == config->home_button ||
+        config->shift_button == config->stop_button) {
+        config->shift_button = -1;
+    }
     return 1;
 }
@@ -2,6 +2,7 @@
  * (c) 2014 Henner Zeller <h.zeller@acm.org>
  */
 
+#include "joystick-input.h"
 #include "machine-jog.h"
 
 struct AxisConfig {
@@ -13,11 +14,14 @@ struct AxisConfig {
 struct Configuration {
     struct AxisConfig axis_config[NUM_AXIS];
     int home_button;     // id of the home button.
+    int stop_button;     // id of the stop button; -1 if there is none.
+    int shift_button;    // id of the button switching banks of saved
+                         // points; -1 if there is none.
     int highest_button;  // highest button found.
 };
 
 // Interactively create a configuration
-int CreateConfig(int js_fd, struct Configuration *config);
+int CreateConfig(struct JoystickInput *js, struct Configuration *config);
 
 // Write configuration to file.
 void WriteConfig(const char *config_dir, const char *js_name,
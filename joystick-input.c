@@ -0,0 +1,558 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "joystick-input.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <linux/joystick.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_PENDING_EVENTS 512
+#define READ_BATCH         64
+#define UNMAPPED           0xff
+#define REPLAY_TAIL_USEC   500000  // Time after the last event of a trace.
+
+#define BITS_PER_LONG      (8 * sizeof(unsigned long))
+#define BIT_ARRAY_LEN(n)   (((n) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define TEST_BIT(b, array) \
+    (((array)[(b) / BITS_PER_LONG] >> ((b) % BITS_PER_LONG)) & 1)
+
+// Scaling of an absolute axis to the -32767..32767 range. Same as the
+// default correction joydev applies, so that configurations created with
+// the joystick API stay valid.
+struct AxisCorrection {
+    bool enabled;
+    int coef[4];
+};
+
+struct JoystickInput {
+    int fd;
+    int event_fd;  // Same as fd for the event backend.
+    bool is_evdev;
+    bool monotonic_timestamps;
+
+    // Mapping of event codes to joystick API axis and button numbers.
+    uint8_t abs_map[ABS_CNT];
+    uint8_t key_map[KEY_CNT];
+    struct AxisCorrection correction[ABS_CNT];
+
+    // Events not handed out yet: the initial state and leftovers from
+    // JoystickWaitForEvent().
+    struct JoystickEvent pending[MAX_PENDING_EVENTS];
+    int pending_start;
+    int pending_count;
+    uint64_t dropped;  // Times the kernel dropped events.
+
+    // Replaying a trace: "fd" is a timer firing at the next event.
+    bool is_replay;
+    struct JoystickEvent *trace;  // Times relative to the start.
+    int trace_len;
+    int trace_pos;
+    int64_t trace_start_usec;
+    bool trace_running;  // Before, only the initial state is handed out.
+    char trace_name[256];
+
+    // Recording all events handed out.
+    FILE *record;
+    int64_t record_start_usec;
+};
+
+int64_t JoystickInputNowUsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int JoystickFindEventDevice(int js_id, char *event_path, size_t len) {
+    // Finding the associated input event requires to go through some
+    // hoops.
+    char sys_path[512];
+    snprintf(sys_path, sizeof(sys_path), "/sys/class/input/js%d/device/",
+             js_id);
+
+    int ev_id = -1;
+    struct dirent *entry;
+    DIR *const dir = opendir(sys_path);
+    while (dir && (entry = readdir(dir)) != NULL) {
+        if (sscanf(entry->d_name, "event%d", &ev_id) == 1) break;
+    }
+    if (dir) closedir(dir);
+    if (ev_id < 0) return 0;
+    snprintf(event_path, len, "/dev/input/event%d", ev_id);
+    return 1;
+}
+
+#define MAX_JOYSTICKS 32  // We look at /dev/input/js0 .. js31.
+
+static bool NameMatches(const char *name, const char *spec) {
+    const size_t spec_len = strlen(spec);
+    for (; *name; ++name) {
+        if (strncasecmp(name, spec, spec_len) == 0) return true;
+    }
+    return spec_len == 0;
+}
+
+int JoystickFindDevice(const char *spec, char *path, size_t len) {
+    if (spec && strchr(spec, '/')) {
+        snprintf(path, len, "%s", spec);
+        return access(path, F_OK) == 0;
+    }
+    for (int js_id = 0; js_id < MAX_JOYSTICKS; ++js_id) {
+        char sys_path[512];
+        snprintf(sys_path, sizeof(sys_path),
+                 "/sys/class/input/js%d/device/name", js_id);
+        FILE *in = fopen(sys_path, "r");
+        if (in == NULL) continue;
+        char name[256] = "";
+        const bool have_name = fgets(name, sizeof(name), in) != NULL;
+        fclose(in);
+        if (spec) {
+            name[strcspn(name, "\n")] = '\0';
+            if (!have_name || !NameMatches(name, spec)) continue;
+        }
+        if (!JoystickFindEventDevice(js_id, path, len))
+            snprintf(path, len, "/dev/input/js%d", js_id);
+        return access(path, F_OK) == 0;
+    }
+    return 0;
+}
+
+static void PushPending(struct JoystickInput *input,
+                        const struct JoystickEvent *e) {
+    if (input->pending_count == MAX_PENDING_EVENTS) return;
+    const int pos =
+      (input->pending_start + input->pending_count) % MAX_PENDING_EVENTS;
+    input->pending[pos] = *e;
+    input->pending_count++;
+}
+
+static int PopPending(struct JoystickInput *input, struct JoystickEvent *events,
+                      int max) {
+    int count = 0;
+    while (input->pending_count > 0 && count < max) {
+        events[count++] = input->pending[input->pending_start];
+        input->pending_start = (input->pending_start + 1) % MAX_PENDING_EVENTS;
+        input->pending_count--;
+    }
+    return count;
+}
+
+static int CorrectAxis(const struct AxisCorrection *corr, int value) {
+    if (!corr->enabled) return value;
+    if (value > corr->coef[0]) {
+        value = (value < corr->coef[1])
+                  ? 0
+                  : ((corr->coef[3] * (value - corr->coef[1])) >> 14);
+    } else {
+        value = (corr->coef[2] * (value - corr->coef[0])) >> 14;
+    }
+    if (value < -32767) return -32767;
+    if (value > 32767) return 32767;
+    return value;
+}
+
+// Build the same numbering of axes and buttons as joydev does.
+static void CreateEventMapping(struct JoystickInput *input) {
+    unsigned long abs_bits[BIT_ARRAY_LEN(ABS_CNT)];
+    unsigned long key_bits[BIT_ARRAY_LEN(KEY_CNT)];
+    memset(abs_bits, 0, sizeof(abs_bits));
+    memset(key_bits, 0, sizeof(key_bits));
+    ioctl(input->fd, EVIOCGBIT(EV_ABS, sizeof(abs_bits)), abs_bits);
+    ioctl(input->fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits);
+    memset(input->abs_map, UNMAPPED, sizeof(input->abs_map));
+    memset(input->key_map, UNMAPPED, sizeof(input->key_map));
+
+    int num_axes = 0;
+    for (int code = 0; code < ABS_CNT && num_axes < UNMAPPED; ++code) {
+        if (!TEST_BIT(code, abs_bits)) continue;
+        input->abs_map[code] = num_axes++;
+        struct input_absinfo info;
+        if (ioctl(input->fd, EVIOCGABS(code), &info) < 0) continue;
+        if (info.maximum == info.minimum) continue;
+        struct AxisCorrection *corr = &input->correction[code];
+        int t = (info.maximum + info.minimum) / 2;
+        corr->coef[0] = t - info.flat;
+        corr->coef[1] = t + info.flat;
+        t = (info.maximum - info.minimum) / 2 - 2 * info.flat;
+        if (t) {
+            corr->coef[2] = corr->coef[3] = (1 << 29) / t;
+        }
+        corr->enabled = true;
+    }
+
+    // Joystick buttons first, then the misc buttons.
+    int num_buttons = 0;
+    for (int code = BTN_JOYSTICK; code < KEY_CNT && num_buttons < UNMAPPED;
+         ++code) {
+        if (TEST_BIT(code, key_bits)) input->key_map[code] = num_buttons++;
+    }
+    for (int code = BTN_MISC; code < BTN_JOYSTICK && num_buttons < UNMAPPED;
+         ++code) {
+        if (TEST_BIT(code, key_bits)) input->key_map[code] = num_buttons++;
+    }
+}
+
+// Report current state of all axes and buttons as events.
+static void QueueCurrentState(struct JoystickInput *input, uint8_t flags) {
+    unsigned long key_state[BIT_ARRAY_LEN(KEY_CNT)];
+    memset(key_state, 0, sizeof(key_state));
+    ioctl(input->fd, EVIOCGKEY(sizeof(key_state)), key_state);
+    struct JoystickEvent e;
+    e.time_usec = JoystickInputNowUsec();
+    for (int code = 0; code < KEY_CNT; ++code) {
+        if (input->key_map[code] == UNMAPPED) continue;
+        e.type = JS_EVENT_BUTTON | flags;
+        e.number = input->key_map[code];
+        e.value = TEST_BIT(code, key_state);
+        PushPending(input, &e);
+    }
+    for (int code = 0; code < ABS_CNT; ++code) {
+        if (input->abs_map[code] == UNMAPPED) continue;
+        struct input_absinfo info;
+        if (ioctl(input->fd, EVIOCGABS(code), &info) < 0) continue;
+        e.type = JS_EVENT_AXIS | flags;
+        e.number = input->abs_map[code];
+        e.value = CorrectAxis(&input->correction[code], info.value);
+        PushPending(input, &e);
+    }
+}
+
+static bool OpenEventDevice(struct JoystickInput *input, const char *path) {
+    input->fd = open(path, O_RDWR | O_NONBLOCK);  // R/W for force feedback.
+    if (input->fd < 0) input->fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (input->fd < 0) return false;
+    input->event_fd = input->fd;
+    input->is_evdev = true;
+    const int clock = CLOCK_MONOTONIC;
+    input->monotonic_timestamps = ioctl(input->fd, EVIOCSCLOCKID, &clock) == 0;
+    CreateEventMapping(input);
+    QueueCurrentState(input, JS_EVENT_INIT);
+    return true;
+}
+
+static bool OpenJoystickDevice(struct JoystickInput *input, const char *path) {
+    // The first time we open it, the zero values are not yet properly
+    // established. So let's close the first instance right away and use
+    // the next open :)
+    close(open(path, O_RDONLY));
+    input->fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (input->fd < 0) return false;
+    // We still need the event device for force feedback.
+    int js_id;
+    char event_path[512];
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    if (sscanf(base, "js%d", &js_id) == 1 &&
+        JoystickFindEventDevice(js_id, event_path, sizeof(event_path))) {
+        input->event_fd = open(event_path, O_RDWR | O_NONBLOCK);
+    }
+    return true;
+}
+
+static bool ReplayEventDue(const struct JoystickInput *input, int64_t now) {
+    const struct JoystickEvent *e = &input->trace[input->trace_pos];
+    if (!input->trace_running) return (e->type & JS_EVENT_INIT) != 0;
+    return input->trace_start_usec + e->time_usec <= now;
+}
+
+// Arm the replay timer for the next event in the trace.
+static void ArmReplayTimer(struct JoystickInput *input) {
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (!input->trace_running) {
+        if (input->trace_pos < input->trace_len &&
+            ReplayEventDue(input, 0)) {
+            spec.it_value.tv_nsec = 1;  // Right away.
+        }
+        timerfd_settime(input->fd, 0, &spec, NULL);
+        return;
+    }
+    int64_t next_usec = input->trace_start_usec;
+    if (input->trace_pos < input->trace_len) {
+        next_usec += input->trace[input->trace_pos].time_usec;
+    } else if (input->trace_len > 0) {
+        next_usec += input->trace[input->trace_len - 1].time_usec +
+                     REPLAY_TAIL_USEC;
+    }
+    spec.it_value.tv_sec = next_usec / 1000000;
+    spec.it_value.tv_nsec = next_usec % 1000000 * 1000;
+    if (spec.it_value.tv_sec == 0 && spec.it_value.tv_nsec == 0) {
+        spec.it_value.tv_nsec = 1;  // Zero would disarm the timer.
+    }
+    timerfd_settime(input->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+struct JoystickInput *JoystickInputOpenReplay(const char *filename) {
+    FILE *in = fopen(filename, "r");
+    if (in == NULL) return NULL;
+    struct JoystickInput *input =
+      (struct JoystickInput *)calloc(1, sizeof(struct JoystickInput));
+    input->event_fd = -1;
+    input->is_replay = true;
+    snprintf(input->trace_name, sizeof(input->trace_name), "replay");
+    int capacity = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), in)) {
+        if (line[0] == '#') continue;
+        if (strncmp(line, "name ", 5) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(input->trace_name, sizeof(input->trace_name), "%.*s",
+                     (int)sizeof(input->trace_name) - 1, line + 5);
+            continue;
+        }
+        long long time_usec;
+        int type, number, value;
+        if (sscanf(line, "%lld %d %d %d", &time_usec, &type, &number,
+                   &value) != 4) {
+            continue;
+        }
+        if (input->trace_len == capacity) {
+            capacity = capacity ? 2 * capacity : 1024;
+            input->trace = (struct JoystickEvent *)realloc(
+              input->trace, capacity * sizeof(struct JoystickEvent));
+        }
+        struct JoystickEvent *e = &input->trace[input->trace_len++];
+        e->time_usec = time_usec;
+        e->type = type;
+        e->number = number;
+        e->value = value;
+    }
+    fclose(in);
+    input->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (input->fd < 0) {
+        free(input->trace);
+        free(input);
+        return NULL;
+    }
+    ArmReplayTimer(input);
+    return input;
+}
+
+void JoystickInputStartReplay(struct JoystickInput *input) {
+    if (!input->is_replay || input->trace_running) return;
+    input->trace_running = true;
+    input->trace_start_usec = JoystickInputNowUsec();
+    ArmReplayTimer(input);
+}
+
+bool JoystickInputRecord(struct JoystickInput *input, const char *filename) {
+    input->record = fopen(filename, "w");
+    if (input->record == NULL) return false;
+    char name[256];
+    if (!JoystickInputName(input, name, sizeof(name))) {
+        snprintf(name, sizeof(name), "unknown-joystick");
+    }
+    fprintf(input->record, "# <usec> <type> <number> <value>\nname %s\n",
+            name);
+    input->record_start_usec = JoystickInputNowUsec();
+    return true;
+}
+
+static void RecordEvents(struct JoystickInput *input,
+                         const struct JoystickEvent *events, int count) {
+    for (int i = 0; i < count; ++i) {
+        int64_t t = events[i].time_usec - input->record_start_usec;
+        if (t < 0) t = 0;  // Initial state from before we started.
+        fprintf(input->record, "%lld %d %d %d\n", (long long)t,
+                events[i].type, events[i].number, events[i].value);
+    }
+}
+
+struct JoystickInput *JoystickInputOpen(const char *path) {
+    struct JoystickInput *input =
+      (struct JoystickInput *)calloc(1, sizeof(struct JoystickInput));
+    input->fd = input->event_fd = -1;
+    const char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    const bool success = (strncmp(base, "event", 5) == 0)
+                           ? OpenEventDevice(input, path)
+                           : OpenJoystickDevice(input, path);
+    if (!success) {
+        free(input);
+        return NULL;
+    }
+    return input;
+}
+
+void JoystickInputClose(struct JoystickInput **input) {
+    if ((*input)->event_fd >= 0 && (*input)->event_fd != (*input)->fd) {
+        close((*input)->event_fd);
+    }
+    if ((*input)->record) fclose((*input)->record);
+    free((*input)->trace);
+    close((*input)->fd);
+    free(*input);
+    *input = NULL;
+}
+
+int JoystickInputFd(const struct JoystickInput *input) { return input->fd; }
+
+int JoystickInputEventFd(const struct JoystickInput *input) {
+    return input->event_fd;
+}
+
+uint64_t JoystickInputDropped(const struct JoystickInput *input) {
+    return input->dropped;
+}
+
+int JoystickInputName(const struct JoystickInput *input, char *name,
+                      size_t len) {
+    if (len == 0) return 0;
+    if (input->is_replay) {
+        snprintf(name, len, "%s", input->trace_name);
+        return 1;
+    }
+    const int r = input->is_evdev ? ioctl(input->fd, EVIOCGNAME(len), name)
+                                  : ioctl(input->fd, JSIOCGNAME(len), name);
+    name[len - 1] = '\0';  // Cut off if too long.
+    return r >= 0;
+}
+
+static int ReadJoystickEvents(struct JoystickInput *input,
+                              struct JoystickEvent *events, int max) {
+    struct js_event js_events[READ_BATCH];
+    if (max > READ_BATCH) max = READ_BATCH;
+    const int r = read(input->fd, js_events, max * sizeof(struct js_event));
+    if (r < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (r == 0) return -1;
+    // The timestamps of the joystick API are in a different time base, so
+    // we have to take the time we read it.
+    const int64_t now = JoystickInputNowUsec();
+    const int count = r / sizeof(struct js_event);
+    for (int i = 0; i < count; ++i) {
+        events[i].time_usec = now;
+        events[i].type = js_events[i].type;
+        events[i].number = js_events[i].number;
+        events[i].value = js_events[i].value;
+    }
+    if (input->event_fd >= 0) {
+        // Nobody else reads the event device, but it reports the same events.
+        struct input_event discard[READ_BATCH];
+        while (read(input->event_fd, discard, sizeof(discard)) > 0) {
+        }
+    }
+    return count;
+}
+
+static int ReadInputEvents(struct JoystickInput *input,
+                           struct JoystickEvent *events, int max) {
+    struct input_event ev[READ_BATCH];
+    if (max > READ_BATCH) max = READ_BATCH;
+    const int r = read(input->fd, ev, max * sizeof(struct input_event));
+    if (r < 0) return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (r == 0) return -1;
+    const int64_t now = JoystickInputNowUsec();
+    const int count = r / sizeof(struct input_event);
+    int result = 0;
+    for (int i = 0; i < count; ++i) {
+        struct JoystickEvent *out = &events[result];
+        out->time_usec = input->monotonic_timestamps
+                           ? (int64_t)ev[i].input_event_sec * 1000000 +
+                               ev[i].input_event_usec
+                           : now;
+        if (ev[i].type == EV_ABS && ev[i].code < ABS_CNT &&
+            input->abs_map[ev[i].code] != UNMAPPED) {
+            out->type = JS_EVENT_AXIS;
+            out->number = input->abs_map[ev[i].code];
+            out->value =
+              CorrectAxis(&input->correction[ev[i].code], ev[i].value);
+            ++result;
+        } else if (ev[i].type == EV_KEY && ev[i].code < KEY_CNT &&
+                   input->key_map[ev[i].code] != UNMAPPED &&
+                   ev[i].value != 2) {  // Ignore auto-repeat.
+            out->type = JS_EVENT_BUTTON;
+            out->number = input->key_map[ev[i].code];
+            out->value = ev[i].value;
+            ++result;
+        } else if (ev[i].type == EV_SYN && ev[i].code == SYN_DROPPED) {
+            // We lost events. Report the current state instead.
+            input->dropped++;
+            QueueCurrentState(input, 0);
+        }
+    }
+    return result;
+}
+
+// Hand out the events of the trace that are due.
+static int ReadReplayEvents(struct JoystickInput *input,
+                            struct JoystickEvent *events, int max) {
+    uint64_t expirations;
+    if (read(input->fd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN) {
+        return -1;
+    }
+    const int64_t now = JoystickInputNowUsec();
+    int count = 0;
+    while (count < max && input->trace_pos < input->trace_len &&
+           ReplayEventDue(input, now)) {
+        events[count] = input->trace[input->trace_pos++];
+        events[count].time_usec += input->trace_start_usec;
+        ++count;
+    }
+    if (count == 0 && input->trace_running &&
+        input->trace_pos == input->trace_len) {
+        const int64_t end_usec =
+          input->trace_len > 0 ? input->trace[input->trace_len - 1].time_usec
+                               : 0;
+        if (now >= input->trace_start_usec + end_usec + REPLAY_TAIL_USEC) {
+            return -1;  // End of trace; just like unplugging.
+        }
+    }
+    ArmReplayTimer(input);
+    return count;
+}
+
+static int ReadBackend(struct JoystickInput *input,
+                       struct JoystickEvent *events, int max) {
+    if (input->is_replay) return ReadReplayEvents(input, events, max);
+    return input->is_evdev ? ReadInputEvents(input, events, max)
+                           : ReadJoystickEvents(input, events, max);
+}
+
+int JoystickInputRead(struct JoystickInput *input, struct JoystickEvent *events,
+                      int max) {
+    const int count = (input->pending_count > 0)
+                        ? PopPending(input, events, max)
+                        : ReadBackend(input, events, max);
+    if (count > 0 && input->record) RecordEvents(input, events, count);
+    return count;
+}
+
+int JoystickWaitForEvent(struct JoystickInput *input,
+                         struct JoystickEvent *event, int timeout_ms) {
+    const int64_t deadline = JoystickInputNowUsec() + timeout_ms * 1000LL;
+    for (;;) {
+        if (input->pending_count > 0) return JoystickInputRead(input, event, 1);
+        struct JoystickEvent batch[READ_BATCH];
+        const int count = ReadBackend(input, batch, READ_BATCH);
+        if (count < 0) {
+            perror("Reading from joystick");
+            return -1;
+        }
+        for (int i = 0; i < count; ++i) PushPending(input, &batch[i]);
+        if (count > 0) continue;
+
+        const int64_t left_usec = deadline - JoystickInputNowUsec();
+        if (left_usec <= 0) return 0;
+        fd_set read_fds;
+        FD_ZERO(&read_fds);
+        FD_SET(input->fd, &read_fds);
+        struct timeval tv;
+        tv.tv_sec = left_usec / 1000000;
+        tv.tv_usec = left_usec % 1000000;
+        if (select(input->fd + 1, &read_fds, NULL, NULL, &tv) < 0) return -1;
+    }
+}
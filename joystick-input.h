@@ -0,0 +1,82 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef JOYSTICK_INPUT_H
+#define JOYSTICK_INPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// A joystick event, independent of the kernel interface it came from.
+// Axes and buttons are numbered as in the joystick API (/dev/input/jsN), so
+// configurations work with either input backend.
+struct JoystickEvent {
+    int64_t time_usec;  // CLOCK_MONOTONIC time the kernel saw the event.
+    uint8_t type;       // JS_EVENT_AXIS or JS_EVENT_BUTTON (| JS_EVENT_INIT)
+    uint8_t number;     // Axis or button number.
+    int16_t value;      // Axis: -32767..32767; button: 0 or 1
+};
+
+struct JoystickInput;
+
+// Open joystick. The "path" can either be an event device
+// (/dev/input/eventN), which is read directly, or a legacy joystick device
+// (/dev/input/jsN). On open, the current state of all axes and buttons is
+// reported as events flagged with JS_EVENT_INIT.
+// Returns NULL on failure.
+struct JoystickInput *JoystickInputOpen(const char *path);
+void JoystickInputClose(struct JoystickInput **input);
+
+// Replay a trace of events recorded with JoystickInputRecord(), with the
+// original timing. Only the initial state is handed out until
+// JoystickInputStartReplay() is called. The end of the trace is reported
+// like an unplugged joystick. Returns NULL on failure.
+struct JoystickInput *JoystickInputOpenReplay(const char *filename);
+
+// Start the clock of the replayed trace; no-op for a real joystick.
+void JoystickInputStartReplay(struct JoystickInput *input);
+
+// Record all events handed out from now on into a trace file.
+bool JoystickInputRecord(struct JoystickInput *input, const char *filename);
+
+// Find the event device belonging to joystick /dev/input/js<js_id>.
+// Returns 1 on success.
+int JoystickFindEventDevice(int js_id, char *event_path, size_t len);
+
+// Find the device of the joystick described by "spec": a path in
+// /dev/input, the name of the joystick or part of it (case insensitive),
+// or NULL for the first joystick. The event device is preferred if there
+// is one. Returns 1 if the joystick is there.
+int JoystickFindDevice(const char *spec, char *path, size_t len);
+
+// File descriptor to watch for readability.
+int JoystickInputFd(const struct JoystickInput *input);
+
+// Event device file descriptor usable for force feedback or -1. With the
+// event backend, this is the same file descriptor we read from.
+int JoystickInputEventFd(const struct JoystickInput *input);
+
+// Number of times the kernel dropped events, as we didn't read them fast
+// enough (event backend only).
+uint64_t JoystickInputDropped(const struct JoystickInput *input);
+
+// Get name of the joystick. Returns 1 on success.
+int JoystickInputName(const struct JoystickInput *input, char *name,
+                      size_t len);
+
+// Read all pending events (at most "max") with a single read without
+// blocking. Returns number of events, 0 if there are none, or -1 on error
+// (e.g. joystick unplugged).
+int JoystickInputRead(struct JoystickInput *input, struct JoystickEvent *events,
+                      int max);
+
+// Returns 0 on timeout, -1 on error and a positive number on event.
+int JoystickWaitForEvent(struct JoystickInput *input,
+                         struct JoystickEvent *event, int timeout_ms);
+
+// Current time in the same time base as JoystickEvent::time_usec.
+int64_t JoystickInputNowUsec(void);
+
+#endif  // JOYSTICK_INPUT_H
@@ -0,0 +1,64 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "joystick-watch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#define INPUT_DIR "/dev/input"
+
+struct JoystickWatch {
+    int fd;
+};
+
+struct JoystickWatch *new_JoystickWatch(void) {
+    const int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        perror("inotify_init1()");
+        return NULL;
+    }
+    if (inotify_add_watch(fd, INPUT_DIR,
+                          IN_CREATE | IN_ATTRIB | IN_MOVED_TO) < 0) {
+        perror("Watching " INPUT_DIR);
+        close(fd);
+        return NULL;
+    }
+    struct JoystickWatch *watch =
+      (struct JoystickWatch *)calloc(1, sizeof(struct JoystickWatch));
+    watch->fd = fd;
+    return watch;
+}
+
+void delete_JoystickWatch(struct JoystickWatch **watch) {
+    close((*watch)->fd);
+    free(*watch);
+    *watch = NULL;
+}
+
+int JoystickWatchFd(const struct JoystickWatch *watch) { return watch->fd; }
+
+static bool IsJoystickDevice(const char *name) {
+    return strncmp(name, "js", 2) == 0 || strncmp(name, "event", 5) == 0;
+}
+
+bool JoystickWatchChanged(struct JoystickWatch *watch) {
+    char buffer[4096]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+    ssize_t r;
+    while ((r = read(watch->fd, buffer, sizeof(buffer))) > 0) {
+        for (char *pos = buffer; pos < buffer + r;) {
+            const struct inotify_event *event =
+              (const struct inotify_event *)pos;
+            if (event->len > 0 && IsJoystickDevice(event->name))
+                changed = true;
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+    }
+    return changed;
+}
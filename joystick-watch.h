@@ -0,0 +1,26 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef JOYSTICK_WATCH_H
+#define JOYSTICK_WATCH_H
+
+#include <stdbool.h>
+
+// Watches /dev/input for joystick devices showing up, so that a joystick
+// that got unplugged can be picked up again as soon as it is back.
+struct JoystickWatch;
+
+// Returns NULL if the directory can't be watched.
+struct JoystickWatch *new_JoystickWatch(void);
+void delete_JoystickWatch(struct JoystickWatch **watch);
+
+// File descriptor to watch for readability.
+int JoystickWatchFd(const struct JoystickWatch *watch);
+
+// Consume the pending notifications without blocking. Returns true if a
+// joystick or event device appeared or its permissions changed (udev sets
+// them only after creating the device).
+bool JoystickWatchChanged(struct JoystickWatch *watch);
+
+#endif  // JOYSTICK_WATCH_H
@@ -10,55 +10,284 @@
 #include <getopt.h>
 #include <linux/joystick.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "event-loop.h"
+#include "firmware.h"
+#include "gcode-encoder.h"
+#include "gcode-line.h"
+#include "host-proxy.h"
+#include "input-thread.h"
+#include "jog-planner.h"
 #include "joystick-config.h"
+#include "joystick-input.h"
+#include "joystick-watch.h"
+#include "machine-link.h"
+#include "machine-port.h"
+#include "machine-thread.h"
+#include "point-store.h"
+#include "realtime.h"
 #include "rumble.h"
-
-// Prusa uses 'W' to indicate that we don't want bed-levelling on G28.
-// If this results in a problem with other machines, remove the W0
-// Also, on GRBL machines, this would be "$H\n"
-#define HOMING_COMMAND "G28 W0\n"
+#include "stats.h"
+#include "teach-in.h"
 
 static const int kMaxFeedrate_xy = 120;
 static const int kMaxFeedrate_z = 10;  // Z is typically pretty slow
-static const int kRumbleTimeMs = 80;
 static const int kMotorTimeoutSeconds = 5;
-
-// Some global state.
-static int max_feedrate_mm_p_sec_xy;
-static int max_feedrate_mm_p_sec_z;
-
-static const long interval_msec = 20;  // update interval between reads.
+static const float kDefaultAccel_xy = 1000;  // mm/s^2
+static const float kDefaultAccel_z = 100;
+static const float kDefaultJerk_xy = 20000;  // mm/s^3
+static const float kDefaultJerk_z = 2000;
+static const int kDefaultResolution = 3;  // Digits after decimal point.
+static const int kDefaultStartupWaitMs = 20000;
+static const float kDefaultTeachInToleranceMm = 0.02;
+
+// Range of the duration of jog segments; adapted to the link within that.
+static int min_segment_ms = 20;
+static int max_segment_ms = 100;
+
+// Ticks while nothing moves are only needed to switch off the motors in
+// time. Slowing them down keeps idle sessions from waking us up all the time.
+static const int kIdleTickMs = 500;
+
+// Default number of commands we send ahead without having seen their 'ok'.
+static const int kDefaultCommandsInFlight = 4;
+static const int kDefaultBaud = 115200;
 
 // Flags.
-static bool simulate_machine = false;
 static bool quiet = false;  // quiet - don't print random stuff to screen
+static bool daemon_mode = false;  // -D: several sessions in one process.
+
+static const char *stats_file = NULL;  // Written regularly, if given.
+static int stats_interval_sec = 10;
+
+// With -T, the joystick and the machine are served by threads of their own.
+static bool use_threads = false;
+
+// With --realtime, we run with real-time priority and report tick jitter.
+static bool realtime = false;
+static const int64_t kJitterTargetUsec = 1000;
+
+// Notices joysticks plugged back in, for all sessions.
+static struct JoystickWatch *joystick_watch = NULL;
+static const int kReconnectSettleMs = 100;  // Let udev set up the device.
+
+static int64_t program_start_usec;  // To report how long startup took.
+static const char *program_name;
+
+// How a joystick is connected to a machine; from the command line, or from
+// a line of the daemon configuration file.
+struct SessionOptions {
+    const char *name;            // Tells sessions apart in daemon mode.
+    const char *config_dir;      // -j
+    const char *config_name;     // -n; otherwise from joystick name
+    const char *joystick_spec;   // -g
+    const char *replay_file;     // -t
+    const char *record_file;     // -R
+    const char *machine_device;  // -d; stdin/stdout if not set.
+    int baud;
+    const char *host_spec;    // -P
+    const char *points_file;  // -p
+    const char *teach_in_file;  // -W: G-code file the path is saved to.
+    float teach_in_tolerance;   // mm the saved path may be off.
+    const struct Firmware *firmware;
+    bool do_homing;
+    bool simulate;      // Machine not connected.
+    bool line_numbers;  // -N: commands with line numbers and checksums.
+    int startup_wait_ms;
+    int max_commands_in_flight;
+    int max_bytes_in_flight;  // 0: unlimited.
+    int resolution;
+    int max_feedrate_xy;  // mm/s
+    int max_feedrate_z;
+    float safe_z;  // -Z: mm to lift to at least before going to a point.
+    struct Vector max_accel;  // Acceleration limits of jog moves.
+    struct Vector max_jerk;
+    struct Vector machine_limits;
+};
 
-static const char *persistent_store = NULL;  // filename to store memory points.
+// Options that can be given per session, in the daemon configuration too.
+#define SESSION_OPTIONS "j:n:g:t:R:d:b:P:p:W:f:hsNi:w:r:x:z:Z:A:J:L:"
+
+static void SessionOptionsInit(struct SessionOptions *options) {
+    memset(options, 0, sizeof(*options));
+    options->baud = kDefaultBaud;
+    options->startup_wait_ms = kDefaultStartupWaitMs;
+    options->max_commands_in_flight = kDefaultCommandsInFlight;
+    options->resolution = kDefaultResolution;
+    options->teach_in_tolerance = kDefaultTeachInToleranceMm;
+    options->max_feedrate_xy = kMaxFeedrate_xy;
+    options->max_feedrate_z = kMaxFeedrate_z;
+    options->max_accel.axis[AXIS_X] = options->max_accel.axis[AXIS_Y] =
+      kDefaultAccel_xy;
+    options->max_accel.axis[AXIS_Z] = kDefaultAccel_z;
+    options->max_jerk.axis[AXIS_X] = options->max_jerk.axis[AXIS_Y] =
+      kDefaultJerk_xy;
+    options->max_jerk.axis[AXIS_Z] = kDefaultJerk_z;
+    options->machine_limits.axis[AXIS_X] =
+      options->machine_limits.axis[AXIS_Y] =
+        options->machine_limits.axis[AXIS_Z] = 305;
+}
 
-// Streams to connect machine to.
-static FILE *gcode_out = NULL;          // we write with fprintf() etc.
-static int gcode_in_fd = STDIN_FILENO;  // .. and read directly from file desc.
+// Parse one of SESSION_OPTIONS. Returns false if invalid.
+static bool ParseSessionOption(struct SessionOptions *options, int opt,
+                               const char *arg) {
+    switch (opt) {
+    case 'j': options->config_dir = strdup(arg); break;
 
-struct Vector {
-    float axis[NUM_AXIS];
-};
+    case 'n': options->config_name = strdup(arg); break;
+
+    case 'g': options->joystick_spec = strdup(arg); break;
+
+    case 't': options->replay_file = strdup(arg); break;
+
+    case 'R': options->record_file = strdup(arg); break;
+
+    case 'd': options->machine_device = strdup(arg); break;
+
+    case 'b': options->baud = atoi(arg); break;
+
+    case 'P': options->host_spec = strdup(arg); break;
+
+    case 'p': options->points_file = strdup(arg); break;
+
+    case 'W': {
+        char *file = strdup(arg);
+        char *comma = strchr(file, ',');
+        if (comma) {
+            *comma = '\0';
+            options->teach_in_tolerance = atof(comma + 1);
+        }
+        if (options->teach_in_tolerance <= 0) {
+            fprintf(stderr, "Invalid -W %s\n", arg);
+            return false;
+        }
+        options->teach_in_file = file;
+    } break;
+
+    case 'f':
+        options->firmware = FirmwareByName(arg);
+        if (options->firmware == NULL) {
+            fprintf(stderr, "Unknown firmware -f %s\n", arg);
+            return false;
+        }
+        break;
+
+    case 'h': options->do_homing = true; break;
+
+    case 's': options->simulate = true; break;
+
+    case 'N': options->line_numbers = true; break;
+
+    case 'i': options->startup_wait_ms = atoi(arg); break;
+
+    case 'w':
+        if (sscanf(arg, "%d,%d", &options->max_commands_in_flight,
+                   &options->max_bytes_in_flight) < 1 ||
+            options->max_commands_in_flight < 1) {
+            fprintf(stderr, "Invalid -w %s\n", arg);
+            return false;
+        }
+        break;
+
+    case 'r':
+        options->resolution = atoi(arg);
+        if (options->resolution < 0 || options->resolution > 6) {
+            fprintf(stderr, "Resolution -r needs to be in range 0..6\n");
+            return false;
+        }
+        break;
+
+    case 'x':
+        options->max_feedrate_xy = atoi(arg);
+        if (options->max_feedrate_xy <= 1) {
+            fprintf(stderr, "Peculiar value -x %d", options->max_feedrate_xy);
+            return false;
+        }
+        break;
+
+    case 'z':
+        options->max_feedrate_z = atoi(arg);
+        if (options->max_feedrate_z <= 1) {
+            fprintf(stderr, "Peculiar value -z %d", options->max_feedrate_z);
+            return false;
+        }
+        break;
+
+    case 'Z':
+        options->safe_z = atof(arg);
+        if (options->safe_z < 0) {
+            fprintf(stderr, "Invalid -Z %s\n", arg);
+            return false;
+        }
+        break;
+
+    case 'A':
+    case 'J': {
+        struct Vector *limit =
+          (opt == 'A') ? &options->max_accel : &options->max_jerk;
+        float xy, z;
+        const int count = sscanf(arg, "%f,%f", &xy, &z);
+        if (count < 1 || xy < 0 || (count == 2 && z < 0)) {
+            fprintf(stderr, "Invalid -%c %s\n", opt, arg);
+            return false;
+        }
+        limit->axis[AXIS_X] = limit->axis[AXIS_Y] = xy;
+        if (count == 2) limit->axis[AXIS_Z] = z;
+    } break;
+
+    case 'L': {
+        // TODO: is there a gcode we can query ?
+        struct Vector *limits = &options->machine_limits;
+        if (3 != sscanf(arg, "%f,%f,%f", &limits->axis[AXIS_X],
+                        &limits->axis[AXIS_Y], &limits->axis[AXIS_Z])) {
+            fprintf(stderr, "Invalid -L %s\n", arg);
+            return false;
+        }
+    } break;
+
+    default: return false;
+    }
+    return true;
+}
+
+// Settle what depends on the firmware. Returns false if the options don't
+// go together.
+static bool FinishSessionOptions(struct SessionOptions *options) {
+    if (options->firmware == NULL) options->firmware = FirmwareDefault();
+    if (options->line_numbers && !options->firmware->line_numbers) {
+        fprintf(stderr, "-N: %s does not understand line numbers\n",
+                options->firmware->name);
+        return false;
+    }
+    if (options->max_bytes_in_flight == 0 &&
+        options->firmware->rx_buffer_size > 0) {
+        // Never overflow the receive buffer.
+        options->max_bytes_in_flight = options->firmware->rx_buffer_size - 1;
+    }
+    return true;
+}
 
 // State for a particular button.
 struct ButtonState {
     char is_pressed;
-    struct Vector stored;
 };
 struct Buttons {
     int count;
@@ -71,7 +300,6 @@ static struct Buttons *new_Buttons(int n) {
     result->count = n;
     for (int i = 0; i < n; ++i) {
         result->state[i].is_pressed = 0;
-        result->state[i].stored.axis[AXIS_X] = -1;
     }
     return result;
 }
@@ -80,93 +308,157 @@ static void delete_Buttons(struct Buttons **b) {
     *b = NULL;
 }
 
-static int quantize(int value, int q) { return value / q * q; }
+// What the rest of the process asks a session for. It takes care of it in
+// its own event loop, which might run on another thread (-D).
+enum SessionRequest {
+    REQUEST_STATS = 1 << 0,      // Write the stats.
+    REQUEST_TEACH_IN = 1 << 1,   // Start or stop recording the path.
+    REQUEST_RECONNECT = 1 << 2,  // New input devices; look for the joystick.
+};
+
+// A joystick jogging a machine. Everything about it is kept here, so that
+// one process can serve several of them (-D).
+struct JogSession {
+    struct SessionOptions options;
+    char label[64];  // Prefix of messages; empty with a single session.
+    const char *stats_file;
+    char stats_path[512];
+
+    // Connection to the machine.
+    int machine_fd;  // Opened by us; -1 if stdin/stdout.
+    struct MachineLink *machine;
+    struct GCodeEncoder encoder;      // Creates compact G1 commands.
+    const struct Firmware *firmware;  // Dialect the machine speaks.
+    struct HostProxy *host_proxy;     // Host sharing the machine; or NULL.
+
+    // With -T, threads of our own serve the joystick and the machine.
+    struct InputThread *input_thread;
+    struct MachineThread *machine_thread;
+    int machine_acquired;  // Nesting of AcquireMachine().
+    struct MachineLinkStatus link_status;  // Last reported by thread.
+    uint64_t host_commands_reported;      // ... as well.
+
+    struct PointStore *saved_points;  // Memory points.
+    int saved_points_bank;  // Bank of points the buttons refer to.
+
+    struct TeachIn *teach_in;  // Path jogged along, with -W; or NULL.
+    bool recording;            // Adding to it right now.
+
+    // Position reports received before this are outdated.
+    int64_t coordinates_read_usec;
+    bool reading_coordinates;
+    time_t last_motor_on_time;
+    int64_t last_probe_usec;
+    uint64_t limit_hits;  // Times the stick pushed us into a limit.
+
+    struct Configuration config;
+    struct JoystickInput *js;  // NULL while unplugged.
+    struct Rumble rumble;
+    int reconnect_timer_fd;  // Pending attempt to pick it up again; or -1
+    struct Buttons *buttons;
+    struct Vector speed_vector;  // Current stick deflection.
+    struct Vector machine_pos;
+    char is_homed;
+    bool stick_active;  // Stick is deflected.
+    bool stopped;       // Stop pressed; ignore stick until released.
+    uint64_t host_commands;  // Host commands seen at our last position sync.
+
+    struct JogStats stats;
+    int64_t first_unsent_event_usec;  // Stick movement not sent yet; or 0.
+
+    // Movement requested by the stick that is not yet sent to the machine.
+    // Integrated with the timestamps of the joystick events.
+    struct Vector travel;
+    int64_t integrated_until_usec;
+    int64_t last_tick_usec;
+    int64_t last_segment_usec;  // Last time we sent a jog segment.
+
+    struct JogPlanner planner;  // Ramps the velocity up and down.
+
+    int segment_ms;  // Current jog segment duration.
+    int tick_ms;     // Tick interval: segment_ms, or kIdleTickMs when idle.
+    int tick_timer_fd;
+    int poll_timer_fd;
+    unsigned last_blocked_sends;
+
+    int accumulated_timeout;
+    int last_button_ev;
+    struct EventLoop *loop;
+    bool running;  // In the event loop; the others go on once it ended.
+    atomic_int requests;  // enum SessionRequest bits not handled yet.
+    int request_fd;       // Wakes up the loop for them.
+    pthread_t thread;     // Serves the session with -D.
+};
 
-void WriteSavedPoints(const char *filename, struct Buttons *buttons) {
-    if (filename == NULL) return;
-    FILE *out = fopen(filename, "w");  // Overwriting for now. TODO: tmp file.
-    for (int i = 0; i < buttons->count; ++i) {
-        if (buttons->state[i].stored.axis[AXIS_X] < 0) continue;
-        fprintf(out, "%2d: %7.2f %7.2f %7.2f\n", i,
-                buttons->state[i].stored.axis[AXIS_X],
-                buttons->state[i].stored.axis[AXIS_Y],
-                buttons->state[i].stored.axis[AXIS_Z]);
+// All sessions we serve.
+static struct JogSession **sessions = NULL;
+static int session_count = 0;
+
+// With -D, each session runs its own event loop on a thread of its own, so
+// that waiting for a machine (homing, reading the position after a stop)
+// holds up no other session. The threads tell us when they are done.
+static int running_sessions = 0;
+static int sessions_done_fd = -1;
+
+// The machine thread owns the link; commands that wait for replies take it
+// over for a while. Queued commands are sent first, unless they are to be
+// discarded (because we stop the machine).
+static void AcquireMachine(struct JogSession *session, bool discard_queued) {
+    if (session->machine_thread && session->machine_acquired++ == 0) {
+        MachineThreadAcquire(session->machine_thread, discard_queued);
     }
-    fclose(out);
 }
 
-void ReadSavedPoints(const char *filename, struct Buttons *buttons) {
-    if (filename == NULL) return;
-    FILE *in = fopen(filename, "r");
-    if (in == NULL) return;
-    int b;
-    struct Vector vec;
-    while (4 == fscanf(in, "%d: %f %f %f\n", &b, &vec.axis[AXIS_X],
-                       &vec.axis[AXIS_Y], &vec.axis[AXIS_Z])) {
-        if (b < 0 || b >= buttons->count) continue;
-        buttons->state[b].stored = vec;
+static void ReleaseMachine(struct JogSession *session) {
+    if (session->machine_thread && --session->machine_acquired == 0) {
+        MachineThreadRelease(session->machine_thread);
     }
-    fclose(in);
 }
 
-static int64_t get_time_millis() {
-    struct timeval tval;
-    gettimeofday(&tval, NULL);
-    return (int64_t)tval.tv_sec * 1000 + tval.tv_usec / 1000;
+static void GetLinkStatus(const struct JogSession *session,
+                          struct MachineLinkStatus *status) {
+    if (session->machine_thread && session->machine_acquired == 0) {
+        *status = session->link_status;
+    } else {
+        MachineLinkGetStatus(session->machine, status);
+    }
 }
 
-// Wait for input to become ready for read or timeout reached.
-// If the file-descriptor becomes readable, returns number of milli-seconds
-// left.
-// Returns 0 on timeout (i.e. no millis left and nothing to be read).
-// Returns -1 on error.
-static int AwaitReadReady(int fd, int timeout_millis) {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(fd, &read_fds);
-
-    struct timeval tv;
-    tv.tv_sec = timeout_millis / 1000;
-    tv.tv_usec = (timeout_millis % 1000) * 1000;
-
-    FD_SET(fd, &read_fds);
-    int s = select(fd + 1, &read_fds, NULL, NULL, &tv);
-    if (s < 0) return -1;
-    return tv.tv_usec / 1000;
+static uint64_t HostCommandCount(const struct JogSession *session) {
+    if (session->machine_thread && session->machine_acquired == 0) {
+        return session->host_commands_reported;
+    }
+    return HostProxyCommandCount(session->host_proxy);
 }
 
-static int ReadLine(int fd, char *result, int len, bool do_echo) {
-    int bytes_read = 0;
-    char c = 0;
-    while (c != '\n' && c != '\r' && bytes_read < len) {
-        if (read(fd, &c, 1) < 0) return -1;
-        ++bytes_read;
-        *result++ = c;
-        if (do_echo && !quiet && write(STDERR_FILENO, &c, 1) < 0) {  // echo
-            perror("echo failed");
-        }
+// Real-time bytes go out right away, even while commands are queued.
+static void SendRealtime(struct JogSession *session, const char *data,
+                         int len) {
+    if (session->machine_thread && session->machine_acquired == 0) {
+        MachineThreadSendRealtime(session->machine_thread, data, len);
+    } else {
+        MachineLinkSendRealtime(session->machine, data, len);
     }
-    *result = '\0';
-    return bytes_read;
 }
 
-// Returns 0 on timeout, -1 on error and a positive number on event.
-int JoystickWaitForEvent(int fd, struct js_event *event, int timeout_ms) {
-    const int timeout_left = AwaitReadReady(fd, timeout_ms);
-    if (timeout_left > 0) {
-        if (read(fd, event, sizeof(*event)) < 0) {
-            perror("Reading from joystick");
-            return -1;
-        }
+static int quantize(int value, int q) { return value / q * q; }
+
+// Name of the configuration of a joystick, derived from its name.
+static void ConfigNameOf(struct JoystickInput *js, char *name, size_t len) {
+    if (!JoystickInputName(js, name, len))
+        snprintf(name, len, "unknown-joystick");
+    // Make a filename-friendly name out of it.
+    for (char *x = name; *x; ++x) {
+        if (isspace(*x)) *x = '-';
     }
-    return timeout_left;
 }
 
-static void JoystickInitialState(int js_fd, struct Configuration *config) {
-    struct js_event e;
+static void JoystickInitialState(struct JoystickInput *js,
+                                 struct Configuration *config) {
+    struct JoystickEvent e;
     config->highest_button = -1;
     // The initial state is sent on connect.
-    while (JoystickWaitForEvent(js_fd, &e, 50) > 0) {
+    while (JoystickWaitForEvent(js, &e, 50) > 0) {
         if ((e.type & JS_EVENT_INIT) == 0) break;  // done init events.
         if ((e.type & JS_EVENT_AXIS) != 0) {
             // read zero position.
@@ -187,157 +479,221 @@ static void JoystickInitialState(int js_fd, struct Configuration *config) {
 }
 
 enum EventOutput {
-    JS_READ_ERROR = -3,
-    JS_REACHED_TIMEOUT = -2,
+    JS_SHIFT_BUTTON = -4,
+    JS_STOP_BUTTON = -3,
+    JS_NO_BUTTON = -2,
     JS_HOME_BUTTON = -1,
     // values >= 0 are button values.
 };
-// Wait for a joystick button up to "timeout_ms" long. Returns one of
-// EventOutput or a positive number (>= 0) denoting the button that
-// has been pressed.
-// In case the axis position is changing, it updates "axis", but does not
-// return before the timeout, as this does not require immediate attention.
-static int JoystickWaitForButton(int fd, int timeout_ms,
-                                 const struct Configuration *config,
-                                 struct Vector *axis, struct Buttons *buttons) {
-    int timeout_left = timeout_ms;
-    for (;;) {
-        struct js_event e;
-        timeout_left = JoystickWaitForEvent(fd, &e, timeout_left);
-        if (timeout_left < 0) {
-            return JS_READ_ERROR;
-        }
-        if (timeout_left == 0) {
-            return JS_REACHED_TIMEOUT;
-        }
-
-        if (e.type == JS_EVENT_AXIS) {
-            for (int a = 0; a < NUM_AXIS; ++a) {
-                if (config->axis_config[a].channel == e.number) {
-                    int normalized = e.value - config->axis_config[a].zero;
-                    int quant = abs(config->axis_config[a].max_value / 16);
-                    axis->axis[a] = (quantize(normalized, quant) * 1.0 /
-                                     config->axis_config[a].max_value);
-                }
-            }
-        } else if (e.type == JS_EVENT_BUTTON) {
-            if (e.number <= config->highest_button) {
-                buttons->state[e.number].is_pressed = e.value;
-                if (e.number == config->home_button)
-                    return JS_HOME_BUTTON;  // special button.
-                else
-                    return e.number;  // generic store button.
+// Process a joystick event. Returns one of EventOutput or a positive
+// number (>= 0) denoting the button that has been pressed or released.
+// In case the axis position is changing, it updates "axis"; this does not
+// require immediate attention, it is picked up at the next jog interval.
+static int JoystickHandleEvent(const struct JoystickEvent *e,
+                               const struct Configuration *config,
+                               struct Vector *axis, struct Buttons *buttons) {
+    if (e->type == JS_EVENT_AXIS) {
+        for (int a = 0; a < NUM_AXIS; ++a) {
+            if (config->axis_config[a].channel == e->number) {
+                int normalized = e->value - config->axis_config[a].zero;
+                int quant = abs(config->axis_config[a].max_value / 16);
+                axis->axis[a] = (quantize(normalized, quant) * 1.0 /
+                                 config->axis_config[a].max_value);
             }
         }
+    } else if (e->type == JS_EVENT_BUTTON) {
+        if (e->number == config->stop_button) {
+            return e->value ? JS_STOP_BUTTON : JS_NO_BUTTON;  // Act on press.
+        }
+        if (e->number == config->shift_button) {
+            return e->value ? JS_SHIFT_BUTTON : JS_NO_BUTTON;
+        }
+        if (e->number <= config->highest_button) {
+            buttons->state[e->number].is_pressed = e->value;
+            if (e->number == config->home_button)
+                return JS_HOME_BUTTON;  // special button.
+            else
+                return e->number;  // generic store button.
+        }
     }
+    return JS_NO_BUTTON;
 }
 
 // Discard all input until nothing is coming anymore within timeout. In
 // particular on first connect, this helps us to get into a clean state.
-static int DiscardAllInput(int timeout_ms) {
-    if (simulate_machine) return 0;
-    int total_bytes = 0;
-    char buf[128];
-    while (AwaitReadReady(gcode_in_fd, timeout_ms) > 0) {
-        int r = read(gcode_in_fd, buf, sizeof(buf));
-        if (r < 0) {
-            perror("reading trouble");
-            return -1;
-        }
-        total_bytes += r;
-        if (!quiet && r > 0 && write(STDERR_FILENO, buf, r) < 0) {  // echo
-            perror("echo failed");
-        }
-    }
-    return total_bytes;
+static int DiscardAllInput(struct JogSession *session, int timeout_ms) {
+    if (session->options.simulate) return 0;
+    AcquireMachine(session, false);
+    const int result =
+      MachineLinkDiscardInput(session->machine, timeout_ms, !quiet);
+    ReleaseMachine(session);
+    return result;
 }
 
-// 'ok' comes on a single line, maybe followed by something.
-static void WaitForOk() {
-    if (simulate_machine) return;
-    char buffer[512];
-    for (;;) {
-        if (ReadLine(gcode_in_fd, buffer, sizeof(buffer), false) < 0) break;
-        if (strncasecmp(buffer, "ok", 2) == 0) break;
+// Send a command that does not need to wait for its 'ok'. Returns false if
+// the connection is lost.
+static bool SendRaw(struct JogSession *session, const char *data, int len) {
+    if (session->machine_thread && session->machine_acquired == 0 &&
+        MachineThreadSend(session->machine_thread, data, len)) {
+        return true;
     }
+    AcquireMachine(session, false);  // Queue full; wait for room.
+    const bool success = MachineLinkSendRaw(session->machine, data, len);
+    ReleaseMachine(session);
+    return success;
 }
 
-// Read coordinates from printer.
-static bool GetCoordinates(struct Vector *pos) {
-    if (simulate_machine) return 1;
-    DiscardAllInput(100);
+static void SendCommand(struct JogSession *session, const char *gcode) {
+    if (session->options.simulate) return;
+    SendRaw(session, gcode, strlen(gcode));
+}
 
-    fprintf(gcode_out, "M114\n");  // read coordinates.
-    if (!quiet) fprintf(stderr, "Reading initial absolute position\n");
+// Read coordinates from printer. Waits until the machine has come to rest.
+static bool ReadCoordinates(struct JogSession *session, struct Vector *pos) {
+    struct MachineLink *const machine = session->machine;
+    const struct Firmware *const firmware = session->firmware;
+    MachineLinkDrain(machine);  // Make sure we're at the end of the queue.
+    GCodeEncoderReset(&session->encoder);  // Start from reported position.
+    DiscardAllInput(session, 100);
+
+    if (!quiet) fprintf(stderr, "Reading absolute position\n");
+    const char *query = firmware->query_position;
     char buffer[512];
-    ReadLine(gcode_in_fd, buffer, sizeof(buffer), true);
-    if (sscanf(buffer, "X:%f Y:%f Z:%f", &pos->axis[AXIS_X], &pos->axis[AXIS_Y],
-               &pos->axis[AXIS_Z]) == 3) {
-        WaitForOk();
-        if (!quiet) {
-            fprintf(stderr, "Got machine pos (x/y/z) = (%.3f/%.3f/%.3f)\n",
-                    pos->axis[AXIS_X], pos->axis[AXIS_Y], pos->axis[AXIS_Z]);
+    buffer[0] = '\0';
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        if (firmware->query_is_realtime) {
+            MachineLinkSendRealtime(machine, query, strlen(query));
+        } else {
+            MachineLinkSend(machine, "%s", query);
         }
-        return true;
+        enum FirmwarePosition reply = FIRMWARE_NO_POSITION;
+        while (MachineLinkReadLine(machine, buffer, sizeof(buffer), 1000) > 0) {
+            if (!quiet) fprintf(stderr, "%s\n", buffer);
+            reply = firmware->parse_position(buffer, pos);
+            if (reply != FIRMWARE_NO_POSITION) break;
+            if (firmware->is_ack(buffer)) break;  // No coordinates ?
+        }
+        if (reply == FIRMWARE_POSITION) {
+            MachineLinkDrain(machine);
+            if (!quiet) {
+                fprintf(stderr, "Got machine pos (x/y/z) = (%.3f/%.3f/%.3f)\n",
+                        pos->axis[AXIS_X], pos->axis[AXIS_Y],
+                        pos->axis[AXIS_Z]);
+            }
+            return true;
+        }
+        if (reply != FIRMWARE_MOVING) break;
+        MachineLinkDrain(machine);
+        const struct timespec pause = {0, 50 * 1000000};
+        nanosleep(&pause, NULL);  // Ask again once it came to a stop.
     }
-    fprintf(stderr, "Didn't get readable coordinates: '%s'\n", buffer);
+    fprintf(stderr, "%sDidn't get readable coordinates: '%s'\n",
+            session->label, buffer);
     return false;
 }
 
-static time_t last_motor_on_time = 0;  // Quasi local state for motor move ops.
-static void GCodeHome() {
-    if (simulate_machine) return;
-    fprintf(gcode_out, HOMING_COMMAND);
-    WaitForOk();
-    last_motor_on_time = time(NULL);
+static bool GetCoordinates(struct JogSession *session, struct Vector *pos) {
+    if (session->options.simulate) return 1;
+    AcquireMachine(session, false);
+    session->reading_coordinates = true;
+    const bool result = ReadCoordinates(session, pos);
+    session->reading_coordinates = false;
+    session->coordinates_read_usec = JoystickInputNowUsec();
+    ReleaseMachine(session);
+    return result;
 }
 
-static void GCodeGoto(struct Vector *pos, float feedrate_mm_sec) {
-    if (simulate_machine) return;
-    fprintf(gcode_out, "G1 X%.3f Y%.3f Z%.3f F%.3f\n", pos->axis[AXIS_X],
-            pos->axis[AXIS_Y], pos->axis[AXIS_Z], feedrate_mm_sec * 60);
-    WaitForOk();
-    last_motor_on_time = time(NULL);
+// Wait until the machine is done with all moves sent, and read where it
+// ended up. Returns false if that can't be read.
+static bool FinishMoves(struct JogSession *session, struct Vector *pos) {
+    if (session->firmware->finish_moves) {
+        SendCommand(session, session->firmware->finish_moves);
+    }
+    return GetCoordinates(session, pos);
 }
 
-static void GCodeEnsureMotorOff() {
-    if (last_motor_on_time) {
-        fprintf(gcode_out, "M84\n");
-        WaitForOk();
-        last_motor_on_time = 0;
+static void GCodeHome(struct JogSession *session) {
+    if (session->options.simulate) return;
+    AcquireMachine(session, false);
+    MachineLinkSend(session->machine, "%s", session->firmware->home);
+    MachineLinkDrain(session->machine);  // Homing needs to be finished.
+    ReleaseMachine(session);
+    GCodeEncoderReset(&session->encoder);
+    session->last_motor_on_time = time(NULL);
+}
+
+// Returns number of bytes sent, 0 if not moving at our resolution.
+static int GCodeGoto(struct JogSession *session, struct Vector *pos,
+                     float feedrate_mm_sec) {
+    char line[128];
+    const int len = GCodeEncodeMove(&session->encoder, pos,
+                                    feedrate_mm_sec * 60, line, sizeof(line));
+    if (len == 0) return 0;
+    if (session->recording) TeachInAdd(session->teach_in, pos);
+    if (session->options.simulate) return len;
+    // Only blocks if there are too many commands in flight already.
+    SendRaw(session, line, len);
+    session->last_motor_on_time = time(NULL);
+    return len;
+}
+
+static void GCodeEnsureMotorOff(struct JogSession *session) {
+    if (session->last_motor_on_time) {
+        if (session->firmware->motor_off) {
+            SendCommand(session, session->firmware->motor_off);
+        }
+        session->last_motor_on_time = 0;
     }
 }
 
 // Switch motor off if it has been idle for kMotorTimeoutSeconds
-static void CheckMotorTimeout() {
-    if (last_motor_on_time > 0 &&
-        time(NULL) - last_motor_on_time > kMotorTimeoutSeconds) {
-        GCodeEnsureMotorOff();
+static void CheckMotorTimeout(struct JogSession *session) {
+    if (session->last_motor_on_time > 0 &&
+        time(NULL) - session->last_motor_on_time > kMotorTimeoutSeconds) {
+        GCodeEnsureMotorOff(session);
     }
 }
 
-// Returns 1 if any gcode has been output or 0 if there was no need.
-int OutputJogGCode(int64_t interval_ms, struct Vector *pos,
-                   const struct Vector *speed, const struct Vector *limit) {
-    // We get the timeout in regular intervals.
+// Feedrate in mm/s requested by the stick deflection.
+static float JogFeedrate(const struct JogSession *session,
+                         const struct Vector *speed) {
     const float euklid = sqrtf(speed->axis[AXIS_X] * speed->axis[AXIS_X] +
                                speed->axis[AXIS_Y] * speed->axis[AXIS_Y] +
                                speed->axis[AXIS_Z] * speed->axis[AXIS_Z]);
+    return euklid * ((fabs(speed->axis[AXIS_Z]) > 0.01)
+                       ? session->options.max_feedrate_z
+                       : session->options.max_feedrate_xy);
+}
 
-    const float feedrate =
-      euklid * ((fabs(speed->axis[AXIS_Z]) > 0.01) ? max_feedrate_mm_p_sec_z
-                                                   : max_feedrate_mm_p_sec_xy);
-    if (fabs(feedrate) < 0.1) return 0;
-
-    // The interval_ms is empirically how long it took since the
-    // last update.
-    if (interval_ms > 100) interval_ms = 100;
-    const float interval = interval_ms / 1000.0;
+// Move "pos" by the "travel" accumulated from the stick movement since the
+// last update "interval_ms" ago.
+// Returns number of bytes of gcode output or 0 if there was no need.
+int OutputJogGCode(struct JogSession *session, int64_t interval_ms,
+                   struct Vector *pos, struct Vector *travel,
+                   const struct Vector *limit) {
+    float distance = sqrtf(travel->axis[AXIS_X] * travel->axis[AXIS_X] +
+                           travel->axis[AXIS_Y] * travel->axis[AXIS_Y] +
+                           travel->axis[AXIS_Z] * travel->axis[AXIS_Z]);
+    if (distance < 0.001) return 0;
+
+    // The interval_ms is the time since the last update; it might be
+    // longer than one segment if we've been busy. Then we only go as far as
+    // in the shorter interval, so the feedrate stays at the planned speed.
+    if (interval_ms > 2 * max_segment_ms) {
+        const float scale = 2.0f * max_segment_ms / interval_ms;
+        for (int a = AXIS_X; a < NUM_AXIS; ++a) travel->axis[a] *= scale;
+        distance *= scale;
+        interval_ms = 2 * max_segment_ms;
+    }
+    if (interval_ms < 1) interval_ms = 1;
+    const float feedrate = distance * 1000.0 / interval_ms;
     bool do_rumble = false;
+    const struct Vector before = *pos;
     for (int a = AXIS_X; a < NUM_AXIS; ++a) {
         const char at_limit_before =
           pos->axis[a] <= 0 || pos->axis[a] >= limit->axis[a];
-        pos->axis[a] = pos->axis[a] + speed->axis[a] * feedrate * interval;
+        pos->axis[a] = pos->axis[a] + travel->axis[a];
+        travel->axis[a] = 0;
         if (pos->axis[a] < 0) {
             pos->axis[a] = 0;
             do_rumble |= !at_limit_before;
@@ -347,156 +703,1510 @@ int OutputJogGCode(int64_t interval_ms, struct Vector *pos,
             do_rumble |= !at_limit_before;
         }
     }
-    GCodeGoto(pos, feedrate);
+    if (do_rumble) {
+        JoystickRumble(&session->rumble, RUMBLE_TICK);
+        session->limit_hits++;
+    }
+    if (memcmp(&before, pos, sizeof(before)) == 0) return 0;  // At limit.
+    const int bytes = GCodeGoto(session, pos, feedrate);
     if (!quiet) {
         fprintf(stderr, "Goto (x/y/z) = (%.2f/%.2f/%.2f)      \r",
                 pos->axis[AXIS_X], pos->axis[AXIS_Y], pos->axis[AXIS_Z]);
     }
-    if (do_rumble) JoystickRumble(kRumbleTimeMs);
-    return 1;
+    return bytes;
 }
 
-void HandlePlaceMemory(int b, struct Buttons *buttons, int *accumulated_timeout,
-                       struct Vector *machine_pos) {
-    struct Vector *storage = &buttons->state[b].stored;
+// Go to a stored point without dragging across the work: up to the safe
+// height (or to the higher end of the move, if that is above) at Z speed,
+// across at XY speed, then down at Z speed. Parts that don't move are left
+// out. The moves go out back to back and only wait for room in the window.
+static void GCodeRoute(struct JogSession *session, const struct Vector *to) {
+    const struct SessionOptions *options = &session->options;
+    struct Vector *const pos = &session->machine_pos;
+    float travel_z = options->safe_z;
+    if (travel_z > options->machine_limits.axis[AXIS_Z]) {
+        travel_z = options->machine_limits.axis[AXIS_Z];
+    }
+    if (pos->axis[AXIS_Z] > travel_z) travel_z = pos->axis[AXIS_Z];
+    if (to->axis[AXIS_Z] > travel_z) travel_z = to->axis[AXIS_Z];
+    pos->axis[AXIS_Z] = travel_z;
+    GCodeGoto(session, pos, options->max_feedrate_z);
+    pos->axis[AXIS_X] = to->axis[AXIS_X];
+    pos->axis[AXIS_Y] = to->axis[AXIS_Y];
+    GCodeGoto(session, pos, options->max_feedrate_xy);
+    *pos = *to;
+    GCodeGoto(session, pos, options->max_feedrate_z);
+}
+
+void HandlePlaceMemory(struct JogSession *session, int b) {
+    const int bank = session->saved_points_bank;
+    struct Buttons *const buttons = session->buttons;
+    int *const accumulated_timeout = &session->accumulated_timeout;
+    struct Vector *const machine_pos = &session->machine_pos;
+    const struct Rumble *const rumble = &session->rumble;
+    struct Vector stored;
     if (buttons->state[b].is_pressed) {
         *accumulated_timeout = 0;
     } else {  // we act on release
         if (*accumulated_timeout >= 500) {
-            *storage = *machine_pos;  // save
-            WriteSavedPoints(persistent_store, buttons);
-            JoystickRumble(kRumbleTimeMs);  // Feedback that it is stored now.
-            if (!quiet) {
-                fprintf(stderr, "\nStored in %d (%.2f, %.2f, %.2f)\n", b,
-                        machine_pos->axis[AXIS_X], machine_pos->axis[AXIS_Y],
-                        machine_pos->axis[AXIS_Z]);
+            if (PointStoreSet(session->saved_points, bank, b, machine_pos)) {
+                JoystickRumble(rumble, RUMBLE_DOUBLE);  // Feedback: stored.
+                if (!quiet) {
+                    fprintf(stderr, "\nStored in %d/%d (%.2f, %.2f, %.2f)\n",
+                            bank, b, machine_pos->axis[AXIS_X],
+                            machine_pos->axis[AXIS_Y],
+                            machine_pos->axis[AXIS_Z]);
+                }
+            } else {
+                if (!quiet) fprintf(stderr, "\nCan't store in %d\n", b);
+                JoystickRumble(rumble, RUMBLE_BUZZ);
             }
         } else {
-            if (storage->axis[AXIS_X] >= 0) {
-                *machine_pos = *storage;
+            if (PointStoreGet(session->saved_points, bank, b, &stored)) {
                 if (!quiet) {
-                    fprintf(
-                      stderr, "\nGoto position %d -> (%.2f, %.2f, %.2f)\n", b,
-                      machine_pos->axis[AXIS_X], machine_pos->axis[AXIS_Y],
-                      machine_pos->axis[AXIS_Z]);
+                    fprintf(stderr,
+                            "\nGoto position %d/%d -> (%.2f, %.2f, %.2f)\n",
+                            bank, b, stored.axis[AXIS_X], stored.axis[AXIS_Y],
+                            stored.axis[AXIS_Z]);
                 }
-                GCodeGoto(machine_pos, max_feedrate_mm_p_sec_xy);
+                GCodeRoute(session, &stored);
             } else {
-                if (!quiet) fprintf(stderr, "\nButton %d undefined\n", b);
+                if (!quiet) {
+                    fprintf(stderr, "\nButton %d undefined in bank %d\n", b,
+                            bank);
+                }
+                JoystickRumble(rumble, RUMBLE_BUZZ);
             }
         }
         *accumulated_timeout = -1;
     }
 }
 
-// Wait for the initial start-up of the machine and any initial
-// chatter to subside (usually after connect, the printer/CNC machine resets
-// and sends a bunch of configuration info before it is ready to start)
-static void WaitForMachineStartup(int timeout_ms) {
-    // Skip initial stuff coming from the machine. We need to have
-    // a defined starting way to read the absolute coordinates.
-    // Wait until board is initialized. Some Marlin versions dump some
-    // stuff out there which we want to ignore.
-    fprintf(gcode_out, "G21\n");  // Tickeling the serial line
-    if (!quiet) fprintf(stderr, "Wait for initialization [");
-    const int discarded = DiscardAllInput(timeout_ms);
-    if (!quiet) fprintf(stderr, "] done (discarded %d bytes).\n", discarded);
-    if (!quiet && discarded <= 0) {
+// Time the machine gets to answer a readiness probe before we ask again.
+static const int kProbeIntervalMs = 500;
+
+// Ask the machine if it is ready. The probe is not accounted for in the
+// window of commands in flight, as it might be sent several times until the
+// machine listens; the link keeps count of the answers still to come.
+static void ProbeMachine(struct JogSession *session) {
+    if (session->options.simulate) return;
+    const char *probe = session->firmware->probe;
+    MachineLinkSendProbe(session->machine, probe, strlen(probe));
+    session->last_probe_usec = JoystickInputNowUsec();
+}
+
+// Wait for the initial start-up of the machine. Usually after connect, the
+// printer/CNC machine resets and sends a bunch of configuration info before
+// it is ready to start; if it was already running, it answers right away.
+// So we keep probing until the first 'ok' we get back, and then wait for
+// the answers to the other probes, so that none of them is taken for the
+// 'ok' of a command.
+static void WaitForMachineStartup(struct JogSession *session) {
+    if (session->options.simulate) return;
+    const struct Firmware *const firmware = session->firmware;
+    if (!quiet) {
+        fprintf(stderr, "%sWait for machine to be ready.\n", session->label);
+    }
+    const int64_t deadline =
+      JoystickInputNowUsec() + session->options.startup_wait_ms * 1000LL;
+    char line[512];
+    bool ready = false;
+    int64_t now;
+    while ((!ready || MachineLinkProbesUnanswered(session->machine) > 0) &&
+           (now = JoystickInputNowUsec()) < deadline) {
+        const int64_t next_probe =
+          ready ? deadline : session->last_probe_usec + kProbeIntervalMs * 1000;
+        if (now >= next_probe) {
+            ProbeMachine(session);
+            continue;
+        }
+        const int r = MachineLinkReadLine(session->machine, line, sizeof(line),
+                                          (next_probe - now + 999) / 1000);
+        if (r < 0) break;
+        if (r == 0) continue;
+        if (!quiet) fprintf(stderr, "%s\n", line);
+        if (firmware->is_ack(line)) {
+            ready = true;
+        } else if (firmware->boot_banner &&
+                   strncmp(line, firmware->boot_banner,
+                           strlen(firmware->boot_banner)) == 0) {
+            // Just booted; probes sent before are lost. Ask right away.
+            MachineLinkForgetProbes(session->machine);
+            ready = false;
+            ProbeMachine(session);
+        }
+    }
+    if (!quiet) {
+        if (ready) {
+            fprintf(stderr, "%sMachine ready after %.0fms.\n", session->label,
+                    (JoystickInputNowUsec() - program_start_usec) / 1000.0);
+        } else {
+            fprintf(stderr, "%sNo answer from machine. Serial line ok ?\n",
+                    session->label);
+        }
+    }
+}
+
+// Wait for the machine and switch on what needs to be agreed upon before
+// the first command. Returns false if the machine can't be used.
+static bool GetMachineReady(struct JogSession *session) {
+    WaitForMachineStartup(session);
+    return !session->options.line_numbers || session->options.simulate ||
+           MachineLinkSetLineNumbers(session->machine, true);
+}
+
+static void SetTickInterval(struct JogSession *session, int interval_ms) {
+    if (interval_ms == session->tick_ms) return;
+    session->tick_ms = interval_ms;
+    EventLoopSetTimerInterval(session->loop, session->tick_timer_fd,
+                              interval_ms);
+}
+
+// Take the session out of the event loop and stop it; the other sessions
+// go on in theirs. The rest is cleaned up once the loop is done.
+static void EndSession(struct JogSession *session) {
+    if (!session->running) return;
+    session->running = false;
+    struct EventLoop *const loop = session->loop;
+    if (session->input_thread) {
+        EventLoopRemoveFd(loop, InputThreadFd(session->input_thread));
+    } else if (session->js) {
+        EventLoopRemoveFd(loop, JoystickInputFd(session->js));
+    }
+    if (session->machine_thread) {
+        EventLoopRemoveFd(loop, MachineThreadReportFd(session->machine_thread));
+    } else if (!session->options.simulate) {
+        EventLoopRemoveFd(loop, MachineLinkFd(session->machine));
+        if (session->host_proxy) HostProxyDetach(session->host_proxy);
+    }
+    EventLoopRemoveFd(loop, session->request_fd);
+    const int timers[] = {session->tick_timer_fd, session->poll_timer_fd,
+                          session->reconnect_timer_fd};
+    for (size_t i = 0; i < sizeof(timers) / sizeof(timers[0]); ++i) {
+        if (timers[i] >= 0) EventLoopRemoveFd(loop, timers[i]);
+    }
+    session->tick_timer_fd = session->poll_timer_fd = -1;
+    session->reconnect_timer_fd = -1;
+    EventLoopStop(loop);
+}
+
+// Integrate the movement requested by the current stick deflection up to
+// the given time.
+static void IntegrateTravel(struct JogSession *session, int64_t time_usec) {
+    int64_t dt_usec = time_usec - session->integrated_until_usec;
+    if (dt_usec <= 0) return;  // Event older than our last update.
+    if (dt_usec > 2000 * max_segment_ms) {
+        dt_usec = 2000 * max_segment_ms;  // We've been busy. Don't jump.
+    }
+    const float feedrate = JogFeedrate(session, &session->speed_vector);
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+        session->travel.axis[a] +=
+          session->speed_vector.axis[a] * feedrate * dt_usec / 1e6;
+    }
+    session->integrated_until_usec = time_usec;
+}
+
+// Forget about pending stick movement, e.g. after the position has been
+// set otherwise.
+static void ResetTravel(struct JogSession *session) {
+    memset(&session->travel, 0, sizeof(session->travel));
+    session->integrated_until_usec = JoystickInputNowUsec();
+    JogPlannerReset(&session->planner);
+    // That is where the machine is now; in the path if we're recording.
+    if (session->recording) {
+        TeachInAdd(session->teach_in, &session->machine_pos);
+    }
+}
+
+// Replace the travel requested by the stick within the last "dt_usec" with
+// what the planner allows.
+static void PlanTravel(struct JogSession *session, int64_t dt_usec) {
+    if (dt_usec > 2000 * max_segment_ms) dt_usec = 2000 * max_segment_ms;
+    if (dt_usec < 1000) dt_usec = 1000;
+    const float dt = dt_usec / 1e6;
+    struct Vector target_velocity;
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+        target_velocity.axis[a] = session->travel.axis[a] / dt;
+    }
+    if (JogPlannerStep(&session->planner, &target_velocity,
+                       &session->machine_pos, &session->options.machine_limits,
+                       dt, &session->travel)) {
+        JoystickRumble(&session->rumble, RUMBLE_TICK);  // Approaching limit.
+    }
+}
+
+// Stop the machine as fast as the firmware allows, without waiting for the
+// commands in flight. Reports how long it took from the button press.
+static void QuickStop(struct JogSession *session, int64_t pressed_usec) {
+    const struct Firmware *const firmware = session->firmware;
+    const bool simulate = session->options.simulate;
+    if (!simulate && firmware->quick_stop == NULL) {
+        fprintf(stderr, "\nNo quick-stop with %s firmware.\n", firmware->name);
+        JoystickRumble(&session->rumble, RUMBLE_BUZZ);
+        return;
+    }
+    if (!simulate) {
+        SendRealtime(session, firmware->quick_stop,
+                     strlen(firmware->quick_stop));
+    }
+    const int64_t sent_usec = JoystickInputNowUsec();
+    session->stopped = session->stick_active;
+    JoystickRumble(&session->rumble, RUMBLE_BUZZ);
+    int64_t rest_usec = sent_usec;
+    if (!simulate) {
+        AcquireMachine(session, true);  // Queued segments are obsolete.
+        // Commands dropped by the stop might never be acknowledged.
+        MachineLinkDiscardInput(session->machine, 100, false);
+        const bool at_rest = GetCoordinates(session, &session->machine_pos);
+        rest_usec = JoystickInputNowUsec();
+        if (at_rest && firmware->stop_flush) {
+            MachineLinkSendRealtime(session->machine, firmware->stop_flush,
+                                    strlen(firmware->stop_flush));
+            MachineLinkDiscardInput(session->machine, 200, false);
+        }
+        ReleaseMachine(session);
+        if (!at_rest) {
+            EndSession(session);
+            return;
+        }
+    }
+    ResetTravel(session);
+    if (!quiet) {
         fprintf(stderr,
-                "Mmmh, zero bytes is suspicious; we'd expect at least "
-                "some bytes. Serial line ok ?\n");
+                "\nStop: sent %.1fms after button press, machine at rest "
+                "after %.1fms\n",
+                (sent_usec - pressed_usec) / 1000.0,
+                (rest_usec - pressed_usec) / 1000.0);
     }
 }
 
-void JogMachine(int js_fd, bool do_homing, const struct Vector *machine_limit,
-                const struct Configuration *config) {
-    struct Vector speed_vector;
-    struct Vector machine_pos;
-    memset(&speed_vector, 0, sizeof(speed_vector));
-    memset(&machine_pos, 0, sizeof(machine_pos));
-    struct Buttons *buttons = new_Buttons(config->highest_button + 1);
-    ReadSavedPoints(persistent_store, buttons);
+static void HandleButton(struct JogSession *session, int button_ev,
+                         int64_t time_usec) {
+    switch (button_ev) {
+    case JS_NO_BUTTON: break;
+
+    case JS_STOP_BUTTON: QuickStop(session, time_usec); break;
+
+    case JS_SHIFT_BUTTON:
+        session->saved_points_bank =
+          (session->saved_points_bank + 1) % POINT_STORE_BANKS;
+        // Two pulses when we are back at the first bank.
+        JoystickRumble(&session->rumble, session->saved_points_bank == 0
+                                           ? RUMBLE_DOUBLE
+                                           : RUMBLE_TICK);
+        if (!quiet) {
+            fprintf(stderr, "\nSaved points bank %d\n",
+                    session->saved_points_bank);
+        }
+        break;
+
+    case JS_HOME_BUTTON:  // only home if not already.
+        if (session->buttons->state[session->config.home_button].is_pressed &&
+            !session->is_homed) {
+            session->is_homed = 1;
+            GCodeHome(session);
+            if (!GetCoordinates(session, &session->machine_pos)) {
+                EndSession(session);
+            }
+            ResetTravel(session);
+        }
+        break;
+
+    default:
+        HandlePlaceMemory(session, button_ev);
+        session->last_button_ev = button_ev;
+        break;
+    }
+}
+
+// Stop the machine right away when the stick is released instead of letting
+// the segments in flight run out, if the firmware allows. Where exactly the
+// machine stops is up to it, so we need to ask for the position afterwards.
+static void CancelJog(struct JogSession *session) {
+    if (session->options.simulate || !session->firmware->jog_cancel) return;
+    SendRealtime(session, &session->firmware->jog_cancel, 1);
+    AcquireMachine(session, true);  // Queued segments are obsolete.
+    // Cancelled commands might not be acknowledged anymore.
+    MachineLinkDiscardInput(session->machine, 100, false);
+    const bool success = GetCoordinates(session, &session->machine_pos);
+    ReleaseMachine(session);
+    if (!success) EndSession(session);
+    ResetTravel(session);
+}
+
+// The joystick is gone. Stop moving, but keep the session with the machine
+// and wait for it to come back.
+static void DisconnectJoystick(struct JogSession *session) {
+    if (!quiet) fprintf(stderr, "%sJoystick unplugged\n", session->label);
+    if (joystick_watch == NULL || session->options.replay_file) {
+        GCodeEnsureMotorOff(session);  // Also the end of a replayed trace.
+        EndSession(session);
+        return;
+    }
+    EventLoopRemoveFd(session->loop,
+                      session->input_thread
+                        ? InputThreadFd(session->input_thread)
+                        : JoystickInputFd(session->js));
+    if (session->input_thread) delete_InputThread(&session->input_thread);
+    JoystickRumbleInit(&session->rumble, -1);
+    JoystickInputClose(&session->js);
+    memset(&session->speed_vector, 0, sizeof(session->speed_vector));
+    if (session->stick_active && !session->stopped) CancelJog(session);
+    session->stick_active = session->stopped = false;
+    ResetTravel(session);
+    if (!quiet) {
+        fprintf(stderr, "%sWaiting for joystick to come back.\n",
+                session->label);
+    }
+}
+
+static void OnJoystickReadable(void *user_data);
+
+// Pick up the joystick if it is there, with the configuration for its name.
+static bool ConnectJoystick(struct JogSession *session) {
+    const struct SessionOptions *const options = &session->options;
+    char path[512];
+    if (!JoystickFindDevice(options->joystick_spec, path, sizeof(path))) {
+        return false;
+    }
+    struct JoystickInput *js = JoystickInputOpen(path);
+    if (js == NULL) return false;  // No permission yet ?
+    char name[256];
+    if (options->config_name) {
+        snprintf(name, sizeof(name), "%s", options->config_name);
+    } else {
+        ConfigNameOf(js, name, sizeof(name));
+    }
+    struct Configuration config;
+    memset(&config, 0, sizeof(config));
+    if (ReadConfig(options->config_dir, name, &config) == 0) {
+        fprintf(stderr, "%s%s: no configuration %s in %s\n", session->label,
+                path, name, options->config_dir);
+        JoystickInputClose(&js);
+        return false;
+    }
+    JoystickInitialState(js, &config);
+    if (use_threads) session->input_thread = new_InputThread(js);
+    if (!EventLoopAddFd(session->loop,
+                        session->input_thread
+                          ? InputThreadFd(session->input_thread)
+                          : JoystickInputFd(js),
+                        &OnJoystickReadable, session)) {
+        if (session->input_thread) delete_InputThread(&session->input_thread);
+        JoystickInputClose(&js);
+        return false;
+    }
+    JoystickRumbleInit(&session->rumble, JoystickInputEventFd(js));
+    delete_Buttons(&session->buttons);
+    session->buttons = new_Buttons(config.highest_button + 1);
+    session->config = config;
+    session->js = js;
+    ResetTravel(session);
+    if (!quiet) {
+        fprintf(stderr, "%sJoystick %s back on %s\n", session->label, name,
+                path);
+    }
+    return true;
+}
+
+static void OnReconnectTimer(uint64_t expirations, void *user_data) {
+    (void)expirations;
+    struct JogSession *session = (struct JogSession *)user_data;
+    EventLoopRemoveFd(session->loop, session->reconnect_timer_fd);
+    session->reconnect_timer_fd = -1;
+    if (session->js == NULL) ConnectJoystick(session);
+}
+
+// The joystick of the session might be among new input devices. Once they
+// have settled, see if it is.
+static void LookForJoystick(struct JogSession *session) {
+    if (!session->running || session->js != NULL ||
+        session->reconnect_timer_fd >= 0) {
+        return;
+    }
+    session->reconnect_timer_fd = EventLoopAddTimer(
+      session->loop, kReconnectSettleMs, &OnReconnectTimer, session);
+}
 
-    fprintf(gcode_out, "G21\n");
-    WaitForOk();  // Switch to metric.
+// Ask a session for something; it sees to it in its own event loop.
+static void PostRequest(struct JogSession *session,
+                        enum SessionRequest request) {
+    atomic_fetch_or(&session->requests, request);
+    const uint64_t one = 1;
+    const ssize_t w = write(session->request_fd, &one, sizeof(one));
+    (void)w;  // Only fails if the counter overflows: it is awake then.
+}
 
-    char is_homed = 0;
+static void PostRequestToAll(enum SessionRequest request) {
+    for (int i = 0; i < session_count; ++i) PostRequest(sessions[i], request);
+}
 
-    if (do_homing) {
+// Input devices appeared; sessions missing their joystick have a look.
+static void OnJoystickWatch(void *user_data) {
+    (void)user_data;
+    if (JoystickWatchChanged(joystick_watch)) {
+        PostRequestToAll(REQUEST_RECONNECT);
+    }
+}
+
+static void OnJoystickReadable(void *user_data) {
+    struct JogSession *session = (struct JogSession *)user_data;
+    struct JoystickEvent events[64];
+    int count = 0;
+    while (session->running &&
+           (count = session->input_thread
+                      ? InputThreadRead(session->input_thread, events, 64)
+                      : JoystickInputRead(session->js, events, 64)) > 0) {
+        const int64_t now = JoystickInputNowUsec();
+        session->stats.events += count;
+        for (int i = 0; i < count && session->running; ++i) {
+            HistogramAdd(&session->stats.input_delay,
+                         now - events[i].time_usec);
+            if (events[i].type & JS_EVENT_AXIS) {
+                // Movement up to now was with the previous deflection.
+                IntegrateTravel(session, events[i].time_usec);
+                if (session->first_unsent_event_usec == 0)
+                    session->first_unsent_event_usec = events[i].time_usec;
+            }
+            const int button_ev =
+              JoystickHandleEvent(&events[i], &session->config,
+                                  &session->speed_vector, session->buttons);
+            HandleButton(session, button_ev, events[i].time_usec);
+        }
+        if (!session->running) return;
+        const bool active = JogFeedrate(session, &session->speed_vector) > 0;
+        if (session->stick_active && !active) {
+            if (session->stopped) {
+                session->stopped = false;  // Ready to jog again.
+                ResetTravel(session);
+            } else {
+                CancelJog(session);
+            }
+        }
+        session->stick_active = active;
+        if (session->tick_ms != session->segment_ms) {
+            // Back from idle. Tick right away; it covers from now on.
+            session->last_tick_usec = now;
+            session->tick_ms = session->segment_ms;
+            EventLoopRestartTimer(session->loop, session->tick_timer_fd, 0,
+                                  session->segment_ms);
+        }
+    }
+    if (count < 0 && session->running) DisconnectJoystick(session);
+}
+
+// Collect the 'ok's as they arrive, so that there is room in the window for
+// the next segment.
+static void OnMachineReadable(void *user_data) {
+    struct JogSession *session = (struct JogSession *)user_data;
+    if (MachineLinkPoll(session->machine) < 0) {
+        fprintf(stderr, "%sLost connection to machine\n", session->label);
+        EndSession(session);
+    }
+}
+
+// Time after the last segment when a machine that can't tell if it is
+// moving has worked through its queue for sure.
+static const int64_t kSettleUsec = 2000000;
+static const float kPositionToleranceMm = 0.02;  // Reports are rounded.
+static const int kPositionPollMs = 250;
+
+// The machine told us where it is. Keep track how far it lags behind the
+// position we commanded; once it came to rest, that is where we are, and
+// everything we assumed otherwise is corrected.
+static void HandlePosition(struct JogSession *session,
+                           enum FirmwarePosition type,
+                           const struct Vector *reported, int64_t usec) {
+    if (usec < session->coordinates_read_usec ||
+        session->reading_coordinates) {
+        return;
+    }
+    struct JogStats *const stats = &session->stats;
+    stats->position_reports++;
+    float squared = 0;
+    for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+        const float d = reported->axis[a] - session->machine_pos.axis[a];
+        squared += d * d;
+    }
+    const float lag_mm = sqrtf(squared);
+    stats->position_lag_um = lag_mm * 1000;
+    if (stats->position_lag_um > stats->max_position_lag_um) {
+        stats->max_position_lag_um = stats->position_lag_um;
+    }
+
+    if (type != FIRMWARE_POSITION || session->stick_active ||
+        lag_mm <= kPositionToleranceMm) {
+        return;
+    }
+    struct MachineLinkStatus status;
+    GetLinkStatus(session, &status);
+    if (status.in_flight > 0 ||
+        (session->machine_thread &&
+         MachineThreadQueued(session->machine_thread) > 0)) {
+        return;
+    }
+    if (!session->firmware->position_shows_motion &&
+        usec - session->last_segment_usec < kSettleUsec) {
+        return;
+    }
+    if (!quiet) {
+        fprintf(stderr,
+                "Machine is at (x/y/z) = (%.3f/%.3f/%.3f), %.3fmm off; "
+                "correcting.\n",
+                reported->axis[AXIS_X], reported->axis[AXIS_Y],
+                reported->axis[AXIS_Z], lag_mm);
+    }
+    stats->position_corrections++;
+    session->machine_pos = *reported;
+    GCodeEncoderReset(&session->encoder);  // Next segment needs all axes.
+    ResetTravel(session);
+}
+
+// Sees replies from the machine, without threads.
+static void OnMachineLine(const char *line, void *user_data) {
+    struct JogSession *session = (struct JogSession *)user_data;
+    struct Vector pos;
+    const enum FirmwarePosition type =
+      session->firmware->parse_position(line, &pos);
+    if (type == FIRMWARE_NO_POSITION) return;
+    HandlePosition(session, type, &pos, JoystickInputNowUsec());
+}
+
+// For machines that don't report their position by themselves.
+static void OnPositionPoll(uint64_t expirations, void *user_data) {
+    (void)expirations;
+    struct JogSession *session = (struct JogSession *)user_data;
+    const char *query = session->firmware->query_position;
+    SendRealtime(session, query, strlen(query));
+}
+
+// Reports from the machine thread, in threaded mode.
+static void OnMachineReport(void *user_data) {
+    struct JogSession *session = (struct JogSession *)user_data;
+    struct MachineReport report;
+    while (session->running &&
+           MachineThreadReadReport(session->machine_thread, &report)) {
+        switch (report.type) {
+        case MACHINE_REPORT_SENT:
+            HistogramAdd(&session->stats.queue_delay, report.usec);
+            break;
+        case MACHINE_REPORT_ROUND_TRIP:
+            HistogramAdd(&session->stats.round_trip, report.usec);
+            break;
+        case MACHINE_REPORT_STATUS:
+            session->link_status = report.status;
+            session->host_commands_reported = report.host_commands;
+            break;
+        case MACHINE_REPORT_POSITION:
+            HandlePosition(session, report.position_type, &report.position,
+                           report.usec);
+            break;
+        case MACHINE_REPORT_LOST:
+            fprintf(stderr, "%sLost connection to machine\n", session->label);
+            EndSession(session);
+            break;
+        }
+    }
+}
+
+static void AddRoundTrip(int64_t usec, void *user_data) {
+    HistogramAdd((struct Histogram *)user_data, usec);
+}
+
+// Choose the duration of the next jog segments. Long enough that the link
+// keeps up with the commands and the firmware planner does not run dry, but
+// as short as possible to keep the delay between stick and machine low.
+static void AdaptSegmentLength(struct JogSession *session) {
+    if (session->options.simulate || min_segment_ms == max_segment_ms) return;
+    struct MachineLinkStatus status;
+    GetLinkStatus(session, &status);
+    int wanted = session->segment_ms;
+    if (status.blocked_sends != session->last_blocked_sends ||
+        (session->machine_thread &&
+         MachineThreadQueued(session->machine_thread) > 1)) {
+        wanted = wanted * 5 / 4 + 1;  // Machine can't keep up with segments.
+    } else if (status.planner_size > 0 &&
+               status.planner_free > status.planner_size * 3 / 4) {
+        wanted = wanted * 5 / 4 + 1;  // Firmware planner runs dry.
+    } else {
+        wanted -= (wanted + 15) / 16;  // Slowly go back to lower latency.
+    }
+    session->last_blocked_sends = status.blocked_sends;
+
+    // With n commands in flight, we can send n commands per round trip.
+    if (status.round_trip_usec > 0) {
+        const int link_ms =
+          status.round_trip_usec * 3 / 2 / 1000 / status.max_commands;
+        if (wanted < link_ms) wanted = link_ms;
+    }
+    if (wanted < min_segment_ms) wanted = min_segment_ms;
+    if (wanted > max_segment_ms) wanted = max_segment_ms;
+    session->segment_ms = wanted;
+    SetTickInterval(session, wanted);
+}
+
+// The host sent commands since we last synced our position; it might have
+// moved the machine or switched to relative mode. Returns true if we are
+// ready to jog.
+static bool SyncWithHost(struct JogSession *session) {
+    if (session->host_proxy == NULL ||
+        HostCommandCount(session) == session->host_commands) {
+        return true;
+    }
+    session->last_motor_on_time = 0;  // Motors are the host's business now.
+    if (!session->stick_active) return false;
+    SendCommand(session, "G90\n");
+    if (!GetCoordinates(session, &session->machine_pos)) {
+        EndSession(session);
+        return false;
+    }
+    session->host_commands = HostCommandCount(session);
+    ResetTravel(session);
+    return false;
+}
+
+// Once there is nothing to move and no button to time, tick slowly until
+// the joystick is touched again.
+static void CheckIdle(struct JogSession *session) {
+    if (!session->running || session->stick_active ||
+        session->accumulated_timeout >= 0) {
+        return;
+    }
+    JogPlannerReset(&session->planner);  // Came to rest.
+    SetTickInterval(session, kIdleTickMs);
+}
+
+// Our regular update interval.
+static void OnJogTick(uint64_t expirations, void *user_data) {
+    struct JogSession *session = (struct JogSession *)user_data;
+    const int elapsed_ms = expirations * session->tick_ms;
+    struct Buttons *buttons = session->buttons;
+    if (expirations > 1) session->stats.late_ticks += expirations - 1;
+    HistogramAdd(&session->stats.tick_lateness,
+                 EventLoopTimerLateness(session->loop, session->tick_timer_fd));
+    if (session->accumulated_timeout >= 0) {
+        session->accumulated_timeout += elapsed_ms;
+        if (session->accumulated_timeout > 500) {  // auto-release long press.
+            assert(buttons->state[session->last_button_ev].is_pressed);
+            buttons->state[session->last_button_ev].is_pressed = 0;
+            HandlePlaceMemory(session, session->last_button_ev);
+        }
+    }
+    if (session->machine_thread &&
+        !MachineThreadHasRoom(session->machine_thread)) {
+        // Don't wait for room; the next tick will cover this one's travel.
+        session->stats.queue_full++;
+        return;
+    }
+    const int64_t now = JoystickInputNowUsec();
+    if (session->stopped || !SyncWithHost(session)) {
+        session->last_tick_usec = now;
+        CheckMotorTimeout(session);
+        CheckIdle(session);
+        return;
+    }
+    IntegrateTravel(session, now);
+    const int64_t interval_usec = now - session->last_tick_usec;
+    session->last_tick_usec = now;
+    if (JogPlannerEnabled(&session->planner)) {
+        PlanTravel(session, interval_usec);
+    }
+    const int64_t interval_ms = interval_usec / 1000;
+    const int bytes =
+      OutputJogGCode(session, interval_ms, &session->machine_pos,
+                     &session->travel, &session->options.machine_limits);
+    if (bytes > 0) {
+        // We did emit some gcode. Now we're not homed anymore
+        session->is_homed = 0;
+        const int64_t sent_usec = JoystickInputNowUsec();
+        const int64_t latency =
+          session->first_unsent_event_usec
+            ? sent_usec - session->first_unsent_event_usec
+            : -1;
+        JogStatsSegment(&session->stats, bytes, latency, sent_usec - now);
+        session->last_segment_usec = sent_usec;
+        session->first_unsent_event_usec = 0;
+        AdaptSegmentLength(session);
+    } else {
+        session->first_unsent_event_usec = 0;  // Nothing to move.
+        CheckMotorTimeout(session);
+        CheckIdle(session);
+    }
+}
+
+// Bring the counters kept elsewhere into our stats.
+static void CollectStats(struct JogSession *session) {
+    struct JogStats *const stats = &session->stats;
+    if (session->input_thread) {
+        stats->dropped_events = InputThreadDropped(session->input_thread);
+    } else if (session->js) {
+        stats->dropped_events = JoystickInputDropped(session->js);
+    }
+    stats->limit_hits = session->limit_hits;
+    stats->encoder_bytes = session->encoder.bytes;
+    stats->encoder_verbose_bytes = session->encoder.verbose_bytes;
+    if (!session->options.simulate) {
+        struct MachineLinkStatus status;
+        GetLinkStatus(session, &status);
+        stats->acks = status.acks;
+        stats->blocked_usec = status.blocked_usec;
+        stats->resent_lines = status.resent_lines;
+        stats->line_errors = status.line_errors;
+        stats->busy_replies = status.busy_replies;
+    }
+}
+
+static void WriteStats(struct JogSession *session) {
+    CollectStats(session);
+    if (session->stats_file == NULL) {
+        fprintf(stderr, "%s", session->label);
+        JogStatsWrite(&session->stats, stderr);
+    } else if (!JogStatsWriteFile(&session->stats, session->stats_file)) {
+        perror(session->stats_file);
+    }
+}
+
+static void OnStatsTimer(uint64_t expirations, void *user_data) {
+    (void)expirations;
+    (void)user_data;
+    PostRequestToAll(REQUEST_STATS);
+}
+
+// Simplify the path recorded so far and save it; recording stops.
+static void SaveTeachIn(struct JogSession *session) {
+    const struct SessionOptions *options = &session->options;
+    session->recording = false;
+    const int recorded = TeachInPoints(session->teach_in);
+    if (recorded < 2) {
+        fprintf(stderr, "%sNo path recorded.\n", session->label);
+        return;
+    }
+    const int kept =
+      TeachInSimplify(session->teach_in, options->teach_in_tolerance);
+    if (!TeachInWriteGCode(session->teach_in, options->teach_in_file,
+                           options->max_feedrate_xy, options->max_feedrate_z,
+                           options->resolution)) {
+        perror(options->teach_in_file);
+        return;
+    }
+    fprintf(stderr,
+            "%sSaved path to %s: %d segments within %.3fmm of %d points "
+            "recorded.\n",
+            session->label, options->teach_in_file, kept - 1,
+            options->teach_in_tolerance, recorded);
+}
+
+// Start recording the path anew, or stop and save it.
+static void ToggleTeachIn(struct JogSession *session) {
+    if (session->teach_in == NULL) return;
+    if (session->recording) {
+        SaveTeachIn(session);
+        return;
+    }
+    TeachInClear(session->teach_in);
+    session->recording = true;
+    TeachInAdd(session->teach_in, &session->machine_pos);
+    fprintf(stderr, "%sRecording path.\n", session->label);
+}
+
+// Requests posted to the session; see PostRequest().
+static void OnSessionRequest(void *user_data) {
+    struct JogSession *session = (struct JogSession *)user_data;
+    uint64_t count;
+    if (read(session->request_fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    const int requests = atomic_exchange(&session->requests, 0);
+    if (requests & REQUEST_STATS) WriteStats(session);
+    if (requests & REQUEST_TEACH_IN) ToggleTeachIn(session);
+    if (requests & REQUEST_RECONNECT) LookForJoystick(session);
+}
+
+// SIGUSR1 asks for the stats right now, SIGUSR2 starts or stops recording
+// the path.
+static void OnSignal(void *user_data) {
+    const int signal_fd = *(const int *)user_data;
+    struct signalfd_siginfo info;
+    if (read(signal_fd, &info, sizeof(info)) != sizeof(info)) return;
+    PostRequestToAll(info.ssi_signo == SIGUSR2 ? REQUEST_TEACH_IN
+                                               : REQUEST_STATS);
+}
+
+// Receive our signals through a file descriptor in the event loop, so that
+// we don't have to worry about being interrupted in the middle of things.
+static int OpenSignals(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) return -1;
+    return signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+}
+
+// Get the machine ready for jogging and hook the session into the event
+// loop. Returns false if the session can't start.
+static bool StartSession(struct JogSession *session, struct EventLoop *loop) {
+    const struct Firmware *const firmware = session->firmware;
+    const bool simulate = session->options.simulate;
+    session->loop = loop;
+    if (!GetMachineReady(session)) {
+        fprintf(stderr, "%sMachine not ready.\n", session->label);
+        return false;
+    }
+    JogPlannerInit(&session->planner, &session->options.max_accel,
+                   &session->options.max_jerk);
+
+    SendCommand(session, "G21\n");  // Switch to metric.
+
+    if (session->options.do_homing) {
         // Unfortunately, connecting to some Marlin instances resets it.
         // So home that we are in a defined state.
-        GCodeHome();
-        is_homed = 1;
+        GCodeHome(session);
+        session->is_homed = 1;
     }
 
     // Relative mode (G91) seems to be pretty badly implemented and does not
     // deal with very small increments (which are rounded away).
     // So let's be absolute and keep track of the current position ourself.
-    fprintf(gcode_out, "G90\n");
-    WaitForOk();  // Absolute coordinates.
+    SendCommand(session, "G90\n");  // Absolute coordinates.
 
-    if (!GetCoordinates(&machine_pos)) {
-        delete_Buttons(&buttons);
-        return;
+    if (simulate) {
+        // Start in the middle, so that there is room in all directions.
+        for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+            session->machine_pos.axis[a] =
+              session->options.machine_limits.axis[a] / 2;
+        }
     }
-
-    fprintf(stderr, "Ready for Input\n");
-
-    int64_t last_jog_time = 0;
-    int accumulated_timeout = -1;
-    int last_button_ev = 0;
-    bool done = false;
-    while (!done) {
-        int button_ev = JoystickWaitForButton(js_fd, interval_msec, config,
-                                              &speed_vector, buttons);
-        switch (button_ev) {
-        case JS_READ_ERROR:
-            if (!quiet) fprintf(stderr, "Joystick unplugged\n");
-            GCodeEnsureMotorOff();
-            done = true;
-            break;
-
-        case JS_REACHED_TIMEOUT: {  // timeout, i.e. our regular update
-                                    // interval.
-            if (accumulated_timeout >= 0) {
-                accumulated_timeout += interval_msec;
-                if (accumulated_timeout > 500) {  // auto-release long press.
-                    assert(buttons->state[last_button_ev].is_pressed);
-                    buttons->state[last_button_ev].is_pressed = 0;
-                    HandlePlaceMemory(last_button_ev, buttons,
-                                      &accumulated_timeout, &machine_pos);
-                }
+    if (!GetCoordinates(session, &session->machine_pos)) return false;
+
+    if (session->host_proxy) session->host_commands = HostCommandCount(session);
+    fprintf(stderr, "%sReady for Input (%.0fms after start)\n", session->label,
+            (JoystickInputNowUsec() - program_start_usec) / 1000.0);
+    ResetTravel(session);
+    session->last_tick_usec = session->integrated_until_usec;
+    JogStatsStart(&session->stats);
+    if (!simulate) {
+        MachineLinkSetRoundTripHandler(session->machine, &AddRoundTrip,
+                                       &session->stats.round_trip);
+    }
+    JoystickInputStartReplay(session->js);  // Now that we're ready.
+    if (use_threads) {
+        // Joystick events are read as they arrive, and commands are sent
+        // as soon as there is room, while we plan the next segments.
+        session->input_thread = new_InputThread(session->js);
+        if (!simulate && session->input_thread) {
+            MachineLinkGetStatus(session->machine, &session->link_status);
+            session->host_commands_reported = session->host_commands;
+            session->machine_thread = new_MachineThread(
+              session->machine, session->host_proxy, firmware);
+        }
+        if (!session->input_thread || (!simulate && !session->machine_thread)) {
+            if (session->input_thread) {
+                delete_InputThread(&session->input_thread);
             }
-            const int64_t now = get_time_millis();
-            if (OutputJogGCode(now - last_jog_time, &machine_pos, &speed_vector,
-                               machine_limit)) {
-                // We did emit some gcode. Now we're not homed anymore
-                is_homed = 0;
-                last_jog_time = now;
-            } else {
-                CheckMotorTimeout();
+            if (!simulate) {
+                MachineLinkSetRoundTripHandler(session->machine, NULL, NULL);
             }
-        } break;
+            return false;
+        }
+    }
+    // Follow where the machine actually is.
+    if (!simulate && !session->machine_thread) {
+        MachineLinkSetLineObserver(session->machine, &OnMachineLine, session);
+    }
+    if (!simulate && firmware->report_position) {
+        SendCommand(session, firmware->report_position);
+    }
+    const bool poll_position = !simulate && !firmware->report_position &&
+                               firmware->query_is_realtime;
+
+    // Everything is event driven from here: joystick events and replies
+    // from the machine are handled as they arrive, jog segments are
+    // generated at a fixed rate.
+    session->segment_ms = session->tick_ms = min_segment_ms;
+    session->running = true;
+    if (!EventLoopAddFd(loop, session->request_fd, &OnSessionRequest,
+                        session) ||
+        !EventLoopAddFd(loop,
+                        session->input_thread
+                          ? InputThreadFd(session->input_thread)
+                          : JoystickInputFd(session->js),
+                        &OnJoystickReadable, session) ||
+        (session->machine_thread &&
+         !EventLoopAddFd(loop, MachineThreadReportFd(session->machine_thread),
+                         &OnMachineReport, session)) ||
+        (!simulate && !session->machine_thread &&
+         !EventLoopAddFd(loop, MachineLinkFd(session->machine),
+                         &OnMachineReadable, session)) ||
+        (session->host_proxy && !session->machine_thread &&
+         !HostProxyAttach(session->host_proxy, loop)) ||
+        (session->tick_timer_fd = EventLoopAddTimer(
+           loop, session->tick_ms, &OnJogTick, session)) < 0 ||
+        (poll_position &&
+         (session->poll_timer_fd = EventLoopAddTimer(
+            loop, kPositionPollMs, &OnPositionPoll, session)) < 0)) {
+        fprintf(stderr, "%sCan't set up event loop\n", session->label);
+        EndSession(session);
+        return false;
+    }
+    return true;
+}
 
-        case JS_HOME_BUTTON:  // only home if not already.
-            if (buttons->state[config->home_button].is_pressed && !is_homed) {
-                is_homed = 1;
-                GCodeHome();
-                if (!GetCoordinates(&machine_pos)) done = true;
+// Wind down a session after the event loop is done with it.
+static void FinishSession(struct JogSession *session) {
+    const bool simulate = session->options.simulate;
+    EndSession(session);
+    if (!simulate && session->firmware->report_position_off) {
+        SendCommand(session, session->firmware->report_position_off);
+    }
+    // Machine thread first; it sends what is still queued.
+    if (session->machine_thread) delete_MachineThread(&session->machine_thread);
+    if (session->input_thread) delete_InputThread(&session->input_thread);
+    if (!simulate) {
+        MachineLinkSetRoundTripHandler(session->machine, NULL, NULL);
+        MachineLinkSetLineObserver(session->machine, NULL, NULL);
+    }
+    if (session->stats.start_usec == 0) return;  // Never got started.
+    if (session->recording) SaveTeachIn(session);
+    if (session->stats_file) WriteStats(session);
+    flockfile(stderr);  // Reports of sessions ending meanwhile come after.
+    const bool replaying = session->options.replay_file != NULL;
+    if (!quiet || (replaying && !daemon_mode)) {
+        fprintf(stderr, "%s", session->label);
+        JogStatsReport(&session->stats, stderr);
+    }
+    if (realtime) {
+        fprintf(stderr, "%s", session->label);
+        JogStatsJitterReport(&session->stats, kJitterTargetUsec, stderr);
+    }
+    const struct GCodeEncoder *encoder = &session->encoder;
+    if (!quiet && encoder->moves > 0) {
+        fprintf(stderr,
+                "\n%s%llu moves in %llu bytes; saved %llu bytes (%.0f%%) "
+                "with compact G-code.\n",
+                session->label, (unsigned long long)encoder->moves,
+                (unsigned long long)encoder->bytes,
+                (unsigned long long)(encoder->verbose_bytes - encoder->bytes),
+                100.0 * (encoder->verbose_bytes - encoder->bytes) /
+                  encoder->verbose_bytes);
+    }
+    if (!quiet && !simulate) {
+        struct MachineLinkStatus status;
+        MachineLinkGetStatus(session->machine, &status);
+        if (status.round_trip_usec >= 0) {
+            fprintf(stderr, "%sShortest round trip to machine: %.2fms\n",
+                    session->label, status.round_trip_usec / 1000.0);
+        }
+    }
+    funlockfile(stderr);
+}
+
+// What serving the sessions cost us, to see how that grows with their
+// number.
+static void ReportDaemonOverhead(uint64_t wakeups, int64_t start_usec,
+                                 int64_t start_cpu_usec) {
+    const double seconds = (JoystickInputNowUsec() - start_usec) / 1e6;
+    const double cpu_percent =
+      (ProcessCpuUsec() - start_cpu_usec) / 1e4 / (seconds > 0 ? seconds : 1);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(stderr,
+            "%d sessions for %.2fs: %.1f wakeups/s, cpu %.2f%% "
+            "(%.3f%% per session), max RSS %ldkB\n",
+            session_count, seconds, wakeups / seconds, cpu_percent,
+            cpu_percent / session_count, usage.ru_maxrss);
+}
+
+// Serves a session of the daemon in an event loop of its own.
+static void *SessionThread(void *user_data) {
+    struct JogSession *session = (struct JogSession *)user_data;
+    if (StartSession(session, session->loop)) EventLoopRun(session->loop);
+    FinishSession(session);
+    const uint64_t one = 1;
+    const ssize_t w = write(sessions_done_fd, &one, sizeof(one));
+    (void)w;  // Only fails if the counter overflows.
+    return NULL;
+}
+
+// Session threads are done; once all of them are, so are we.
+static void OnSessionsDone(void *user_data) {
+    uint64_t done;
+    if (read(sessions_done_fd, &done, sizeof(done)) != sizeof(done)) return;
+    running_sessions -= done;
+    if (running_sessions <= 0) EventLoopStop((struct EventLoop *)user_data);
+}
+
+// Start a thread for each session of the daemon. Those that can't be
+// started are left out. A loop per session rather than one for all, since
+// homing, reading the position and draining wait for the machine in place.
+static void StartSessionThreads(void) {
+    for (int i = 0; i < session_count; ++i) {
+        struct JogSession *session = sessions[i];
+        session->loop = new_EventLoop();
+        if (session->loop == NULL ||
+            RealtimeCreateThread(&session->thread, &SessionThread, session)) {
+            fprintf(stderr, "%sCan't start session thread\n", session->label);
+            if (session->loop) delete_EventLoop(&session->loop);
+            continue;
+        }
+        running_sessions++;
+    }
+}
+
+// Jog until the joysticks are gone for good or all machines are lost.
+// Returns the number of sessions that got started.
+static int RunSessions(void) {
+    struct EventLoop *loop = new_EventLoop();
+    if (loop == NULL) return 0;
+    int signal_fd = OpenSignals();
+    if (daemon_mode) sessions_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((signal_fd >= 0 &&
+         !EventLoopAddFd(loop, signal_fd, &OnSignal, &signal_fd)) ||
+        (stats_file && EventLoopAddTimer(loop, stats_interval_sec * 1000,
+                                         &OnStatsTimer, NULL) < 0) ||
+        (joystick_watch &&
+         !EventLoopAddFd(loop, JoystickWatchFd(joystick_watch),
+                         &OnJoystickWatch, NULL)) ||
+        (daemon_mode &&
+         (sessions_done_fd < 0 ||
+          !EventLoopAddFd(loop, sessions_done_fd, &OnSessionsDone, loop)))) {
+        fprintf(stderr, "Can't set up event loop\n");
+    } else if (daemon_mode) {
+        StartSessionThreads();
+    } else if (StartSession(sessions[0], loop)) {
+        running_sessions = 1;  // EndSession() stops our loop then.
+    }
+    const int64_t start_usec = JoystickInputNowUsec();
+    const int64_t start_cpu_usec = ProcessCpuUsec();
+    if (running_sessions > 0) EventLoopRun(loop);
+    uint64_t wakeups = EventLoopWakeups(loop);
+    int started = 0;
+    for (int i = 0; i < session_count; ++i) {
+        struct JogSession *session = sessions[i];
+        if (!daemon_mode) {
+            FinishSession(session);
+        } else if (session->loop) {
+            pthread_join(session->thread, NULL);
+            wakeups += EventLoopWakeups(session->loop);
+            delete_EventLoop(&session->loop);
+        }
+        if (session->stats.start_usec != 0) started++;
+    }
+    if (daemon_mode) ReportDaemonOverhead(wakeups, start_usec, start_cpu_usec);
+    delete_EventLoop(&loop);
+    if (signal_fd >= 0) close(signal_fd);
+    if (sessions_done_fd >= 0) close(sessions_done_fd);
+    return started;
+}
+
+// Open the joystick of a session, or the trace replayed instead. Stores the
+// name of its configuration in "config_name".
+static struct JoystickInput *OpenJoystick(const struct SessionOptions *options,
+                                          char *config_name, size_t len) {
+    // Preferably, we read the event device directly; only if that is not
+    // available, fall back to the joystick API.
+    char path[512];
+    if (options->replay_file != NULL) {
+        snprintf(path, sizeof(path), "%s", options->replay_file);
+    } else if (!JoystickFindDevice(options->joystick_spec, path,
+                                   sizeof(path))) {
+        fprintf(stderr, "No joystick %s found\n",
+                options->joystick_spec ? options->joystick_spec : "");
+        return NULL;
+    }
+    struct JoystickInput *js = options->replay_file
+                                 ? JoystickInputOpenReplay(path)
+                                 : JoystickInputOpen(path);
+    if (js == NULL) {
+        perror(path);
+        return NULL;
+    }
+    if (options->record_file != NULL &&
+        !JoystickInputRecord(js, options->record_file)) {
+        perror(options->record_file);
+        JoystickInputClose(&js);
+        return NULL;
+    }
+    if (options->config_name) {
+        snprintf(config_name, len, "%s", options->config_name);
+    } else {
+        ConfigNameOf(js, config_name, len);
+    }
+    if (!quiet) {
+        fprintf(stderr, "joystick configuration name: %s\n", config_name);
+    }
+    return js;
+}
+
+static void delete_JogSession(struct JogSession **session) {
+    struct JogSession *s = *session;
+    if (s->js) JoystickInputClose(&s->js);
+    if (s->buttons) delete_Buttons(&s->buttons);
+    if (s->host_proxy) delete_HostProxy(&s->host_proxy);
+    if (s->machine) delete_MachineLink(&s->machine);
+    if (s->machine_fd >= 0) close(s->machine_fd);
+    if (s->saved_points) delete_PointStore(&s->saved_points);
+    if (s->teach_in) delete_TeachIn(&s->teach_in);
+    if (s->request_fd >= 0) close(s->request_fd);
+    free(s);
+    *session = NULL;
+}
+
+// Connect to the machine of a session. Returns NULL on failure.
+static struct JogSession *new_JogSession(const struct SessionOptions *opts) {
+    struct JogSession *session =
+      (struct JogSession *)calloc(1, sizeof(struct JogSession));
+    session->options = *opts;
+    session->firmware = opts->firmware;
+    session->machine_fd = -1;
+    session->tick_timer_fd = session->poll_timer_fd = -1;
+    session->reconnect_timer_fd = -1;
+    session->accumulated_timeout = -1;
+    session->rumble.device_fd = -1;
+    atomic_init(&session->requests, 0);
+    session->request_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (daemon_mode) {
+        snprintf(session->label, sizeof(session->label), "%s: ", opts->name);
+    }
+    session->stats_file = stats_file;
+    if (daemon_mode && stats_file) {
+        snprintf(session->stats_path, sizeof(session->stats_path), "%s.%s",
+                 stats_file, opts->name);
+        session->stats_file = session->stats_path;
+    }
+
+    session->saved_points = new_PointStore(opts->points_file);
+    if (session->request_fd < 0 || session->saved_points == NULL) {
+        delete_JogSession(&session);
+        return NULL;
+    }
+
+    // Connection to the machine reading gcode. Either we are wired up
+    // by the caller via stdin/stdout, or we connect ourselves.
+    int machine_in = STDIN_FILENO;
+    int machine_out = STDOUT_FILENO;
+    if (opts->machine_device != NULL && !opts->simulate) {
+        session->machine_fd = OpenMachinePort(opts->machine_device, opts->baud);
+        if (session->machine_fd < 0) {
+            delete_JogSession(&session);
+            return NULL;
+        }
+        machine_in = machine_out = session->machine_fd;
+    }
+    session->machine =
+      new_MachineLink(machine_in, machine_out, opts->max_commands_in_flight,
+                      opts->max_bytes_in_flight);
+    MachineLinkSetAckMatcher(session->machine, session->firmware->is_ack);
+    GCodeEncoderInit(&session->encoder, opts->resolution);
+    GCodeEncoderSetCommand(&session->encoder, session->firmware->jog_command,
+                           session->firmware->jog_needs_feedrate);
+    if (opts->host_spec != NULL && !opts->simulate) {
+        session->host_proxy =
+          new_HostProxy(opts->host_spec, session->machine, session->firmware);
+        if (session->host_proxy == NULL) {
+            delete_JogSession(&session);
+            return NULL;
+        }
+    }
+    if (opts->teach_in_file != NULL) {
+        session->teach_in = new_TeachIn();
+        session->recording = true;
+    }
+    // While the machine is busy answering, we look at the joystick.
+    ProbeMachine(session);
+    return session;
+}
+
+// Open the joystick of a session. Returns false on failure.
+static bool OpenSessionJoystick(struct JogSession *session) {
+    const struct SessionOptions *opts = &session->options;
+    char config_name[512];
+    session->js = OpenJoystick(opts, config_name, sizeof(config_name));
+    if (session->js == NULL) return false;
+    if (ReadConfig(opts->config_dir, config_name, &session->config) == 0) {
+        fprintf(stderr,
+                "%sProblem reading joystick config file.\n"
+                "Create a fresh one with\n\t%s -C %s\n",
+                session->label, program_name, opts->config_dir);
+        return false;
+    }
+    JoystickInitialState(session->js, &session->config);
+    JoystickRumbleInit(&session->rumble, JoystickInputEventFd(session->js));
+    if (JoystickInputEventFd(session->js) < 0) {
+        fprintf(stderr, "%sNo rumble available.\n", session->label);
+    }
+    session->buttons = new_Buttons(session->config.highest_button + 1);
+    return true;
+}
+
+static bool AddSession(const struct SessionOptions *options) {
+    struct JogSession *session = new_JogSession(options);
+    if (session == NULL) return false;
+    if (!OpenSessionJoystick(session)) {
+        delete_JogSession(&session);
+        return false;
+    }
+    struct JogSession **grown = (struct JogSession **)realloc(
+      sessions, (session_count + 1) * sizeof(*grown));
+    if (grown == NULL) {
+        delete_JogSession(&session);
+        return false;
+    }
+    sessions = grown;
+    sessions[session_count++] = session;
+    return true;
+}
+
+// Read the sessions to serve from a file with a line per machine:
+//   <name> <options>
+// The options are those of a single session, as on the command line;
+// '#' starts a comment.
+static bool ReadDaemonConfig(const char *filename) {
+    FILE *in = fopen(filename, "r");
+    if (in == NULL) {
+        perror(filename);
+        return false;
+    }
+    static const char kBlanks[] = " \t\r\n";
+    char line[1024];
+    int line_no = 0;
+    bool success = true;
+    while (success && fgets(line, sizeof(line), in)) {
+        ++line_no;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        char *rest;
+        const char *name = strtok_r(line, kBlanks, &rest);
+        if (name == NULL) continue;  // Empty line.
+        struct SessionOptions options;
+        SessionOptionsInit(&options);
+        options.name = strdup(name);
+        const char *word;
+        while (success && (word = strtok_r(NULL, kBlanks, &rest))) {
+            const char *spec = (word[0] == '-' && word[1] && !word[2])
+                                 ? strchr(SESSION_OPTIONS, word[1])
+                                 : NULL;
+            const bool needs_arg = spec && spec[1] == ':';
+            const char *arg = needs_arg ? strtok_r(NULL, kBlanks, &rest)
+                                        : NULL;
+            success = spec && *spec != ':' && (arg || !needs_arg) &&
+                      ParseSessionOption(&options, word[1], arg);
+        }
+        if (success && options.config_dir == NULL) {
+            fprintf(stderr, "Missing -j <config-dir>\n");
+            success = false;
+        }
+        if (success && !options.machine_device && !options.simulate) {
+            fprintf(stderr, "Missing -d <device> (or -s)\n");
+            success = false;
+        }
+        success = success && FinishSessionOptions(&options);
+        if (!success) {
+            fprintf(stderr, "%s:%d: invalid session %s\n", filename, line_no,
+                    name);
+        }
+        if (success && !AddSession(&options)) {
+            // Its machine might be off; the others can still be served.
+            fprintf(stderr, "%s:%d: can't serve %s; skipping it\n", filename,
+                    line_no, name);
+        }
+    }
+    fclose(in);
+    if (success && session_count == 0) {
+        fprintf(stderr, "%s: no sessions\n", filename);
+        success = false;
+    }
+    return success;
+}
+
+// Copy saved points between the store and text files ("-": stdin/stdout).
+static bool ImportExportPoints(struct PointStore *saved_points,
+                               const char *import_file,
+                               const char *export_file) {
+    if (import_file) {
+        FILE *in = strcmp(import_file, "-") == 0 ? stdin
+                                                 : fopen(import_file, "r");
+        if (in == NULL) {
+            perror(import_file);
+            return false;
+        }
+        int bad_lines;
+        const int count = PointStoreImport(saved_points, in, &bad_lines);
+        if (in != stdin) fclose(in);
+        fprintf(stderr, "Imported %d saved points\n", count);
+        if (bad_lines > 0) {
+            fprintf(stderr, "Skipped %d lines that are not points\n",
+                    bad_lines);
+        }
+    }
+    if (export_file) {
+        FILE *out = strcmp(export_file, "-") == 0 ? stdout
+                                                  : fopen(export_file, "w");
+        if (out == NULL) {
+            perror(export_file);
+            return false;
+        }
+        PointStoreExport(saved_points, out);
+        if (out != stdout && fclose(out) != 0) {
+            perror(export_file);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Stream a G-code file, such as a path saved with -W, to the machine of the
+// session as fast as it takes it: the link window is the only limit. The
+// file is mapped copy-on-write, so comments are cut from each line in place
+// and it goes out straight from the mapping.
+static bool PlayGCode(struct JogSession *session, const char *filename) {
+    const int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(filename);
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    const size_t size = st.st_size;
+    char *const data =
+      size > 0 ? (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                              fd, 0)
+               : NULL;
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(filename);
+        return false;
+    }
+    if (data) posix_madvise(data, size, POSIX_MADV_SEQUENTIAL);
+
+    if (!GetMachineReady(session)) {
+        if (data) munmap(data, size);
+        return false;
+    }
+    // Defaults the file might have been written for; it can change them.
+    SendCommand(session, "G21\n");
+    SendCommand(session, "G90\n");
+    const int64_t start_usec = JoystickInputNowUsec();
+    bool success = true;
+    int lines = 0;
+    size_t bytes = 0;
+    char *const end = data + size;
+    for (char *line = data; success && line < end;) {
+        char *eol = (char *)memchr(line, '\n', end - line);
+        if (eol == NULL) eol = end;
+        char *next = eol + 1;
+        const int len = GCodeStripComments(line, eol - line, line);
+        if (len == 0 || *line == '%') {
+            line = next;  // Nothing to send.
+            continue;
+        }
+        char copy[256];
+        char *send = line;
+        if (line + len == end) {  // Last line, no newline and no room for it.
+            if (len + 1 > (int)sizeof(copy)) {
+                fprintf(stderr, "%s: line %d too long\n", filename,
+                        lines + 1);
+                success = false;
+                break;
             }
-            break;
+            memcpy(copy, line, len);
+            send = copy;
+        }
+        send[len] = '\n';
+        if (!session->options.simulate) {
+            success = SendRaw(session, send, len + 1);
+        }
+        ++lines;
+        bytes += len + 1;
+        line = next;
+    }
+    if (data) munmap(data, size);
 
-        default:
-            HandlePlaceMemory(button_ev, buttons, &accumulated_timeout,
-                              &machine_pos);
-            last_button_ev = button_ev;
-            break;
+    struct Vector pos;
+    if (success) success = FinishMoves(session, &pos);
+    const double seconds = (JoystickInputNowUsec() - start_usec) / 1e6;
+    if (!quiet) {
+        fprintf(stderr, "%s: %d lines in %zu bytes, %.2fs (%.0f lines/s)\n",
+                filename, lines, bytes, seconds,
+                seconds > 0 ? lines / seconds : 0);
+    }
+    return success;
+}
+
+// Go through a sequence of stored points, given as "[<bank>/]<slot>,...",
+// each on the route GCodeRoute() takes. All moves go out as one batch,
+// pipelined as deep as the window allows.
+static bool VisitPoints(struct JogSession *session, const char *sequence) {
+    struct Vector *points = NULL;
+    int count = 0;
+    for (const char *p = sequence; *p;) {
+        char *end;
+        long bank = 0;
+        long slot = strtol(p, &end, 10);
+        if (end != p && *end == '/') {
+            bank = slot;
+            p = end + 1;
+            slot = strtol(p, &end, 10);
+        }
+        if (end == p || (*end != ',' && *end != '\0') || bank < 0 ||
+            bank >= POINT_STORE_BANKS || slot < 0 ||
+            slot >= POINT_STORE_SLOTS) {
+            fprintf(stderr, "Invalid point '%s' in -V %s\n", p, sequence);
+            free(points);
+            return false;
+        }
+        struct Vector *grown =
+          (struct Vector *)realloc(points, (count + 1) * sizeof(*points));
+        if (grown == NULL) {
+            free(points);
+            return false;
+        }
+        points = grown;
+        if (!PointStoreGet(session->saved_points, bank, slot,
+                           &points[count])) {
+            fprintf(stderr, "No point stored in %ld/%ld\n", bank, slot);
+            free(points);
+            return false;
         }
+        ++count;
+        p = (*end == ',') ? end + 1 : end;
+    }
+    bool success = GetMachineReady(session);
+    if (success) {
+        // A host or an earlier program might have left other modes.
+        SendCommand(session, "G21\n");
+        SendCommand(session, "G90\n");
+        success = GetCoordinates(session, &session->machine_pos);
+    }
+    const int64_t start_usec = JoystickInputNowUsec();
+    for (int i = 0; success && i < count; ++i) {
+        GCodeRoute(session, &points[i]);
+    }
+    free(points);
+    struct Vector pos;
+    if (success) success = FinishMoves(session, &pos);
+    if (!quiet && success) {
+        fprintf(stderr, "Visited %d points with %llu moves in %.2fs\n",
+                count, (unsigned long long)session->encoder.moves,
+                (JoystickInputNowUsec() - start_usec) / 1e6);
     }
-    delete_Buttons(&buttons);
+    return success;
 }
 
-static int usage(const char *progname, int initial_time) {
+static bool CreateJoystickConfig(const struct SessionOptions *options) {
+    char config_name[512];
+    struct JoystickInput *js =
+      OpenJoystick(options, config_name, sizeof(config_name));
+    if (js == NULL) return false;
+    struct Configuration config;
+    memset(&config, 0, sizeof(config));
+    CreateConfig(js, &config);
+    WriteConfig(options->config_dir, config_name, &config);
+    JoystickInputClose(&js);
+    return true;
+}
+
+static int usage(const char *progname) {
     fprintf(stderr,
             "Usage: %s <options>\n"
             "  -C <config-dir>  : Create a configuration file for Joystick, "
@@ -504,146 +2214,231 @@ static int usage(const char *progname, int initial_time) {
             "  -j <config-dir>  : Jog machine using config from directory.\n"
             "  -n <config-name> : Optional config name; otherwise derived from "
             "joystick name\n"
-            "  -i <init-ms>     : Wait time for machine to initialize "
+            "  -g <joystick>    : Joystick to use: name (or part of it) or "
+            "/dev/input path\n"
+            "                     (default: first joystick)\n"
+            "  -D <file>        : Daemon: serve the joystick/machine pairs "
+            "listed in file,\n"
+            "                     one per line: <name> <options of the "
+            "session>\n"
+            "  -G <gcode-file>  : Play G-code file, e.g. a path saved with "
+            "-W, at full speed\n"
+            "  -V <points>      : Visit stored points [<bank>/]<slot>,... "
+            "at full speed\n"
+            "  -W <file>[,<mm>] : Record the path jogged along into G-code "
+            "file, kept within\n"
+            "                     mm (default %.2f); SIGUSR2 saves, or "
+            "starts again\n"
+            "  -i <init-ms>     : Max. wait time for machine to get ready "
             "(default %d)\n"
+            "  -d <device>      : Connect to machine directly instead of "
+            "stdin/stdout:\n"
+            "                     /dev/tty..., tcp:<host>:<port> or "
+            "unix:<path>\n"
+            "  -b <baud>        : Baud rate for serial device (default %d)\n"
+            "  -R <trace-file>  : Record joystick events into trace file\n"
+            "  -t <trace-file>  : Replay joystick trace instead of reading "
+            "joystick\n"
+            "  -M <file>[,<sec>]: Write stats to file every <sec> seconds "
+            "(default 10)\n"
+            "                     and on SIGUSR1 (without -M: on stderr)\n"
+            "  -T               : Threads for joystick and machine I/O\n"
+            "  -N               : Line numbers and checksums; corrupted "
+            "lines are resent\n"
+            "  --realtime[=<prio>[,<cpu>]]: Real-time priority (default %d), "
+            "pinned to cpu;\n"
+            "                     reports jitter of segment ticks\n"
+            "  -P <host-spec>   : Share machine with a host program on "
+            "unix:<path> or pty:<path>\n"
+            "  -f <firmware>    : Firmware of the machine: marlin, grbl, "
+            "klipper, beagleg (default marlin)\n"
             "  -h               : Home on startup\n"
             "  -p <persist-file>: persist saved points in given file\n"
+            "  -I <text-file>   : Import saved points from text file "
+            "into -p file, then exit\n"
+            "  -E <text-file>   : Export saved points of -p file as text "
+            "('-': stdout), then exit\n"
             "  -L <x,y,z>       : Machine limits in mm\n"
             "  -x <speed>       : feedrate for xy in mm/s\n"
             "  -z <speed>       : feedrate for z in mm/s\n"
+            "  -Z <height>      : Lift to at least this Z (mm) before going "
+            "to stored points\n"
+            "  -A <xy>[,<z>]    : Max jog acceleration in mm/s^2 "
+            "(default %.0f,%.0f; 0: off)\n"
+            "  -J <xy>[,<z>]    : Max jog jerk in mm/s^3 "
+            "(default %.0f,%.0f; 0: unlimited)\n"
+            "  -r <digits>      : Resolution: digits after decimal point "
+            "(default %d)\n"
+            "  -S <min>[,<max>] : Range of jog segment duration in ms; "
+            "adapted to link (default %d,%d)\n"
+            "  -w <cmds>[,<bytes>]: Max commands (and bytes) in flight to "
+            "machine (default %d)\n"
             "  -s               : machine not connected; simulate.\n"
             "  -q               : Quiet. No chatter on stderr.\n",
-            progname, initial_time);
+            progname, kDefaultTeachInToleranceMm, kDefaultStartupWaitMs,
+            kDefaultBaud,
+            REALTIME_DEFAULT_PRIORITY, kDefaultAccel_xy, kDefaultAccel_z,
+            kDefaultJerk_xy, kDefaultJerk_z, kDefaultResolution,
+            min_segment_ms, max_segment_ms, kDefaultCommandsInFlight);
     return 1;
 }
 
 int main(int argc, char **argv) {
-    max_feedrate_mm_p_sec_xy = kMaxFeedrate_xy;
-    max_feedrate_mm_p_sec_z = kMaxFeedrate_z;
-    bool do_homing = false;
-    struct Configuration config;
-    memset(&config, 0, sizeof(config));
-    struct Vector machine_limits;
-    machine_limits.axis[AXIS_X] = machine_limits.axis[AXIS_Y] =
-      machine_limits.axis[AXIS_Z] = 305;
+    program_start_usec = JoystickInputNowUsec();
+    program_name = argv[0];
+    struct SessionOptions options;
+    SessionOptionsInit(&options);
 
     enum Operation { DO_NOTHING, DO_CREATE_CONFIG, DO_JOG } op = DO_NOTHING;
-    const char *config_dir = NULL;
-    char joystick_name[512];
-    memset(joystick_name, 0, sizeof(joystick_name));
-
-    int startup_wait_ms = 20000;
-
+    const char *daemon_file = NULL;
+    const char *play_file = NULL;
+    const char *visit_sequence = NULL;
+    const char *import_file = NULL;
+    const char *export_file = NULL;
+    int realtime_priority = REALTIME_DEFAULT_PRIORITY;
+    int realtime_cpu = -1;
+
+    const char *const option_chars = "C:D:G:V:M:TS:qI:E:" SESSION_OPTIONS;
+    static const struct option long_options[] = {
+      {"realtime", optional_argument, NULL, 'X'},
+      {NULL, 0, NULL, 0},
+    };
     int opt;
-    while ((opt = getopt(argc, argv, "C:j:x:z:L:hsp:q:n:i:")) != -1) {
+    while ((opt = getopt_long(argc, argv, option_chars, long_options,
+                              NULL)) != -1) {
         switch (opt) {
         case 'C':
             op = DO_CREATE_CONFIG;
-            config_dir = strdup(optarg);
+            options.config_dir = strdup(optarg);
             break;
 
-        case 'n':
-            strncpy(joystick_name, optarg, sizeof(joystick_name) - 1);
+        case 'j':
+            op = DO_JOG;
+            options.config_dir = strdup(optarg);
             break;
 
-        case 'h': do_homing = true; break;
-
-        case 's': simulate_machine = true; break;
+        case 'D': daemon_file = strdup(optarg); break;
 
-        case 'q': quiet = true; break;
+        case 'G': play_file = strdup(optarg); break;
 
-        case 'p': persistent_store = strdup(optarg); break;
+        case 'V': visit_sequence = strdup(optarg); break;
 
-        case 'i': startup_wait_ms = atoi(optarg); break;
+        case 'T': use_threads = true; break;
 
-        case 'x':
-            max_feedrate_mm_p_sec_xy = atoi(optarg);
-            if (max_feedrate_mm_p_sec_xy <= 1) {
-                fprintf(stderr, "Peculiar value -x %d",
-                        max_feedrate_mm_p_sec_xy);
-                return usage(argv[0], startup_wait_ms);
+        case 'X':
+            realtime = true;
+            if (optarg &&
+                (sscanf(optarg, "%d,%d", &realtime_priority, &realtime_cpu) <
+                   1 ||
+                 realtime_priority < 1 || realtime_priority > 99)) {
+                fprintf(stderr, "Invalid --realtime=%s\n", optarg);
+                return usage(argv[0]);
             }
             break;
 
-        case 'L':
-            // TODO: is there a gcode we can query ?
-            if (3 != sscanf(optarg, "%f,%f,%f", &machine_limits.axis[AXIS_X],
-                            &machine_limits.axis[AXIS_Z],
-                            &machine_limits.axis[AXIS_Z])) {
-                return usage(argv[0], startup_wait_ms);
+        case 'M': {
+            char *stats_spec = strdup(optarg);
+            char *comma = strchr(stats_spec, ',');
+            if (comma) {
+                *comma = '\0';
+                stats_interval_sec = atoi(comma + 1);
+            }
+            if (stats_interval_sec < 1) {
+                fprintf(stderr, "Invalid -M %s\n", optarg);
+                return usage(argv[0]);
             }
+            stats_file = stats_spec;
             break;
+        }
+
+        case 'q': quiet = true; break;
+
+        case 'I': import_file = strdup(optarg); break;
+
+        case 'E': export_file = strdup(optarg); break;
 
-        case 'z':
-            max_feedrate_mm_p_sec_z = atoi(optarg);
-            if (max_feedrate_mm_p_sec_z <= 1) {
-                fprintf(stderr, "Peculiar value -z %d",
-                        max_feedrate_mm_p_sec_z);
-                return usage(argv[0], startup_wait_ms);
+        case 'S': {
+            const int count =
+              sscanf(optarg, "%d,%d", &min_segment_ms, &max_segment_ms);
+            if (count == 1) max_segment_ms = min_segment_ms;
+            if (count < 1 || min_segment_ms < 1 ||
+                max_segment_ms < min_segment_ms) {
+                fprintf(stderr, "Invalid -S %s\n", optarg);
+                return usage(argv[0]);
             }
-            break;
+        } break;
 
-        case 'j':
-            op = DO_JOG;
-            config_dir = strdup(optarg);
-            break;
+        case '?': return usage(argv[0]);
 
-        default: /* '?' */ return usage(argv[0], startup_wait_ms);
+        default:
+            if (!ParseSessionOption(&options, opt, optarg)) {
+                return usage(argv[0]);
+            }
+            break;
         }
     }
 
-    if (op == DO_NOTHING) return usage(argv[0], startup_wait_ms);
+    if (import_file || export_file) {
+        if (options.points_file == NULL) {
+            fprintf(stderr, "Import and export need a file with -p\n");
+            return usage(argv[0]);
+        }
+        struct PointStore *saved_points = new_PointStore(options.points_file);
+        if (saved_points == NULL) return 1;
+        const bool success =
+          ImportExportPoints(saved_points, import_file, export_file);
+        delete_PointStore(&saved_points);
+        return success ? 0 : 1;
+    }
 
-    // Connection to the machine reading gcode. TODO: maybe provide
-    // listening on a socket ?
-    gcode_out = stdout;
-    gcode_in_fd = STDIN_FILENO;
-    setvbuf(gcode_out, NULL, _IONBF, 0);  // Don't buffer.
+    if (op == DO_NOTHING && daemon_file == NULL && play_file == NULL &&
+        visit_sequence == NULL) {
+        return usage(argv[0]);
+    }
 
     // Stderr might be piped to another process. Make sure to flush that
     // immediately.
     setvbuf(stderr, NULL, _IONBF, 0);
 
-    const int kJoystickId = 0;  // TODO: make configurable ?
+    if (play_file != NULL || visit_sequence != NULL) {
+        if (options.teach_in_file != NULL) {
+            fprintf(stderr, "-W records jogging; not with -G or -V\n");
+            return usage(argv[0]);
+        }
+        if (!FinishSessionOptions(&options)) return usage(argv[0]);
+        struct JogSession *session = new_JogSession(&options);
+        if (session == NULL) return 1;
+        const bool success = play_file ? PlayGCode(session, play_file)
+                                       : VisitPoints(session, visit_sequence);
+        delete_JogSession(&session);
+        return success ? 0 : 1;
+    }
 
-    // The Joystick. The first time we open it, the zero values are not
-    // yet properly established. So let's close the first instance right awawy
-    // and use the next open :)
-    // TODO: maybe not hardcode the joystick number. For now, expect it to be 0
-    close(open("/dev/input/js0", O_RDONLY));             // kJoystickId
-    const int js_fd = open("/dev/input/js0", O_RDONLY);  // kJoystickId
-    if (js_fd < 0) {
-        perror("Opening joystick");
-        return 1;
+    if (op == DO_CREATE_CONFIG) return CreateJoystickConfig(&options) ? 0 : 1;
+
+    if (daemon_file != NULL) {
+        daemon_mode = true;
+        if (!ReadDaemonConfig(daemon_file)) return 1;
+    } else {
+        if (!FinishSessionOptions(&options)) return usage(argv[0]);
+        if (!AddSession(&options)) return 1;
     }
 
-    if (joystick_name[0] == '\0') {
-        if (ioctl(js_fd, JSIOCGNAME(sizeof(joystick_name)), joystick_name) < 0)
-            strncpy(joystick_name, "unknown-joystick", sizeof(joystick_name));
-        // Make a filename-friendly name out of it.
-        for (char *x = joystick_name; *x; ++x) {
-            if (isspace(*x)) *x = '-';
+    for (int i = 0; i < session_count; ++i) {
+        if (sessions[i]->options.replay_file == NULL) {
+            // Keep going if a joystick is unplugged for a moment.
+            joystick_watch = new_JoystickWatch();
+            break;
         }
     }
-    if (!quiet) {
-        fprintf(stderr, "joystick configuration name: %s\n", joystick_name);
-    }
-    if (op == DO_CREATE_CONFIG) {
-        CreateConfig(js_fd, &config);
-        WriteConfig(config_dir, joystick_name, &config);
-    } else if (op == DO_JOG) {
-        if (ReadConfig(config_dir, joystick_name, &config) == 0) {
-            fprintf(stderr,
-                    "Problem reading joystick config file.\n"
-                    "Create a fresh one with\n\t%s -C %s\n",
-                    argv[0], config_dir);
-            return 1;
-        }
-        JoystickInitialState(js_fd, &config);
-        JoystickRumbleInit(kJoystickId);
-        WaitForMachineStartup(startup_wait_ms);
-        JogMachine(js_fd, do_homing, &machine_limits, &config);
-    }
-
-    return 0;
+    if (realtime && !RealtimeStart(realtime_priority, realtime_cpu)) {
+        return 1;
+    }
+    // A daemon goes on as long as it can serve any of its machines.
+    const bool success = RunSessions() > 0;
+    if (joystick_watch) delete_JoystickWatch(&joystick_watch);
+    for (int i = 0; i < session_count; ++i) delete_JogSession(&sessions[i]);
+    free(sessions);
+
+    return success ? 0 : 1;
 }
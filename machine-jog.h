@@ -8,7 +8,8 @@
 // Axes we are interested in.
 enum Axis { AXIS_X, AXIS_Y, AXIS_Z, NUM_AXIS };
 
-struct js_event;
-int JoystickWaitForEvent(int fd, struct js_event *event, int timeout_ms);
+struct Vector {
+    float axis[NUM_AXIS];
+};
 
 #endif  // MACHINE_JOG_H
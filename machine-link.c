@@ -0,0 +1,710 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "machine-link.h"
+#include "reply-parser.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_COMMANDS_IN_FLIGHT 64
+#define RX_BUFFER_SIZE         4096  // Needs to be power of two.
+#define ROUND_TRIP_SAMPLES     16
+#define HISTORY_LINES          128  // Lines kept to be sent again.
+#define HISTORY_LINE_SIZE      192  // Longer lines can't be numbered.
+#define FRAMING_OVERHEAD       16   // "N<line> " and "*<checksum>"
+
+// A numbered line as it was sent.
+struct SentLine {
+    int owner;
+    int len;
+    char text[HISTORY_LINE_SIZE];
+};
+
+struct MachineLink {
+    int in_fd;
+    int out_fd;
+    int max_commands;  // Maximum number of unacknowledged commands.
+    int max_bytes;     // Maximum unacknowledged bytes; 0 for no limit.
+
+    // Ring of the byte-size, send time and owner of each command in flight.
+    int in_flight_bytes[MAX_COMMANDS_IN_FLIGHT];
+    int in_flight_owner[MAX_COMMANDS_IN_FLIGHT];
+    long in_flight_line[MAX_COMMANDS_IN_FLIGHT];  // -1: not numbered.
+    int64_t in_flight_sent_usec[MAX_COMMANDS_IN_FLIGHT];
+    int in_flight_start;
+    int in_flight_count;
+    int bytes_in_flight;
+
+    // Recent round trip times from sending a command to its 'ok'.
+    int64_t round_trip_usec[ROUND_TRIP_SAMPLES];
+    int round_trip_count;
+    int round_trip_pos;
+
+    int planner_free;  // Free planner blocks if reported in 'ok'; or -1
+    int planner_size;  // Largest number of free blocks seen.
+    unsigned blocked_sends;
+    int64_t blocked_usec;
+    uint64_t commands_sent;
+    uint64_t bytes_sent;
+    uint64_t acks;
+    uint64_t resent_lines;
+    uint64_t line_errors;
+    uint64_t busy_replies;
+    MachineLinkRoundTripHandler round_trip_handler;
+    void *round_trip_data;
+
+    // Ring buffer of received bytes. Positions are free-running counters,
+    // masked when accessing the buffer.
+    char rx[RX_BUFFER_SIZE];
+    unsigned rx_start;  // Beginning of the first incomplete line.
+    unsigned rx_scan;   // Everything before this has been searched for EOL.
+    unsigned rx_end;    // End of data.
+    bool rx_eof;
+    struct ReplyParser parser;  // Classifies the line at rx_start.
+
+    // Line numbers and checksums, so that the firmware can ask for lines
+    // that got corrupted on the way.
+    bool line_numbers;
+    long next_line;  // Number of the next line to send.
+    struct SentLine history[HISTORY_LINES];  // Indexed by line number.
+    long resend_from;      // Line we sent again last.
+    long resend_next;      // Next line to send again; next_line if none.
+    int stale_resends;     // Requests for it that are still to come.
+    int skip_oks;          // Each resend request is followed by an 'ok'.
+
+    int probes_unanswered;  // Their 'ok's come before those of commands.
+
+    int saved_in_flags;  // fcntl() flags to restore at the end.
+    MachineLinkAckMatcher is_ack;
+
+    // Where replies for commands of other owners go.
+    MachineLinkReplyHandler reply_handler;
+    void *reply_data;
+    MachineLinkLineObserver line_observer;
+    void *line_observer_data;
+};
+
+struct MachineLink *new_MachineLink(int in_fd, int out_fd, int max_commands,
+                                    int max_bytes) {
+    struct MachineLink *result =
+      (struct MachineLink *)calloc(1, sizeof(struct MachineLink));
+    result->in_fd = in_fd;
+    result->out_fd = out_fd;
+    if (max_commands < 1) max_commands = 1;
+    if (max_commands > MAX_COMMANDS_IN_FLIGHT)
+        max_commands = MAX_COMMANDS_IN_FLIGHT;
+    result->max_commands = max_commands;
+    result->max_bytes = max_bytes;
+    result->planner_free = result->planner_size = -1;
+    ReplyParserReset(&result->parser);
+
+    // We only read when there is something to read, but a non-blocking
+    // file descriptor allows us to just attempt the read() without asking
+    // select() first.
+    result->saved_in_flags = fcntl(in_fd, F_GETFL);
+    if (result->saved_in_flags >= 0) {
+        fcntl(in_fd, F_SETFL, result->saved_in_flags | O_NONBLOCK);
+    }
+    return result;
+}
+
+void delete_MachineLink(struct MachineLink **link) {
+    if ((*link)->saved_in_flags >= 0) {
+        fcntl((*link)->in_fd, F_SETFL, (*link)->saved_in_flags);
+    }
+    free(*link);
+    *link = NULL;
+}
+
+// Wait for fd to become readable. Timeout of -1 waits forever.
+// Returns 1 if readable, 0 on timeout and -1 on error.
+static int WaitReadable(int fd, int timeout_ms) {
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(fd, &read_fds);
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    return select(fd + 1, &read_fds, NULL, NULL, timeout_ms < 0 ? NULL : &tv);
+}
+
+static int WaitWritable(int fd) {
+    fd_set write_fds;
+    FD_ZERO(&write_fds);
+    FD_SET(fd, &write_fds);
+    return select(fd + 1, NULL, &write_fds, NULL, NULL);
+}
+
+// Read as much as fits into the receive buffer with a single read.
+// Returns number of bytes read, 0 if nothing available and -1 on error or EOF.
+static int FillBuffer(struct MachineLink *link) {
+    const unsigned used = link->rx_end - link->rx_start;
+    if (used == RX_BUFFER_SIZE) return 0;
+    const unsigned end_pos = link->rx_end & (RX_BUFFER_SIZE - 1);
+    const unsigned start_pos = link->rx_start & (RX_BUFFER_SIZE - 1);
+    struct iovec iov[2];
+    int iov_count = 1;
+    iov[0].iov_base = link->rx + end_pos;
+    if (end_pos >= start_pos) {  // Free space wraps around.
+        iov[0].iov_len = RX_BUFFER_SIZE - end_pos;
+        iov[1].iov_base = link->rx;
+        iov[1].iov_len = start_pos;
+        iov_count = (start_pos > 0) ? 2 : 1;
+    } else {
+        iov[0].iov_len = start_pos - end_pos;
+    }
+    const ssize_t r = readv(link->in_fd, iov, iov_count);
+    if (r < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        perror("Reading from machine");
+        return -1;
+    }
+    if (r == 0) {
+        link->rx_eof = true;
+        return -1;
+    }
+    link->rx_end += r;
+    return r;
+}
+
+static const char *FindEndOfLine(const char *data, size_t len) {
+    const char *eol = (const char *)memchr(data, '\n', len);
+    const char *cr =
+      (const char *)memchr(data, '\r', eol ? (size_t)(eol - data) : len);
+    return cr ? cr : eol;
+}
+
+// Extract the next complete line from the receive buffer into "buffer"
+// (without the newline) and tell what kind of reply it is; the bytes are
+// classified while they are searched for the end of line. Returns false if
+// there is no complete line yet.
+static bool NextLine(struct MachineLink *link, char *buffer, int len,
+                     enum ReplyType *type, long *number) {
+    for (;;) {
+        unsigned eol = link->rx_end;
+        while (link->rx_scan != link->rx_end) {
+            const unsigned scan_pos = link->rx_scan & (RX_BUFFER_SIZE - 1);
+            unsigned chunk = link->rx_end - link->rx_scan;
+            if (scan_pos + chunk > RX_BUFFER_SIZE)
+                chunk = RX_BUFFER_SIZE - scan_pos;  // up to the wrap-around.
+            const char *data = link->rx + scan_pos;
+            const char *found = FindEndOfLine(data, chunk);
+            if (found) {
+                ReplyParserFeed(&link->parser, data, found - data);
+                eol = link->rx_scan + (found - data);
+                break;
+            }
+            ReplyParserFeed(&link->parser, data, chunk);
+            link->rx_scan += chunk;
+        }
+        const unsigned line_len = eol - link->rx_start;
+        if (eol == link->rx_end) {
+            // No newline. Unless the buffer is full, we need to wait for more.
+            if (line_len < RX_BUFFER_SIZE) return false;
+        }
+        // Copy out, dealing with the possible wrap-around.
+        int copy_len = (int)line_len < len - 1 ? (int)line_len : len - 1;
+        for (int i = 0; i < copy_len;) {
+            const unsigned pos = (link->rx_start + i) & (RX_BUFFER_SIZE - 1);
+            int chunk = copy_len - i;
+            if (pos + chunk > RX_BUFFER_SIZE) chunk = RX_BUFFER_SIZE - pos;
+            memcpy(buffer + i, link->rx + pos, chunk);
+            i += chunk;
+        }
+        buffer[copy_len] = '\0';
+        *type = ReplyParserType(&link->parser, number);
+        ReplyParserReset(&link->parser);
+        link->rx_start = (eol == link->rx_end) ? eol : eol + 1;
+        link->rx_scan = link->rx_start;
+        if (line_len > 0) return true;
+        // Empty line, e.g. remainder of a \r\n. Look for the next one.
+    }
+}
+
+static int64_t NowUsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Handle an 'ok' line. With ADVANCED_OK, Marlin reports the state of its
+// queues: "ok N<line> P<planner-blocks-free> B<buffer-free>"
+static void AcknowledgeOldest(struct MachineLink *link, const char *ok_line) {
+    const char *planner = strstr(ok_line, " P");
+    int free_blocks;
+    if (planner && sscanf(planner + 2, "%d", &free_blocks) == 1) {
+        link->planner_free = free_blocks;
+        if (free_blocks > link->planner_size) link->planner_size = free_blocks;
+    }
+    if (link->in_flight_count == 0) return;  // Unsolicited 'ok'
+    if (link->in_flight_line[link->in_flight_start] >= link->resend_from) {
+        // The machine got past the lines sent again, so all requests for
+        // them that were already underway have arrived.
+        link->stale_resends = 0;
+    }
+    const int64_t round_trip =
+      NowUsec() - link->in_flight_sent_usec[link->in_flight_start];
+    link->acks++;
+    if (link->round_trip_handler) {
+        link->round_trip_handler(round_trip, link->round_trip_data);
+    }
+    link->round_trip_usec[link->round_trip_pos] = round_trip;
+    link->round_trip_pos = (link->round_trip_pos + 1) % ROUND_TRIP_SAMPLES;
+    if (link->round_trip_count < ROUND_TRIP_SAMPLES) link->round_trip_count++;
+    link->bytes_in_flight -= link->in_flight_bytes[link->in_flight_start];
+    link->in_flight_start =
+      (link->in_flight_start + 1) % MAX_COMMANDS_IN_FLIGHT;
+    link->in_flight_count--;
+}
+
+static bool WriteAll(struct MachineLink *link, const char *buffer, int len);
+static bool HasRoomFor(const struct MachineLink *link, int bytes);
+
+static void PushInFlight(struct MachineLink *link, int owner, int len,
+                         long line) {
+    const int pos = (link->in_flight_start + link->in_flight_count) %
+                    MAX_COMMANDS_IN_FLIGHT;
+    link->in_flight_bytes[pos] = len;
+    link->in_flight_owner[pos] = owner;
+    link->in_flight_line[pos] = line;
+    link->in_flight_sent_usec[pos] = NowUsec();
+    link->bytes_sent += len;
+    link->in_flight_count++;
+    link->bytes_in_flight += len;
+}
+
+// Forget the lines from "line" on that are in flight, wherever they are:
+// lines sent before numbering started might be ahead of them.
+static void DropInFlightFrom(struct MachineLink *link, long line) {
+    int kept = 0;
+    for (int i = 0; i < link->in_flight_count; ++i) {
+        const int from = (link->in_flight_start + i) % MAX_COMMANDS_IN_FLIGHT;
+        if (link->in_flight_line[from] >= line) {
+            link->bytes_in_flight -= link->in_flight_bytes[from];
+            continue;
+        }
+        const int to = (link->in_flight_start + kept) % MAX_COMMANDS_IN_FLIGHT;
+        link->in_flight_bytes[to] = link->in_flight_bytes[from];
+        link->in_flight_owner[to] = link->in_flight_owner[from];
+        link->in_flight_line[to] = link->in_flight_line[from];
+        link->in_flight_sent_usec[to] = link->in_flight_sent_usec[from];
+        kept++;
+    }
+    link->in_flight_count = kept;
+}
+
+// Send lines that are still to go again, as far as the window allows; the
+// rest follows as acknowledgements make room. Returns false on error.
+static bool ContinueResend(struct MachineLink *link) {
+    while (link->resend_next < link->next_line) {
+        const struct SentLine *sent =
+          &link->history[link->resend_next % HISTORY_LINES];
+        if (!HasRoomFor(link, sent->len)) return true;
+        if (!WriteAll(link, sent->text, sent->len)) return false;
+        PushInFlight(link, sent->owner, sent->len, link->resend_next++);
+        link->resent_lines++;
+    }
+    return true;
+}
+
+// The machine got a corrupted line and asks for it again. It drops all
+// lines after it as well, each with another request for the same line, so
+// we send everything from there on again, once.
+static void ResendFrom(struct MachineLink *link, long line) {
+    if (line == link->resend_from && link->stale_resends > 0) {
+        link->stale_resends--;
+        return;
+    }
+    if (line == link->next_line && link->resend_next == line) {
+        // The machine has all lines; a copy we sent again came too late
+        // and is rejected. Replies come in order, so it is the oldest.
+        if (link->in_flight_count > 0) {
+            link->bytes_in_flight -=
+              link->in_flight_bytes[link->in_flight_start];
+            link->in_flight_start =
+              (link->in_flight_start + 1) % MAX_COMMANDS_IN_FLIGHT;
+            link->in_flight_count--;
+        }
+        return;
+    }
+    if (line < 0 || line >= link->next_line ||
+        link->next_line - line > HISTORY_LINES) {
+        fprintf(stderr, "Machine asks for line %ld, which we can't resend.\n",
+                line);
+        return;
+    }
+    // These are not going to be acknowledged anymore.
+    DropInFlightFrom(link, line);
+    link->resend_from = line;
+    // The machine saw the lines after it that we had sent before.
+    const long seen = link->resend_next < link->next_line ? link->resend_next
+                                                          : link->next_line;
+    link->stale_resends = seen > line ? seen - 1 - line : 0;
+    link->resend_next = line;
+    ContinueResend(link);
+}
+
+// With line numbers, replies about them are handled right here. Returns
+// true if "line" was such a reply.
+static bool HandleNumberingReply(struct MachineLink *link, const char *line,
+                                 enum ReplyType type, long number) {
+    switch (type) {
+    case REPLY_RESEND:
+        link->skip_oks++;
+        ResendFrom(link, number);
+        return true;
+    case REPLY_OK:
+        if (link->skip_oks == 0) return false;
+        link->skip_oks--;  // The one following a resend request.
+        return true;
+    case REPLY_ERROR:
+        // Which line is missing; followed by the resend request.
+        if (strstr(line, "Last Line") == NULL) return false;
+        link->line_errors++;
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Account for a reply line and pass it on if it belongs to a command of
+// another owner. Replies are assumed to belong to the oldest command in
+// flight. Returns true if the line is for us (unsolicited lines are both
+// passed on and returned).
+static bool RouteLine(struct MachineLink *link, const char *line,
+                      enum ReplyType type, long number) {
+    const int owner = link->in_flight_count > 0
+                        ? link->in_flight_owner[link->in_flight_start]
+                        : MACHINE_LINK_UNSOLICITED;
+    if (link->line_observer) {
+        link->line_observer(line, link->line_observer_data);
+    }
+    if (type == REPLY_BUSY) link->busy_replies++;
+    if (link->probes_unanswered > 0 &&
+        (link->is_ack ? link->is_ack(line) : type == REPLY_OK)) {
+        link->probes_unanswered--;  // Sent before anything in flight.
+        return true;
+    }
+    if (link->line_numbers && HandleNumberingReply(link, line, type, number))
+        return false;
+    if (link->is_ack ? link->is_ack(line) : type == REPLY_OK) {
+        AcknowledgeOldest(link, line);
+        if (link->line_numbers) ContinueResend(link);  // Room for more.
+    }
+    if (owner == MACHINE_LINK_SELF || link->reply_handler == NULL) return true;
+    link->reply_handler(owner, line, link->reply_data);
+    return owner == MACHINE_LINK_UNSOLICITED;
+}
+
+int MachineLinkReadLine(struct MachineLink *link, char *buffer, int len,
+                        int timeout_ms) {
+    enum ReplyType type;
+    long number;
+    for (;;) {
+        if (NextLine(link, buffer, len, &type, &number)) {
+            if (RouteLine(link, buffer, type, number)) return 1;
+            continue;
+        }
+        const int r = FillBuffer(link);
+        if (r < 0) return -1;
+        if (r > 0) continue;
+        // Nothing there yet.
+        const int ready = WaitReadable(link->in_fd, timeout_ms);
+        if (ready <= 0) return ready;
+    }
+}
+
+int MachineLinkPoll(struct MachineLink *link) {
+    char buffer[512];
+    enum ReplyType type;
+    long number;
+    const uint64_t acks_before = link->acks;
+    // A single read() typically fetches all replies that came in since
+    // the last poll.
+    if (FillBuffer(link) < 0) return -1;
+    while (NextLine(link, buffer, sizeof(buffer), &type, &number)) {
+        RouteLine(link, buffer, type, number);
+    }
+    return link->acks - acks_before;
+}
+
+// Lines still to be sent again go first.
+static bool ResendPending(const struct MachineLink *link) {
+    return link->line_numbers && link->resend_next < link->next_line;
+}
+
+static bool HasRoomFor(const struct MachineLink *link, int bytes) {
+    if (link->in_flight_count == 0) return true;  // Always make progress.
+    if (link->line_numbers) bytes += FRAMING_OVERHEAD;
+    if (link->in_flight_count >= link->max_commands) return false;
+    return link->max_bytes <= 0 ||
+           link->bytes_in_flight + bytes <= link->max_bytes;
+}
+
+bool MachineLinkSend(struct MachineLink *link, const char *format, ...) {
+    char buffer[256];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(buffer, sizeof(buffer), format, ap);
+    va_end(ap);
+    if (len < 0) return false;
+    if (len >= (int)sizeof(buffer)) len = sizeof(buffer) - 1;
+    return MachineLinkSendRaw(link, buffer, len);
+}
+
+static bool WriteAll(struct MachineLink *link, const char *buffer, int len) {
+    for (int written = 0; written < len;) {
+        const int w = write(link->out_fd, buffer + written, len - written);
+        if (w < 0 && (errno == EAGAIN || errno == EINTR)) {
+            WaitWritable(link->out_fd);  // in case in_fd == out_fd
+            continue;
+        }
+        if (w < 0) {
+            perror("Writing to machine");
+            return false;
+        }
+        written += w;
+    }
+    return true;
+}
+
+bool MachineLinkSendRaw(struct MachineLink *link, const char *buffer,
+                        int len) {
+    return MachineLinkSendFor(link, MACHINE_LINK_SELF, buffer, len);
+}
+
+// Frame a command as "N<line> <command>*<checksum>\n", the checksum being
+// the XOR of all bytes before the '*'. Numbers and checksums the command
+// already has are replaced, and so is the line number an M110 sets, as
+// lines are counted by us. Returns the length or -1 if it doesn't fit.
+static int FrameLine(long line, const char *data, int len, char *out) {
+    if (len > 1 && toupper((unsigned char)data[0]) == 'N' &&
+        isdigit((unsigned char)data[1])) {
+        int skip = 1;
+        while (skip < len && isdigit((unsigned char)data[skip])) ++skip;
+        while (skip < len && data[skip] == ' ') ++skip;
+        data += skip;
+        len -= skip;
+    }
+    // The firmware ignores everything after a ';', including a checksum.
+    for (int i = 0; i < len; ++i) {
+        if (data[i] == '*' || data[i] == ';') len = i;
+    }
+    while (len > 0 && isspace((unsigned char)data[len - 1])) --len;
+    int framed_len;
+    if (len >= 4 && strncasecmp(data, "M110", 4) == 0 &&
+        (len == 4 || !isdigit((unsigned char)data[4]))) {
+        framed_len =
+          snprintf(out, HISTORY_LINE_SIZE, "N%ld M110 N%ld", line, line);
+    } else {
+        framed_len =
+          snprintf(out, HISTORY_LINE_SIZE, "N%ld %.*s", line, len, data);
+    }
+    if (framed_len < 0 || framed_len + 6 > HISTORY_LINE_SIZE)
+        return -1;  // No room for "*255\n".
+    unsigned char checksum = 0;
+    for (int i = 0; i < framed_len; ++i) checksum ^= out[i];
+    return framed_len + snprintf(out + framed_len,
+                                 HISTORY_LINE_SIZE - framed_len, "*%u\n",
+                                 checksum);
+}
+
+bool MachineLinkSendFor(struct MachineLink *link, int owner,
+                        const char *buffer, int len) {
+    char reply[512];
+    if (ResendPending(link) || !HasRoomFor(link, len)) {
+        link->blocked_sends++;
+        const int64_t start_usec = NowUsec();
+        while (ResendPending(link) || !HasRoomFor(link, len)) {
+            if (MachineLinkReadLine(link, reply, sizeof(reply), -1) < 0)
+                return false;
+        }
+        link->blocked_usec += NowUsec() - start_usec;
+    }
+    long line = -1;
+    if (link->line_numbers) {
+        // An unnumbered line would get in the way of resends; the machine
+        // would reject it anyway.
+        struct SentLine *sent = &link->history[link->next_line % HISTORY_LINES];
+        const int framed_len = FrameLine(link->next_line, buffer, len,
+                                         sent->text);
+        if (framed_len < 0) {
+            fprintf(stderr, "Line too long to be numbered, not sent: %.*s",
+                    len, buffer);
+            return false;
+        }
+        sent->owner = owner;
+        sent->len = framed_len;
+        buffer = sent->text;
+        len = framed_len;
+        line = link->next_line++;
+        link->resend_next = link->next_line;
+    }
+    if (!WriteAll(link, buffer, len)) return false;
+    PushInFlight(link, owner, len, line);
+    link->commands_sent++;
+    return true;
+}
+
+bool MachineLinkSetLineNumbers(struct MachineLink *link, bool enable) {
+    link->line_numbers = enable;
+    if (!enable) return true;
+    link->next_line = link->resend_next = 0;
+    link->resend_from = -1;
+    link->stale_resends = link->skip_oks = 0;
+    // Becomes "N0 M110 N0", so the machine expects line 1 next. Marlin only
+    // sets the number once it executes the M110, after it has checked the
+    // lines queued behind it already; so these have to wait for the 'ok'.
+    return MachineLinkSendRaw(link, "M110\n", 5) && MachineLinkDrain(link);
+}
+
+bool MachineLinkSendRealtime(struct MachineLink *link, const char *data,
+                             int len) {
+    if (!WriteAll(link, data, len)) return false;
+    link->bytes_sent += len;
+    return true;
+}
+
+bool MachineLinkSendProbe(struct MachineLink *link, const char *data,
+                          int len) {
+    if (!MachineLinkSendRealtime(link, data, len)) return false;
+    link->probes_unanswered++;
+    return true;
+}
+
+int MachineLinkProbesUnanswered(const struct MachineLink *link) {
+    return link->probes_unanswered;
+}
+
+void MachineLinkForgetProbes(struct MachineLink *link) {
+    link->probes_unanswered = 0;
+}
+
+void MachineLinkSetReplyHandler(struct MachineLink *link,
+                                 MachineLinkReplyHandler handler,
+                                 void *user_data) {
+    link->reply_handler = handler;
+    link->reply_data = user_data;
+}
+
+void MachineLinkSetLineObserver(struct MachineLink *link,
+                                MachineLinkLineObserver observer,
+                                void *user_data) {
+    link->line_observer = observer;
+    link->line_observer_data = user_data;
+}
+
+void MachineLinkSetAckMatcher(struct MachineLink *link,
+                              MachineLinkAckMatcher is_ack) {
+    link->is_ack = is_ack;
+}
+
+bool MachineLinkDrain(struct MachineLink *link) {
+    char reply[512];
+    while (link->in_flight_count > 0) {
+        if (MachineLinkReadLine(link, reply, sizeof(reply), -1) < 0)
+            return false;
+    }
+    return true;
+}
+
+int MachineLinkDiscardInput(struct MachineLink *link, int timeout_ms,
+                            bool do_echo) {
+    int total_bytes = 0;
+    for (;;) {
+        const int r = FillBuffer(link);
+        if (r < 0) return link->rx_eof ? total_bytes : -1;
+        if (r == 0 && link->rx_end == link->rx_start) {
+            if (WaitReadable(link->in_fd, timeout_ms) <= 0) break;
+            continue;
+        }
+        if (link->reply_handler || link->probes_unanswered > 0) {
+            // Replies for others are still passed on; only ours are dropped.
+            // Acknowledged probes are accounted for.
+            char line[512];
+            enum ReplyType type;
+            long number;
+            const unsigned before = link->rx_start;
+            while (NextLine(link, line, sizeof(line), &type, &number)) {
+                if (RouteLine(link, line, type, number) && do_echo)
+                    fprintf(stderr, "%s\n", line);
+            }
+            total_bytes += link->rx_start - before;
+            if (r == 0 && link->rx_start == before) {
+                // Only an incomplete line; wait for the rest of it.
+                if (WaitReadable(link->in_fd, timeout_ms) <= 0) break;
+            }
+            continue;
+        }
+        // Echo and drop everything in the buffer.
+        while (link->rx_start != link->rx_end) {
+            const unsigned pos = link->rx_start & (RX_BUFFER_SIZE - 1);
+            unsigned chunk = link->rx_end - link->rx_start;
+            if (pos + chunk > RX_BUFFER_SIZE) chunk = RX_BUFFER_SIZE - pos;
+            if (do_echo && write(STDERR_FILENO, link->rx + pos, chunk) < 0) {
+                perror("echo failed");
+            }
+            total_bytes += chunk;
+            link->rx_start += chunk;
+        }
+        link->rx_scan = link->rx_start;
+        ReplyParserReset(&link->parser);
+    }
+    link->in_flight_start = link->in_flight_count = link->bytes_in_flight = 0;
+    link->stale_resends = link->skip_oks = 0;
+    link->resend_next = link->next_line;
+    return total_bytes;
+}
+
+int MachineLinkInFlight(const struct MachineLink *link) {
+    return link->in_flight_count;
+}
+
+int MachineLinkFd(const struct MachineLink *link) { return link->in_fd; }
+
+void MachineLinkGetStatus(const struct MachineLink *link,
+                          struct MachineLinkStatus *status) {
+    status->round_trip_usec = -1;
+    for (int i = 0; i < link->round_trip_count; ++i) {
+        if (status->round_trip_usec < 0 ||
+            link->round_trip_usec[i] < status->round_trip_usec) {
+            status->round_trip_usec = link->round_trip_usec[i];
+        }
+    }
+    status->in_flight = link->in_flight_count;
+    status->max_commands = link->max_commands;
+    status->planner_free = link->planner_free;
+    status->planner_size = link->planner_size;
+    status->blocked_sends = link->blocked_sends;
+    status->blocked_usec = link->blocked_usec;
+    status->acks = link->acks;
+    status->commands_sent = link->commands_sent;
+    status->bytes_sent = link->bytes_sent;
+    status->resent_lines = link->resent_lines;
+    status->line_errors = link->line_errors;
+    status->busy_replies = link->busy_replies;
+}
+
+void MachineLinkSetRoundTripHandler(struct MachineLink *link,
+                                    MachineLinkRoundTripHandler handler,
+                                    void *user_data) {
+    link->round_trip_handler = handler;
+    link->round_trip_data = user_data;
+}
+
+bool MachineLinkHasRoom(const struct MachineLink *link, int len) {
+    return !ResendPending(link) && HasRoomFor(link, len);
+}
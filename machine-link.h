@@ -0,0 +1,149 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef MACHINE_LINK_H
+#define MACHINE_LINK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Streaming connection to the machine.
+//
+// Instead of sending one command and waiting for its 'ok', we keep up to
+// a configurable number of commands (and bytes, as the firmware only has a
+// small receive buffer) in flight. That way, the planner of the machine does
+// not run empty while we are busy reading the joystick.
+struct MachineLink;
+
+// Create a link reading replies from "in_fd" and writing to "out_fd".
+// Allows "max_commands" unacknowledged commands with a total of "max_bytes"
+// (0 for no limit).
+struct MachineLink *new_MachineLink(int in_fd, int out_fd, int max_commands,
+                                    int max_bytes);
+void delete_MachineLink(struct MachineLink **link);
+
+// Send a line of G-code (printf-style, including newline). Only blocks if
+// the window of commands in flight is full. Returns false on error.
+bool MachineLinkSend(struct MachineLink *link, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+// Send "len" bytes of already formatted G-code.
+bool MachineLinkSendRaw(struct MachineLink *link, const char *data, int len);
+
+// Owners of commands. Others, e.g. a host program we're proxying for, use
+// positive numbers.
+#define MACHINE_LINK_UNSOLICITED -1  // Reply while nothing was in flight.
+#define MACHINE_LINK_SELF 0
+
+// Send a command on behalf of "owner". Its replies are passed to the reply
+// handler instead of being returned by MachineLinkReadLine().
+bool MachineLinkSendFor(struct MachineLink *link, int owner, const char *data,
+                        int len);
+
+// Receives the reply lines (without newline) for commands of other owners,
+// and all unsolicited lines.
+typedef void (*MachineLinkReplyHandler)(int owner, const char *line,
+                                        void *user_data);
+void MachineLinkSetReplyHandler(struct MachineLink *link,
+                                MachineLinkReplyHandler handler,
+                                void *user_data);
+
+// Sees every reply line (without newline) read from the machine, whoever
+// it is for, e.g. to pick up position reports the firmware sends by itself.
+typedef void (*MachineLinkLineObserver)(const char *line, void *user_data);
+void MachineLinkSetLineObserver(struct MachineLink *link,
+                                MachineLinkLineObserver observer,
+                                void *user_data);
+
+// Send "len" bytes that the firmware handles as soon as they arrive, without
+// acknowledging them (e.g. GRBL real-time commands). They bypass the window
+// of commands in flight.
+bool MachineLinkSendRealtime(struct MachineLink *link, const char *data,
+                             int len);
+
+// Send a probe to see if the machine is ready; "data" is a command it
+// acknowledges. Probes bypass the window, so that they can be repeated while
+// the machine doesn't answer, but their acknowledgements are counted: they
+// come before those of commands sent later, and are returned by
+// MachineLinkReadLine() without acknowledging any command.
+bool MachineLinkSendProbe(struct MachineLink *link, const char *data,
+                          int len);
+
+// Number of probes not acknowledged yet.
+int MachineLinkProbesUnanswered(const struct MachineLink *link);
+
+// The machine has been reset; probes sent before will never be answered.
+void MachineLinkForgetProbes(struct MachineLink *link);
+
+// Tells if a reply line acknowledges the oldest command in flight.
+typedef bool (*MachineLinkAckMatcher)(const char *line);
+
+// Set how acknowledgements look like; the default (NULL) accepts lines
+// starting with 'ok'.
+void MachineLinkSetAckMatcher(struct MachineLink *link,
+                              MachineLinkAckMatcher is_ack);
+
+// Send each command with a line number and checksum from now on (Marlin
+// style "N<line> <command>*<checksum>"), starting with an "M110 N0". When
+// the firmware asks to resend a line that got corrupted, it is sent again
+// together with all that followed, from a history of the most recent lines.
+// Resend requests and what comes with them are not passed on as replies.
+// Returns false on error.
+bool MachineLinkSetLineNumbers(struct MachineLink *link, bool enable);
+
+// Consume all replies available without blocking and account for the
+// 'ok's received. Returns number of 'ok's seen or -1 on error.
+int MachineLinkPoll(struct MachineLink *link);
+
+// Wait until all commands in flight are acknowledged. Returns false on error.
+bool MachineLinkDrain(struct MachineLink *link);
+
+// Read the next reply line (without newline) into "buffer", waiting up to
+// "timeout_ms" (-1: forever). An 'ok' is accounted for, but still returned.
+// Returns 1 if a line has been read, 0 on timeout and -1 on error.
+int MachineLinkReadLine(struct MachineLink *link, char *buffer, int len,
+                        int timeout_ms);
+
+// Discard all input until nothing is coming anymore within timeout. Forgets
+// about all commands in flight. Replies for other owners are still passed
+// on to the reply handler. Returns number of bytes discarded or -1 on
+// error.
+int MachineLinkDiscardInput(struct MachineLink *link, int timeout_ms,
+                            bool do_echo);
+
+// File descriptor replies are read from; to be watched for readability.
+int MachineLinkFd(const struct MachineLink *link);
+
+// Tells if a command of "len" bytes can be sent without waiting.
+bool MachineLinkHasRoom(const struct MachineLink *link, int len);
+
+// Number of commands not yet acknowledged.
+int MachineLinkInFlight(const struct MachineLink *link);
+
+// What we know about the state of the link and the firmware queues.
+struct MachineLinkStatus {
+    int64_t round_trip_usec;  // Shortest recent send to 'ok' time; -1: unknown
+    int in_flight;            // Commands not acknowledged yet.
+    int max_commands;         // Maximum commands in flight.
+    int planner_free;         // Free planner blocks (-1: not reported).
+    int planner_size;         // Largest number of free blocks seen.
+    unsigned blocked_sends;   // Number of sends that had to wait for room.
+    int64_t blocked_usec;     // ... and the total time they waited.
+    uint64_t acks;            // Commands acknowledged.
+    uint64_t commands_sent;
+    uint64_t bytes_sent;
+    uint64_t resent_lines;    // Lines sent again on the machine's request.
+    uint64_t line_errors;     // Lines the machine reported as corrupted.
+    uint64_t busy_replies;    // "busy:" messages while commands take long.
+};
+void MachineLinkGetStatus(const struct MachineLink *link,
+                          struct MachineLinkStatus *status);
+
+// Called with the time from sending to acknowledgement of each command.
+typedef void (*MachineLinkRoundTripHandler)(int64_t usec, void *user_data);
+void MachineLinkSetRoundTripHandler(struct MachineLink *link,
+                                    MachineLinkRoundTripHandler handler,
+                                    void *user_data);
+
+#endif  // MACHINE_LINK_H
@@ -0,0 +1,193 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#define _DEFAULT_SOURCE  // CRTSCTS, B460800 and up.
+
+#include "machine-port.h"
+
+#include <fcntl.h>
+#include <linux/serial.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+static speed_t BaudToSpeed(int baud) {
+    switch (baud) {
+    case 9600: return B9600;
+    case 19200: return B19200;
+    case 38400: return B38400;
+    case 57600: return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 500000: return B500000;
+    case 576000: return B576000;
+    case 921600: return B921600;
+    case 1000000: return B1000000;
+    case 2000000: return B2000000;
+    default: return B0;
+    }
+}
+
+// Raw 8N1 without any flow control or line processing.
+static void MakeRaw(struct termios *tty) {
+    tty->c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR |
+                      ICRNL | IXON | IXOFF | IXANY);
+    tty->c_oflag &= ~OPOST;
+    tty->c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    tty->c_cflag &= ~(CSIZE | PARENB | CSTOPB | CRTSCTS);
+    tty->c_cflag |= CS8 | CLOCAL | CREAD;
+    // Return from read() as soon as there is a single byte, without an
+    // inter-character timer; lines are assembled by the reader.
+    tty->c_cc[VMIN] = 1;
+    tty->c_cc[VTIME] = 0;
+}
+
+bool SetRawTerminal(int fd) {
+    struct termios tty;
+    if (tcgetattr(fd, &tty) < 0) return false;
+    MakeRaw(&tty);
+    return tcsetattr(fd, TCSANOW, &tty) == 0;
+}
+
+static int OpenSerial(const char *device, int baud) {
+    const speed_t speed = BaudToSpeed(baud);
+    if (speed == B0) {
+        fprintf(stderr, "Unsupported baud rate %d\n", baud);
+        return -1;
+    }
+    const int fd = open(device, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        perror(device);
+        return -1;
+    }
+    struct termios tty;
+    if (tcgetattr(fd, &tty) < 0) {
+        perror("Not a terminal");
+        close(fd);
+        return -1;
+    }
+    MakeRaw(&tty);
+    cfsetispeed(&tty, speed);
+    cfsetospeed(&tty, speed);
+    if (tcsetattr(fd, TCSANOW, &tty) < 0) {
+        perror("Configuring serial line");
+        close(fd);
+        return -1;
+    }
+
+    // Many USB serial converters only pass on received bytes after a
+    // timeout of several milliseconds, unless asked for low latency. Not
+    // all drivers support that, so a failure is not an error.
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) == 0) {
+        serial.flags |= ASYNC_LOW_LATENCY;
+        ioctl(fd, TIOCSSERIAL, &serial);
+    }
+    tcflush(fd, TCIOFLUSH);  // Forget whatever was there before we came.
+    return fd;
+}
+
+static int OpenTCP(const char *host_port) {
+    char host[256];
+    const char *colon = strrchr(host_port, ':');
+    if (colon == NULL || colon - host_port >= (int)sizeof(host)) {
+        fprintf(stderr, "Expected tcp:<host>:<port>\n");
+        return -1;
+    }
+    memcpy(host, host_port, colon - host_port);
+    host[colon - host_port] = '\0';
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addresses;
+    const int err = getaddrinfo(host, colon + 1, &hints, &addresses);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", host_port, gai_strerror(err));
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo *a = addresses; a != NULL; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) continue;
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addresses);
+    if (fd < 0) {
+        perror(host_port);
+        return -1;
+    }
+    // Each command is a small packet that should go out right away.
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return fd;
+}
+
+static int OpenUnixSocket(const char *path) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket()");
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int OpenMachinePort(const char *spec, int baud) {
+    if (strncmp(spec, "tcp:", 4) == 0) return OpenTCP(spec + 4);
+    if (strncmp(spec, "unix:", 5) == 0) return OpenUnixSocket(spec + 5);
+    return OpenSerial(spec, baud);
+}
+
+int CreatePseudoTerminal(const char *link_path, int *slave_fd) {
+    *slave_fd = -1;
+    const int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        perror("Creating pseudo terminal");
+        if (master >= 0) close(master);
+        return -1;
+    }
+    const char *slave_name = ptsname(master);
+    *slave_fd = open(slave_name, O_RDWR | O_NOCTTY);
+    if (*slave_fd < 0 || !SetRawTerminal(*slave_fd)) {
+        perror(slave_name);
+        close(master);
+        return -1;
+    }
+    fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+    struct stat st;
+    if (lstat(link_path, &st) == 0 && S_ISLNK(st.st_mode)) unlink(link_path);
+    if (symlink(slave_name, link_path) < 0) {
+        perror(link_path);
+        close(master);
+        return -1;
+    }
+    return master;
+}
@@ -0,0 +1,28 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef MACHINE_PORT_H
+#define MACHINE_PORT_H
+
+#include <stdbool.h>
+
+// Open a direct connection to the machine, so that we don't need socat in
+// between. The "spec" is one of
+//   /dev/ttyACM0          : serial line with the given "baud" rate.
+//   tcp:<host>:<port>     : TCP connection, e.g. to BeagleG.
+//   unix:<path>           : Unix domain socket.
+// Returns the file descriptor, used for reading and writing, or -1 on error.
+int OpenMachinePort(const char *spec, int baud);
+
+// Switch terminal "fd" to raw mode: no echo, no line processing.
+bool SetRawTerminal(int fd);
+
+// Create a raw pseudo terminal with "link_path" a symbolic link to its slave
+// side, so that other programs can open it like a serial line. The slave is
+// kept open in "*slave_fd", so that the master survives them closing it.
+// Returns the non-blocking master file descriptor or -1 on error; on error,
+// "*slave_fd" might still need closing.
+int CreatePseudoTerminal(const char *link_path, int *slave_fd);
+
+#endif  // MACHINE_PORT_H
@@ -0,0 +1,329 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "machine-thread.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "event-loop.h"
+#include "host-proxy.h"
+#include "realtime.h"
+#include "spsc-ring.h"
+
+#define COMMAND_QUEUE_SIZE  64
+#define REALTIME_QUEUE_SIZE 16
+#define REPORT_QUEUE_SIZE   256
+#define MAX_COMMAND_LEN     116
+
+// Requests to the machine thread, besides commands.
+enum Control {
+    CONTROL_NONE,
+    CONTROL_PAUSE,          // Send what is queued, then pause.
+    CONTROL_PAUSE_DISCARD,  // Drop what is queued, then pause.
+    CONTROL_PAUSED,         // Paused; the link is someone else's.
+    CONTROL_STOP,           // Send what is queued, then exit.
+};
+
+struct Command {
+    int64_t queued_usec;
+    int len;
+    char data[MAX_COMMAND_LEN];
+};
+
+struct MachineThread {
+    struct MachineLink *link;
+    struct HostProxy *proxy;
+    const struct Firmware *firmware;
+    struct EventLoop *loop;
+    pthread_t thread;
+
+    struct SpscRing *commands;  // To the machine thread ...
+    struct SpscRing *realtime;  // ... bytes that skip the queue ...
+    struct SpscRing *reports;   // ... and back.
+    uint64_t lost_reports;      // Reports dropped as nobody fetched them.
+
+    atomic_int control;  // enum Control
+    int control_fd;      // Wakes up the machine thread for control changes.
+    int paused_fd;       // Machine thread paused.
+    int resume_fd;       // Machine thread can continue.
+};
+
+static int64_t NowUsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void Signal(int fd) {
+    const uint64_t one = 1;
+    const ssize_t w = write(fd, &one, sizeof(one));
+    (void)w;  // Only fails if the counter overflows: it's signalled then.
+}
+
+static void WaitFor(int fd) {
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) < 0) continue;  // EINTR
+}
+
+static void Report(struct MachineThread *t, const struct MachineReport *r) {
+    if (!SpscRingPush(t->reports, r)) t->lost_reports++;
+}
+
+static void ReportRoundTrip(int64_t usec, void *user_data) {
+    struct MachineReport report = {.type = MACHINE_REPORT_ROUND_TRIP,
+                                   .usec = usec};
+    Report((struct MachineThread *)user_data, &report);
+}
+
+static void ReportPosition(const char *line, void *user_data) {
+    struct MachineThread *t = (struct MachineThread *)user_data;
+    struct MachineReport report = {.type = MACHINE_REPORT_POSITION};
+    report.position_type =
+      t->firmware->parse_position(line, &report.position);
+    if (report.position_type == FIRMWARE_NO_POSITION) return;
+    report.usec = NowUsec();
+    Report(t, &report);
+}
+
+static void ReportStatus(struct MachineThread *t) {
+    struct MachineReport report = {.type = MACHINE_REPORT_STATUS};
+    MachineLinkGetStatus(t->link, &report.status);
+    if (t->proxy) report.host_commands = HostProxyCommandCount(t->proxy);
+    Report(t, &report);
+}
+
+static void ReportLost(struct MachineThread *t) {
+    struct MachineReport report = {.type = MACHINE_REPORT_LOST};
+    Report(t, &report);
+    EventLoopStop(t->loop);
+}
+
+static void SendRealtime(struct MachineThread *t) {
+    char c;
+    while (SpscRingPop(t->realtime, &c)) {
+        if (!MachineLinkSendRealtime(t->link, &c, 1)) ReportLost(t);
+    }
+}
+
+// Send queued commands as long as there is room in the window.
+static void SendQueued(struct MachineThread *t) {
+    SendRealtime(t);
+    if (atomic_load_explicit(&t->control, memory_order_acquire) ==
+        CONTROL_PAUSE_DISCARD) {
+        return;  // These are about to be dropped.
+    }
+    const struct Command *command;
+    while ((command = (const struct Command *)SpscRingPeek(t->commands))) {
+        if (!MachineLinkHasRoom(t->link, command->len)) break;
+        struct MachineReport report = {
+          .type = MACHINE_REPORT_SENT,
+          .usec = NowUsec() - command->queued_usec,
+        };
+        const bool sent =
+          MachineLinkSendRaw(t->link, command->data, command->len);
+        SpscRingPop(t->commands, NULL);
+        if (!sent) {
+            ReportLost(t);
+            return;
+        }
+        Report(t, &report);
+    }
+}
+
+// Pause or stop if asked to and we are done with the queue.
+static void HandleControl(struct MachineThread *t) {
+    const int control =
+      atomic_load_explicit(&t->control, memory_order_acquire);
+    if (control == CONTROL_NONE || control == CONTROL_PAUSED) return;
+    SendRealtime(t);
+    if (control == CONTROL_PAUSE_DISCARD) {
+        while (SpscRingPop(t->commands, NULL)) continue;
+    }
+    if (SpscRingPeek(t->commands) != NULL) return;  // Not done yet.
+    if (control == CONTROL_STOP) {
+        EventLoopStop(t->loop);
+        return;
+    }
+    ReportStatus(t);
+    atomic_store_explicit(&t->control, CONTROL_PAUSED, memory_order_release);
+    Signal(t->paused_fd);
+    // The link is someone else's meanwhile. Round trips and positions are
+    // still reported from there, which is fine, as we don't touch the
+    // reports meanwhile.
+    WaitFor(t->resume_fd);
+    // Pairs with the release in MachineThreadRelease().
+    (void)atomic_load_explicit(&t->control, memory_order_acquire);
+    SendQueued(t);  // Commands might have been queued meanwhile.
+    ReportStatus(t);
+}
+
+static void OnCommands(void *user_data) {
+    struct MachineThread *t = (struct MachineThread *)user_data;
+    SpscRingClearWakeup(t->commands);
+    SendQueued(t);
+    HandleControl(t);
+}
+
+static void OnRealtime(void *user_data) {
+    struct MachineThread *t = (struct MachineThread *)user_data;
+    SpscRingClearWakeup(t->realtime);
+    SendRealtime(t);
+}
+
+static void OnControl(void *user_data) {
+    struct MachineThread *t = (struct MachineThread *)user_data;
+    uint64_t count;
+    if (read(t->control_fd, &count, sizeof(count)) < 0) return;
+    HandleControl(t);
+}
+
+static void OnMachineReadable(void *user_data) {
+    struct MachineThread *t = (struct MachineThread *)user_data;
+    const int acks = MachineLinkPoll(t->link);
+    if (acks < 0) {
+        ReportLost(t);
+        return;
+    }
+    if (acks == 0) return;
+    SendQueued(t);  // There is room again.
+    ReportStatus(t);
+    HandleControl(t);
+}
+
+static void *MachineLoop(void *user_data) {
+    struct MachineThread *t = (struct MachineThread *)user_data;
+    EventLoopRun(t->loop);
+    return NULL;
+}
+
+struct MachineThread *new_MachineThread(struct MachineLink *link,
+                                        struct HostProxy *proxy,
+                                        const struct Firmware *firmware) {
+    struct MachineThread *t =
+      (struct MachineThread *)calloc(1, sizeof(struct MachineThread));
+    t->link = link;
+    t->proxy = proxy;
+    t->firmware = firmware;
+    atomic_init(&t->control, CONTROL_NONE);
+    t->commands = new_SpscRing(COMMAND_QUEUE_SIZE, sizeof(struct Command));
+    t->realtime = new_SpscRing(REALTIME_QUEUE_SIZE, 1);
+    t->reports =
+      new_SpscRing(REPORT_QUEUE_SIZE, sizeof(struct MachineReport));
+    t->control_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    t->paused_fd = eventfd(0, EFD_CLOEXEC);
+    t->resume_fd = eventfd(0, EFD_CLOEXEC);
+    t->loop = new_EventLoop();
+    MachineLinkSetRoundTripHandler(link, &ReportRoundTrip, t);
+    MachineLinkSetLineObserver(link, &ReportPosition, t);
+    if (!t->commands || !t->realtime || !t->reports || t->control_fd < 0 ||
+        t->paused_fd < 0 || t->resume_fd < 0 || !t->loop ||
+        !EventLoopAddFd(t->loop, SpscRingFd(t->commands), &OnCommands, t) ||
+        !EventLoopAddFd(t->loop, SpscRingFd(t->realtime), &OnRealtime, t) ||
+        !EventLoopAddFd(t->loop, t->control_fd, &OnControl, t) ||
+        !EventLoopAddFd(t->loop, MachineLinkFd(link), &OnMachineReadable,
+                        t) ||
+        (proxy && !HostProxyAttach(proxy, t->loop)) ||
+        RealtimeCreateThread(&t->thread, &MachineLoop, t) != 0) {
+        perror("Starting machine thread");
+        MachineLinkSetRoundTripHandler(link, NULL, NULL);
+        MachineLinkSetLineObserver(link, NULL, NULL);
+        if (proxy) HostProxyDetach(proxy);
+        if (t->loop) delete_EventLoop(&t->loop);
+        if (t->commands) delete_SpscRing(&t->commands);
+        if (t->realtime) delete_SpscRing(&t->realtime);
+        if (t->reports) delete_SpscRing(&t->reports);
+        if (t->control_fd >= 0) close(t->control_fd);
+        if (t->paused_fd >= 0) close(t->paused_fd);
+        if (t->resume_fd >= 0) close(t->resume_fd);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void delete_MachineThread(struct MachineThread **thread) {
+    struct MachineThread *t = *thread;
+    atomic_store_explicit(&t->control, CONTROL_STOP, memory_order_release);
+    Signal(t->control_fd);
+    pthread_join(t->thread, NULL);
+    MachineLinkSetRoundTripHandler(t->link, NULL, NULL);
+    MachineLinkSetLineObserver(t->link, NULL, NULL);
+    if (t->lost_reports > 0) {
+        fprintf(stderr, "Machine thread: %llu reports lost\n",
+                (unsigned long long)t->lost_reports);
+    }
+    delete_EventLoop(&t->loop);
+    delete_SpscRing(&t->commands);
+    delete_SpscRing(&t->realtime);
+    delete_SpscRing(&t->reports);
+    close(t->control_fd);
+    close(t->paused_fd);
+    close(t->resume_fd);
+    free(t);
+    *thread = NULL;
+}
+
+bool MachineThreadSend(struct MachineThread *thread, const char *data,
+                       int len) {
+    struct Command command;
+    if (len > MAX_COMMAND_LEN) return false;
+    command.queued_usec = NowUsec();
+    command.len = len;
+    memcpy(command.data, data, len);
+    return SpscRingPush(thread->commands, &command);
+}
+
+bool MachineThreadSendRealtime(struct MachineThread *thread,
+                               const char *data, int len) {
+    for (int i = 0; i < len; ++i) {
+        if (!SpscRingPush(thread->realtime, &data[i])) return false;
+    }
+    return true;
+}
+
+bool MachineThreadHasRoom(struct MachineThread *thread) {
+    return SpscRingFree(thread->commands) > 0;
+}
+
+int MachineThreadQueued(struct MachineThread *thread) {
+    return COMMAND_QUEUE_SIZE - SpscRingFree(thread->commands);
+}
+
+int MachineThreadReportFd(const struct MachineThread *thread) {
+    return SpscRingFd(thread->reports);
+}
+
+bool MachineThreadReadReport(struct MachineThread *thread,
+                             struct MachineReport *report) {
+    SpscRingClearWakeup(thread->reports);
+    return SpscRingPop(thread->reports, report);
+}
+
+void MachineThreadAcquire(struct MachineThread *thread, bool discard_queued) {
+    atomic_store_explicit(
+      &thread->control,
+      discard_queued ? CONTROL_PAUSE_DISCARD : CONTROL_PAUSE,
+      memory_order_release);
+    Signal(thread->control_fd);
+    WaitFor(thread->paused_fd);
+    // Pairs with the release in HandleControl(), so that we see the link
+    // as the machine thread left it.
+    while (atomic_load_explicit(&thread->control, memory_order_acquire) !=
+           CONTROL_PAUSED) {
+        continue;
+    }
+}
+
+void MachineThreadRelease(struct MachineThread *thread) {
+    atomic_store_explicit(&thread->control, CONTROL_NONE,
+                          memory_order_release);
+    Signal(thread->resume_fd);
+}
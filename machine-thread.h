@@ -0,0 +1,78 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef MACHINE_THREAD_H
+#define MACHINE_THREAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "firmware.h"
+#include "machine-link.h"
+
+struct HostProxy;
+
+// Talks to the machine on a thread of its own: commands are queued without
+// ever blocking, and sent as soon as the window of commands in flight has
+// room. Waiting for the machine thus never holds up whoever queues them.
+struct MachineThread;
+
+// What the machine thread tells us about its work.
+enum MachineReportType {
+    MACHINE_REPORT_SENT,        // A queued command has been sent.
+    MACHINE_REPORT_ROUND_TRIP,  // A command has been acknowledged.
+    MACHINE_REPORT_STATUS,      // New link status.
+    MACHINE_REPORT_POSITION,    // The machine reported its position.
+    MACHINE_REPORT_LOST,        // Connection to the machine is lost.
+};
+
+struct MachineReport {
+    enum MachineReportType type;
+    int64_t usec;  // SENT: time spent in queue; ROUND_TRIP: round trip;
+                   // POSITION: time received.
+    struct MachineLinkStatus status;  // STATUS only.
+    uint64_t host_commands;           // STATUS only.
+    enum FirmwarePosition position_type;  // POSITION only.
+    struct Vector position;               // POSITION only.
+};
+
+// Take over "link" and, if not NULL, serve "proxy" from the machine thread.
+// Position reports in the replies are recognized as "firmware" says.
+// Returns NULL on failure.
+struct MachineThread *new_MachineThread(struct MachineLink *link,
+                                        struct HostProxy *proxy,
+                                        const struct Firmware *firmware);
+
+// Sends whatever is still queued, then stops the thread.
+void delete_MachineThread(struct MachineThread **thread);
+
+// Queue a command (including newline). Returns false if the queue is full
+// or the command too long.
+bool MachineThreadSend(struct MachineThread *thread, const char *data,
+                       int len);
+
+// Queue real-time bytes; they are sent ahead of all queued commands.
+bool MachineThreadSendRealtime(struct MachineThread *thread,
+                               const char *data, int len);
+
+// Tells if there is room in the queue for another command.
+bool MachineThreadHasRoom(struct MachineThread *thread);
+
+// Number of commands waiting in the queue to be sent.
+int MachineThreadQueued(struct MachineThread *thread);
+
+// Readable when there are reports; fetch them with MachineThreadReadReport()
+// until it returns false.
+int MachineThreadReportFd(const struct MachineThread *thread);
+bool MachineThreadReadReport(struct MachineThread *thread,
+                             struct MachineReport *report);
+
+// Take over the link for commands that need to wait for replies. Returns
+// once the machine thread has sent all queued commands, or dropped them if
+// "discard_queued" is set, and paused. Until MachineThreadRelease(), the
+// link (and host proxy) can be used directly.
+void MachineThreadAcquire(struct MachineThread *thread, bool discard_queued);
+void MachineThreadRelease(struct MachineThread *thread);
+
+#endif  // MACHINE_THREAD_H
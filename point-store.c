@@ -0,0 +1,252 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "point-store.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define POINT_STORE_MAGIC   "MJPS"
+#define POINT_STORE_VERSION 1
+
+struct FileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t banks;
+    uint32_t slots;
+};
+
+// Small enough to be written in one go by the disk (a sector is at least
+// 512 bytes, and records never straddle one).
+struct PointRecord {
+    float axis[NUM_AXIS];
+    uint32_t check;  // Tells a complete record from an empty or torn one.
+};
+
+struct PointStore {
+    int fd;  // -1 if only in memory.
+    size_t size;
+    struct FileHeader *header;  // Beginning of the mapped file.
+    struct PointRecord *records;
+};
+
+static const size_t kStoreSize =
+  sizeof(struct FileHeader) +
+  POINT_STORE_BANKS * POINT_STORE_SLOTS * sizeof(struct PointRecord);
+
+// FNV-1a over the coordinates. Never 0 for all-zero coordinates, so
+// records of a freshly created file read as empty.
+static uint32_t RecordCheck(const struct PointRecord *record) {
+    const unsigned char *bytes = (const unsigned char *)record->axis;
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(record->axis); ++i) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static struct PointRecord *Record(const struct PointStore *store, int bank,
+                                  int slot) {
+    if (bank < 0 || bank >= POINT_STORE_BANKS || slot < 0 ||
+        slot >= POINT_STORE_SLOTS) {
+        return NULL;
+    }
+    return &store->records[bank * POINT_STORE_SLOTS + slot];
+}
+
+static bool IsStoreFile(int fd) {
+    char magic[4];
+    return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+           memcmp(magic, POINT_STORE_MAGIC, sizeof(magic)) == 0;
+}
+
+// Replace a text file of points by a store with the same points. The new
+// store is assembled next to it and takes its place once complete; the
+// text file is kept as .bak. Anything that doesn't read as points through
+// and through is left alone: it is likely not ours.
+static bool ConvertTextFile(const char *filename) {
+    FILE *in = fopen(filename, "r");
+    if (in == NULL) return false;
+    char tmp[1024];
+    char backup[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    snprintf(backup, sizeof(backup), "%s.bak", filename);
+    unlink(tmp);
+    struct PointStore *store = new_PointStore(tmp);
+    if (store == NULL) {
+        fclose(in);
+        return false;
+    }
+    int bad_lines;
+    const int count = PointStoreImport(store, in, &bad_lines);
+    fclose(in);
+    const bool synced = msync(store->header, store->size, MS_SYNC) == 0;
+    delete_PointStore(&store);
+    if (count == 0 || bad_lines > 0) {
+        fprintf(stderr,
+                "%s: not a saved points file, nor points in text form; "
+                "not touching it.\n",
+                filename);
+        unlink(tmp);
+        return false;
+    }
+    if (!synced || rename(filename, backup) < 0) {
+        perror(filename);
+        unlink(tmp);
+        return false;
+    }
+    if (rename(tmp, filename) < 0) {
+        perror(filename);
+        rename(backup, filename);
+        unlink(tmp);
+        return false;
+    }
+    fprintf(stderr, "Converted %d saved points in %s; old file kept as %s\n",
+            count, filename, backup);
+    return true;
+}
+
+struct PointStore *new_PointStore(const char *filename) {
+    struct PointStore *store =
+      (struct PointStore *)calloc(1, sizeof(struct PointStore));
+    store->fd = -1;
+    store->size = kStoreSize;
+    if (filename == NULL) {
+        store->header = (struct FileHeader *)calloc(1, kStoreSize);
+        store->records = (struct PointRecord *)(store->header + 1);
+        return store;
+    }
+
+    store->fd = open(filename, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (store->fd < 0 || fstat(store->fd, &st) < 0) {
+        perror(filename);
+        delete_PointStore(&store);
+        return NULL;
+    }
+    const bool is_new = (st.st_size == 0);
+    if (!is_new && !IsStoreFile(store->fd)) {
+        delete_PointStore(&store);
+        return ConvertTextFile(filename) ? new_PointStore(filename) : NULL;
+    }
+    if (is_new && ftruncate(store->fd, kStoreSize) < 0) {
+        perror(filename);
+        delete_PointStore(&store);
+        return NULL;
+    }
+    if (!is_new && st.st_size != (off_t)kStoreSize) {
+        fprintf(stderr, "%s: unexpected size of saved points file\n",
+                filename);
+        delete_PointStore(&store);
+        return NULL;
+    }
+    void *map = mmap(NULL, kStoreSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     store->fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap() saved points");
+        delete_PointStore(&store);
+        return NULL;
+    }
+    store->header = (struct FileHeader *)map;
+    store->records = (struct PointRecord *)(store->header + 1);
+    if (is_new) {
+        memcpy(store->header->magic, POINT_STORE_MAGIC, 4);
+        store->header->version = POINT_STORE_VERSION;
+        store->header->banks = POINT_STORE_BANKS;
+        store->header->slots = POINT_STORE_SLOTS;
+        msync(map, kStoreSize, MS_SYNC);
+    } else if (store->header->version != POINT_STORE_VERSION ||
+               store->header->banks != POINT_STORE_BANKS ||
+               store->header->slots != POINT_STORE_SLOTS) {
+        fprintf(stderr, "%s: incompatible saved points file\n", filename);
+        delete_PointStore(&store);
+        return NULL;
+    }
+    return store;
+}
+
+void delete_PointStore(struct PointStore **store) {
+    struct PointStore *s = *store;
+    if (s->fd < 0) {
+        free(s->header);
+    } else {
+        if (s->header) munmap(s->header, s->size);
+        close(s->fd);
+    }
+    free(s);
+    *store = NULL;
+}
+
+bool PointStoreGet(const struct PointStore *store, int bank, int slot,
+                   struct Vector *point) {
+    const struct PointRecord *record = Record(store, bank, slot);
+    if (record == NULL || record->check != RecordCheck(record)) return false;
+    memcpy(point->axis, record->axis, sizeof(point->axis));
+    return true;
+}
+
+bool PointStoreSet(struct PointStore *store, int bank, int slot,
+                   const struct Vector *point) {
+    struct PointRecord *record = Record(store, bank, slot);
+    if (record == NULL) return false;
+    memcpy(record->axis, point->axis, sizeof(record->axis));
+    record->check = RecordCheck(record);
+    if (store->fd < 0) return true;
+    // Only sync the page the record is in.
+    const uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    const uintptr_t page = (uintptr_t)record & ~(page_size - 1);
+    if (msync((void *)page, (uintptr_t)(record + 1) - page, MS_SYNC) < 0) {
+        perror("msync() saved point");
+        return false;
+    }
+    return true;
+}
+
+int PointStoreImport(struct PointStore *store, FILE *in, int *bad_lines) {
+    char line[256];
+    int bank = 0;
+    int count = 0;
+    int bad = 0;
+    while (fgets(line, sizeof(line), in)) {
+        const char *start = line + strspn(line, " \t\r\n");
+        if (*start == '\0' || *start == '#') continue;
+        int slot;
+        struct Vector point;
+        char rest;
+        if (sscanf(start, "bank %d %c", &slot, &rest) == 1) {
+            bank = slot;
+            continue;
+        }
+        if (sscanf(start, "%d: %f %f %f %c", &slot, &point.axis[AXIS_X],
+                   &point.axis[AXIS_Y], &point.axis[AXIS_Z], &rest) == 4 &&
+            PointStoreSet(store, bank, slot, &point)) {
+            ++count;
+        } else {
+            ++bad;
+        }
+    }
+    if (bad_lines) *bad_lines = bad;
+    return count;
+}
+
+void PointStoreExport(const struct PointStore *store, FILE *out) {
+    for (int bank = 0; bank < POINT_STORE_BANKS; ++bank) {
+        bool bank_written = (bank == 0);  // Bank 0 needs no header.
+        for (int slot = 0; slot < POINT_STORE_SLOTS; ++slot) {
+            struct Vector point;
+            if (!PointStoreGet(store, bank, slot, &point)) continue;
+            if (!bank_written) {
+                fprintf(out, "bank %d\n", bank);
+                bank_written = true;
+            }
+            fprintf(out, "%2d: %7.2f %7.2f %7.2f\n", slot, point.axis[AXIS_X],
+                    point.axis[AXIS_Y], point.axis[AXIS_Z]);
+        }
+    }
+}
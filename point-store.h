@@ -0,0 +1,45 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef POINT_STORE_H
+#define POINT_STORE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "machine-jog.h"
+
+#define POINT_STORE_BANKS 8
+#define POINT_STORE_SLOTS 64  // Per bank; one for each button.
+
+// Saved points, in banks of slots. Persisted in a memory-mapped file of
+// fixed-size records: storing a point writes just its record and syncs
+// that, and a record torn by a crash is detected and reads as empty, while
+// all others stay intact.
+struct PointStore;
+
+// Open the store in "filename", creating it if needed. A file in the text
+// format of older versions is converted. With a NULL filename, points are
+// only kept in memory. Returns NULL on failure.
+struct PointStore *new_PointStore(const char *filename);
+void delete_PointStore(struct PointStore **store);
+
+// Get point in "slot" of "bank". Returns false if it is empty.
+bool PointStoreGet(const struct PointStore *store, int bank, int slot,
+                   struct Vector *point);
+
+// Store point and make sure it is on disk. Returns false on failure.
+bool PointStoreSet(struct PointStore *store, int bank, int slot,
+                   const struct Vector *point);
+
+// Read points in text form, one "<slot>: <x> <y> <z>" per line; a line
+// "bank <n>" switches the bank they go to (0 at the start). Empty lines and
+// those starting with '#' are skipped. Returns the number of points read;
+// lines that are none of that are counted in "bad_lines" (if not NULL).
+int PointStoreImport(struct PointStore *store, FILE *in, int *bad_lines);
+
+// Write all points in the text form PointStoreImport() reads.
+void PointStoreExport(const struct PointStore *store, FILE *out);
+
+#endif  // POINT_STORE_H
@@ -0,0 +1,88 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#define _GNU_SOURCE  // CPU affinity.
+
+#include "realtime.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define PREFAULT_STACK_BYTES (256 * 1024)
+#define PREFAULT_THREAD_STACK_BYTES (REALTIME_THREAD_STACK_BYTES / 2)
+
+struct ThreadStart {
+    void *(*run)(void *);
+    void *arg;
+};
+
+static bool memory_locked = false;
+
+// Touch the stack we might need, so that its pages are mapped (and locked)
+// now instead of on first use in the middle of a jog tick.
+static void PrefaultStack(int bytes) {
+    char stack[bytes];
+    volatile char *touch = stack;  // Don't let the compiler skip this.
+    for (int i = 0; i < bytes; i += 4096) touch[i] = 0;
+}
+
+static void *RunThread(void *user_data) {
+    const struct ThreadStart start = *(struct ThreadStart *)user_data;
+    free(user_data);
+    if (memory_locked) PrefaultStack(PREFAULT_THREAD_STACK_BYTES);
+    return start.run(start.arg);
+}
+
+bool RealtimeStart(int priority, int cpu) {
+    // Threads would otherwise each get a malloc arena of their own, 64MB of
+    // address space that counts as locked, although barely any is used.
+    mallopt(M_ARENA_MAX, 1);
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        perror("mlockall()");
+        return false;
+    }
+    memory_locked = true;
+    PrefaultStack(PREFAULT_STACK_BYTES);
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            perror("sched_setaffinity()");
+            return false;
+        }
+    }
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+        perror("sched_setscheduler(SCHED_FIFO)");
+        return false;
+    }
+    return true;
+}
+
+int RealtimeCreateThread(pthread_t *thread, void *(*run)(void *), void *arg) {
+    struct ThreadStart *start = malloc(sizeof(*start));
+    if (start == NULL) return errno = ENOMEM;
+    start->run = run;
+    start->arg = arg;
+    pthread_attr_t attr;
+    int err = pthread_attr_init(&attr);
+    if (err == 0) {
+        err = pthread_attr_setstacksize(&attr, REALTIME_THREAD_STACK_BYTES);
+        if (err == 0) err = pthread_create(thread, &attr, &RunThread, start);
+        pthread_attr_destroy(&attr);
+    }
+    if (err != 0) {
+        free(start);
+        errno = err;
+    }
+    return err;
+}
@@ -0,0 +1,32 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#define REALTIME_DEFAULT_PRIORITY 50
+
+// Stack of each thread we start. Once all memory is locked, every page of
+// a thread's stack stays resident from the start; at glibc's default of
+// 8MB, each session of the daemon would lock 16MB that way. Our threads
+// keep their buffers on the heap and need only a few kB of stack.
+#define REALTIME_THREAD_STACK_BYTES (128 * 1024)
+
+// Make the calling process fit for hard timing: lock all memory (current
+// and future) so that we never wait for a page fault, pre-fault the stack,
+// pin the process to "cpu" (if >= 0) and run with SCHED_FIFO "priority".
+// Threads created afterwards inherit all of that.
+// Returns false (and says why on stderr) if any of it fails; typically, this
+// needs root or CAP_SYS_NICE and CAP_IPC_LOCK.
+bool RealtimeStart(int priority, int cpu);
+
+// Like pthread_create(), but with a stack of REALTIME_THREAD_STACK_BYTES,
+// of which the new thread pre-faults half before calling "run" if memory
+// is locked. Returns 0 or the error number, which is also left in errno.
+int RealtimeCreateThread(pthread_t *thread, void *(*run)(void *), void *arg);
+
+#endif  // REALTIME_H
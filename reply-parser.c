@@ -0,0 +1,71 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "reply-parser.h"
+
+#include <ctype.h>
+
+static const struct {
+    const char *prefix;  // Matched case-insensitively.
+    enum ReplyType type;
+} kPrefixes[] = {
+    {"ok", REPLY_OK},
+    {"resend:", REPLY_RESEND},
+    {"rs ", REPLY_RESEND},  // Old Marlin.
+    {"busy:", REPLY_BUSY},
+    {"echo:busy:", REPLY_BUSY},
+    {"error:", REPLY_ERROR},
+    {"!! ", REPLY_ERROR},  // Klipper.
+    {"echo:", REPLY_ECHO},
+};
+#define NUM_PREFIXES (int)(sizeof(kPrefixes) / sizeof(kPrefixes[0]))
+
+void ReplyParserReset(struct ReplyParser *parser) {
+    parser->candidates = (1u << NUM_PREFIXES) - 1;
+    parser->pos = 0;
+    parser->type = REPLY_OTHER;
+    parser->in_number = false;
+    parser->have_number = false;
+    parser->number = 0;
+}
+
+// Resend requests: skip blanks up to the number, then read digits.
+static void FeedNumber(struct ReplyParser *parser, char c) {
+    if (isdigit((unsigned char)c)) {
+        parser->number = parser->number * 10 + (c - '0');
+        parser->have_number = true;
+    } else if (parser->have_number || c != ' ') {
+        parser->in_number = false;  // Done.
+    }
+}
+
+void ReplyParserFeed(struct ReplyParser *parser, const char *data,
+                     size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        const char c = tolower((unsigned char)data[i]);
+        if (parser->in_number) {
+            FeedNumber(parser, c);
+            continue;
+        }
+        if (parser->candidates == 0) return;  // Seen all we need.
+        for (int p = 0; p < NUM_PREFIXES; ++p) {
+            if ((parser->candidates & (1u << p)) == 0) continue;
+            const char *prefix = kPrefixes[p].prefix;
+            if (prefix[parser->pos] != c) {
+                parser->candidates &= ~(1u << p);
+            } else if (prefix[parser->pos + 1] == '\0') {
+                parser->candidates &= ~(1u << p);  // Complete.
+                parser->type = kPrefixes[p].type;
+                parser->in_number = (parser->type == REPLY_RESEND);
+            }
+        }
+        parser->pos++;
+    }
+}
+
+enum ReplyType ReplyParserType(const struct ReplyParser *parser,
+                               long *number) {
+    if (number) *number = parser->have_number ? parser->number : -1;
+    return parser->type;
+}
@@ -0,0 +1,45 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef REPLY_PARSER_H
+#define REPLY_PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Kinds of lines firmware replies with.
+enum ReplyType {
+    REPLY_OTHER,   // Anything else, e.g. a position report.
+    REPLY_OK,      // "ok", possibly followed by queue state.
+    REPLY_RESEND,  // "Resend: <line>" or "rs <line>": line got corrupted.
+    REPLY_BUSY,    // "busy: processing" while a long command runs.
+    REPLY_ERROR,   // "Error:...", GRBL's "error:<code>" or Klipper's "!! ".
+    REPLY_ECHO,    // "echo:..." messages.
+};
+
+// Classifies a reply line as its bytes come in, wherever they are, so lines
+// don't need to be assembled first. Only the beginning of a line is looked
+// at (and the line number of a resend request).
+struct ReplyParser {
+    unsigned candidates;  // Prefixes still matching.
+    int pos;              // Bytes of the line seen so far.
+    enum ReplyType type;  // Longest prefix matched so far.
+    bool in_number;       // Reading the line number of a resend request.
+    bool have_number;
+    long number;
+};
+
+// Start looking at a new line.
+void ReplyParserReset(struct ReplyParser *parser);
+
+// Feed the next "len" bytes of the line (without the newline).
+void ReplyParserFeed(struct ReplyParser *parser, const char *data,
+                     size_t len);
+
+// At the end of the line: what it is. For REPLY_RESEND, "number" is the line
+// to resend from, or -1 if it is missing.
+enum ReplyType ReplyParserType(const struct ReplyParser *parser,
+                               long *number);
+
+#endif  // REPLY_PARSER_H
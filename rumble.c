@@ -4,85 +4,66 @@
 
 #include "rumble.h"
 
-#include <dirent.h>
-#include <fcntl.h>
 #include <linux/input.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <time.h>
 #include <unistd.h>
 
-static int rumble_device_fd = -1;
-static int rumble_effect_id = -1;
+// Timing of the effects.
+static const struct {
+    int length_ms;
+    int delay_ms;  // Delay before each playback.
+    int count;     // Number of repetitions.
+} kEffectTiming[NUM_RUMBLE_EFFECTS] = {
+  [RUMBLE_TICK] = {80, 0, 1},
+  [RUMBLE_BUZZ] = {300, 0, 1},
+  [RUMBLE_DOUBLE] = {60, 60, 2},
+};
 
-// Find input event for given joystick ID. Returns 1 on success.
-static int FindInputEvent(int for_js, char *event_path, size_t len) {
-    // Finding the associated input event requires to go through some
-    // hoops.
-    char sys_path[512];
-    snprintf(sys_path, sizeof(sys_path), "/sys/class/input/js%d/device/",
-             for_js);
+void JoystickRumbleInit(struct Rumble *rumble, int event_fd) {
+    rumble->device_fd = event_fd;
+    if (event_fd < 0) return;
 
-    int ev_id = -1;
-    struct dirent *entry;
-    DIR *const dir = opendir(sys_path);
-    while (dir && (entry = readdir(dir)) != NULL) {
-        if (sscanf(entry->d_name, "event%d", &ev_id) == 1) break;
+    int registered = 0;
+    for (int i = 0; i < NUM_RUMBLE_EFFECTS; ++i) {
+        struct ff_effect rumble_effect;
+        memset(&rumble_effect, 0, sizeof(rumble_effect));
+        rumble_effect.type = FF_RUMBLE;
+        rumble_effect.id = -1;
+        rumble_effect.direction = 0;
+        rumble_effect.trigger.button = 42;  // not triggered by button.
+        rumble_effect.replay.length = kEffectTiming[i].length_ms;
+        rumble_effect.replay.delay = kEffectTiming[i].delay_ms;
+        rumble_effect.u.rumble.strong_magnitude = 0xffff;
+        rumble_effect.u.rumble.weak_magnitude = 0xffff;
+        if (ioctl(rumble->device_fd, EVIOCSFF, &rumble_effect) < 0 ||
+            rumble_effect.id < 0) {
+            rumble->effect_id[i] = -1;
+            continue;
+        }
+        rumble->effect_id[i] = rumble_effect.id;
+        ++registered;
     }
-    if (dir) closedir(dir);
-    if (ev_id < 0) return 0;
-    snprintf(event_path, len, "/dev/input/event%d", ev_id);
-    return 1;
-}
-
-void JoystickRumbleInit(int joystick_id) {
-    char event_path[512];
-    if (!FindInputEvent(joystick_id, event_path, sizeof(event_path))) {
-        fprintf(stderr, "No rumble available.");
-        return;
-    }
-    rumble_device_fd = open(event_path, O_RDWR);
-    if (rumble_device_fd < 0) {
-        perror("Opening rumble");
-        return;
-    }
-
-    struct ff_effect rumble_effect;
-    memset(&rumble_effect, 0, sizeof(rumble_effect));
-    rumble_effect.type = FF_RUMBLE;
-    rumble_effect.id = -1;
-    rumble_effect.direction = 0;
-    rumble_effect.trigger.button = 42;  // not triggered by button.
-    rumble_effect.u.rumble.strong_magnitude = 0xffff;
-    rumble_effect.u.rumble.weak_magnitude = 0xffff;
-    if (ioctl(rumble_device_fd, EVIOCSFF, &rumble_effect) < 0 ||
-        rumble_effect.id < 0) {
+    if (registered == 0) {
         perror("Can't register rumble effect");
-        close(rumble_device_fd);
-        rumble_device_fd = -1;
-        return;
+        rumble->device_fd = -1;
     }
-    rumble_effect_id = rumble_effect.id;
 }
 
-void JoystickRumble(int ms) {
-    if (rumble_device_fd < 0) return;
+void JoystickRumble(const struct Rumble *rumble, enum RumbleEffect effect) {
+    if (rumble->device_fd < 0) return;
+    int id = rumble->effect_id[effect];
+    for (int i = 0; id < 0 && i < NUM_RUMBLE_EFFECTS; ++i) {
+        id = rumble->effect_id[i];  // Not available; take whatever we have.
+    }
     struct input_event play;
+    memset(&play, 0, sizeof(play));
     play.type = EV_FF;
-    play.code = rumble_effect_id;
-    play.value = 1; /* on */
-    if (write(rumble_device_fd, &play, sizeof(play)) < 0) {
-        perror("rumble on");
-    }
-    struct timespec tv;
-    tv.tv_sec = 0;
-    tv.tv_nsec = ms * 1000000L;
-    nanosleep(&tv, NULL);
-    play.value = 0; /* off */
-    if (write(rumble_device_fd, &play, sizeof(play)) < 0) {
-        perror("rumble off");
+    play.code = id;
+    play.value = kEffectTiming[effect].count;  // Number of times to play.
+    if (write(rumble->device_fd, &play, sizeof(play)) < 0) {
+        perror("rumble");
     }
 }
+
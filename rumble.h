@@ -2,8 +2,29 @@
  * (c) 2014 Henner Zeller <h.zeller@acm.org>
  */
 
-// Initialize rumble for joystick with given id.
-void JoystickRumbleInit(int joystick_id);
+#ifndef RUMBLE_H
+#define RUMBLE_H
 
-// Rumble for given milliseconds.
-void JoystickRumble(int ms);
+// Effects registered with the joystick.
+enum RumbleEffect {
+    RUMBLE_TICK,    // Short tick, e.g. hitting a limit.
+    RUMBLE_BUZZ,    // Longer buzz.
+    RUMBLE_DOUBLE,  // Two short pulses.
+    NUM_RUMBLE_EFFECTS
+};
+
+// Rumble of one joystick.
+struct Rumble {
+    int device_fd;  // -1 if not available.
+    int effect_id[NUM_RUMBLE_EFFECTS];
+};
+
+// Initialize rumble using the given input event device file descriptor
+// (opened read/write). A negative value disables rumble.
+void JoystickRumbleInit(struct Rumble *rumble, int event_fd);
+
+// Start playing the given effect. Does not block: the duration is part of
+// the effect, so the kernel stops it on its own.
+void JoystickRumble(const struct Rumble *rumble, enum RumbleEffect effect);
+
+#endif  // RUMBLE_H
@@ -0,0 +1,110 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "spsc-ring.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define CACHE_LINE 64
+
+struct SpscRing {
+    // Free-running positions, masked when accessing the buffer. Each is
+    // written by one side only; on separate cache lines, so that the two
+    // threads don't fight over them.
+    _Alignas(CACHE_LINE) atomic_uint head;  // Next to write; producer.
+    _Alignas(CACHE_LINE) atomic_uint tail;  // Next to read; consumer.
+
+    _Alignas(CACHE_LINE) unsigned mask;
+    size_t message_size;
+    int wakeup_fd;
+    char *buffer;
+};
+
+struct SpscRing *new_SpscRing(int capacity, size_t message_size) {
+    unsigned size = 1;
+    while (size < (unsigned)capacity) size <<= 1;
+    struct SpscRing *ring = (struct SpscRing *)aligned_alloc(
+      CACHE_LINE, (sizeof(struct SpscRing) + CACHE_LINE - 1) / CACHE_LINE *
+                    CACHE_LINE);
+    if (ring == NULL) return NULL;
+    memset(ring, 0, sizeof(*ring));
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->mask = size - 1;
+    ring->message_size = message_size;
+    ring->buffer = (char *)calloc(size, message_size);
+    ring->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->buffer == NULL || ring->wakeup_fd < 0) {
+        delete_SpscRing(&ring);
+        return NULL;
+    }
+    return ring;
+}
+
+void delete_SpscRing(struct SpscRing **ring) {
+    struct SpscRing *r = *ring;
+    if (r->wakeup_fd >= 0) close(r->wakeup_fd);
+    free(r->buffer);
+    free(r);
+    *ring = NULL;
+}
+
+bool SpscRingPush(struct SpscRing *ring, const void *message) {
+    const unsigned head =
+      atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const unsigned tail =
+      atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail > ring->mask) return false;  // Full.
+    memcpy(ring->buffer + (head & ring->mask) * ring->message_size, message,
+           ring->message_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    SpscRingWakeConsumer(ring);
+    return true;
+}
+
+int SpscRingFree(struct SpscRing *ring) {
+    const unsigned head =
+      atomic_load_explicit(&ring->head, memory_order_relaxed);
+    const unsigned tail =
+      atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return ring->mask + 1 - (head - tail);
+}
+
+void SpscRingWakeConsumer(struct SpscRing *ring) {
+    const uint64_t one = 1;
+    const ssize_t w = write(ring->wakeup_fd, &one, sizeof(one));
+    (void)w;  // Only fails if the counter overflows: consumer is awake then.
+}
+
+const void *SpscRingPeek(struct SpscRing *ring) {
+    const unsigned tail =
+      atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    const unsigned head =
+      atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail == head) return NULL;
+    return ring->buffer + (tail & ring->mask) * ring->message_size;
+}
+
+bool SpscRingPop(struct SpscRing *ring, void *message) {
+    const void *oldest = SpscRingPeek(ring);
+    if (oldest == NULL) return false;
+    if (message) memcpy(message, oldest, ring->message_size);
+    const unsigned tail =
+      atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+int SpscRingFd(const struct SpscRing *ring) { return ring->wakeup_fd; }
+
+void SpscRingClearWakeup(struct SpscRing *ring) {
+    uint64_t count;
+    const ssize_t r = read(ring->wakeup_fd, &count, sizeof(count));
+    (void)r;  // Fails with EAGAIN if there was nothing to clear.
+}
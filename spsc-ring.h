@@ -0,0 +1,43 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Passes fixed-size messages from one producer thread to one consumer
+// thread. Push and pop are wait-free and copy into memory allocated up
+// front, so nothing is allocated or locked while passing messages. The
+// consumer can wait for messages on a file descriptor.
+struct SpscRing;
+
+// Ring for at least "capacity" messages of "message_size" bytes.
+struct SpscRing *new_SpscRing(int capacity, size_t message_size);
+void delete_SpscRing(struct SpscRing **ring);
+
+// Producer: copy the message into the ring and wake up the consumer.
+// Returns false if the ring is full.
+bool SpscRingPush(struct SpscRing *ring, const void *message);
+
+// Producer: number of messages that can be pushed right now.
+int SpscRingFree(struct SpscRing *ring);
+
+// Producer: wake up the consumer without pushing a message.
+void SpscRingWakeConsumer(struct SpscRing *ring);
+
+// Consumer: the oldest message without removing it, or NULL if empty.
+const void *SpscRingPeek(struct SpscRing *ring);
+
+// Consumer: copy out and remove the oldest message ("message" can be NULL
+// to just drop it). Returns false if empty.
+bool SpscRingPop(struct SpscRing *ring, void *message);
+
+// Consumer: readable after messages have been pushed. Call
+// SpscRingClearWakeup() before popping them, so that no wakeup is lost.
+int SpscRingFd(const struct SpscRing *ring);
+void SpscRingClearWakeup(struct SpscRing *ring);
+
+#endif  // SPSC_RING_H
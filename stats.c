@@ -0,0 +1,170 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "stats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "joystick-input.h"
+
+#define SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+// Values below 2 * SUB_BUCKETS have a bucket each; above, each power of two
+// is split into SUB_BUCKETS buckets.
+static int BucketIndex(uint32_t usec) {
+    if (usec < 2 * SUB_BUCKETS) return usec;
+    const int shift = (31 - __builtin_clz(usec)) - HISTOGRAM_SUB_BITS;
+    return shift * SUB_BUCKETS + (usec >> shift);
+}
+
+// Largest value that goes into bucket "index".
+static int64_t BucketUpperBound(int index) {
+    if (index < 2 * SUB_BUCKETS) return index;
+    const int shift = index / SUB_BUCKETS - 1;
+    const int64_t mantissa = index % SUB_BUCKETS + SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+void HistogramAdd(struct Histogram *histogram, int64_t usec) {
+    if (usec < 0) usec = 0;
+    if (usec > INT32_MAX) usec = INT32_MAX;
+    histogram->bucket[BucketIndex(usec)]++;
+    histogram->count++;
+    histogram->sum_usec += usec;
+    if (histogram->count == 1 || usec < histogram->min_usec) {
+        histogram->min_usec = usec;
+    }
+    if (usec > histogram->max_usec) histogram->max_usec = usec;
+}
+
+int64_t HistogramPercentile(const struct Histogram *histogram,
+                            double percent) {
+    if (histogram->count == 0) return -1;
+    const uint64_t wanted = histogram->count * percent / 100.0;
+    uint64_t seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+        seen += histogram->bucket[b];
+        if (seen > wanted) {
+            const int64_t upper = BucketUpperBound(b);
+            return upper < histogram->max_usec ? upper : histogram->max_usec;
+        }
+    }
+    return histogram->max_usec;
+}
+
+int64_t ProcessCpuUsec(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (int64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+           usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+void JogStatsStart(struct JogStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->start_usec = JoystickInputNowUsec();
+    stats->start_cpu_usec = ProcessCpuUsec();
+}
+
+void JogStatsSegment(struct JogStats *stats, int bytes, int64_t latency_usec,
+                     int64_t send_usec) {
+    stats->segments++;
+    stats->bytes += bytes;
+    if (latency_usec >= 0) HistogramAdd(&stats->latency, latency_usec);
+    HistogramAdd(&stats->send, send_usec);
+}
+
+void JogStatsReport(const struct JogStats *stats, FILE *out) {
+    const double seconds = (JoystickInputNowUsec() - stats->start_usec) / 1e6;
+    if (seconds <= 0) return;
+    const struct Histogram *latency = &stats->latency;
+    fprintf(out,
+            "%.2fs: %.1f segments/s, %.0f bytes/s; latency p50 %.1fms "
+            "p90 %.1fms p99 %.1fms max %.1fms; cpu %.2f%%\n",
+            seconds, stats->segments / seconds, stats->bytes / seconds,
+            HistogramPercentile(latency, 50) / 1000.0,
+            HistogramPercentile(latency, 90) / 1000.0,
+            HistogramPercentile(latency, 99) / 1000.0,
+            latency->max_usec / 1000.0,
+            (ProcessCpuUsec() - stats->start_cpu_usec) / 1e4 / seconds);
+}
+
+void JogStatsJitterReport(const struct JogStats *stats, int64_t target_usec,
+                          FILE *out) {
+    const struct Histogram *h = &stats->tick_lateness;
+    if (h->count == 0) return;
+    const int64_t p99 = HistogramPercentile(h, 99);
+    fprintf(out,
+            "Tick lateness over %llu ticks: min %.3fms avg %.3fms "
+            "p99 %.3fms max %.3fms; %llu ticks missed.\n"
+            "p99 %s the %.1fms target.\n",
+            (unsigned long long)h->count, h->min_usec / 1000.0,
+            h->sum_usec / (double)h->count / 1000.0, p99 / 1000.0,
+            h->max_usec / 1000.0, (unsigned long long)stats->late_ticks,
+            p99 <= target_usec ? "meets" : "MISSES", target_usec / 1000.0);
+}
+
+static void WriteHistogram(const char *name, const struct Histogram *h,
+                           FILE *out) {
+    fprintf(out, "%s_count %llu\n", name, (unsigned long long)h->count);
+    fprintf(out, "%s_min_usec %lld\n", name, (long long)h->min_usec);
+    fprintf(out, "%s_mean_usec %lld\n", name,
+            h->count ? (long long)(h->sum_usec / (int64_t)h->count) : -1LL);
+    static const int kPercentiles[] = {50, 90, 99};
+    for (int i = 0; i < 3; ++i) {
+        fprintf(out, "%s_p%d_usec %lld\n", name, kPercentiles[i],
+                (long long)HistogramPercentile(h, kPercentiles[i]));
+    }
+    fprintf(out, "%s_max_usec %lld\n", name, (long long)h->max_usec);
+}
+
+void JogStatsWrite(const struct JogStats *stats, FILE *out) {
+    const int64_t elapsed_usec = JoystickInputNowUsec() - stats->start_usec;
+    fprintf(out, "uptime_usec %lld\n", (long long)elapsed_usec);
+    fprintf(out, "cpu_usec %lld\n",
+            (long long)(ProcessCpuUsec() - stats->start_cpu_usec));
+    fprintf(out, "events %llu\n", (unsigned long long)stats->events);
+    fprintf(out, "dropped_events %llu\n",
+            (unsigned long long)stats->dropped_events);
+    fprintf(out, "segments %llu\n", (unsigned long long)stats->segments);
+    fprintf(out, "bytes %llu\n", (unsigned long long)stats->bytes);
+    fprintf(out, "encoder_bytes %llu\n",
+            (unsigned long long)stats->encoder_bytes);
+    fprintf(out, "encoder_verbose_bytes %llu\n",
+            (unsigned long long)stats->encoder_verbose_bytes);
+    fprintf(out, "limit_hits %llu\n", (unsigned long long)stats->limit_hits);
+    fprintf(out, "late_ticks %llu\n", (unsigned long long)stats->late_ticks);
+    fprintf(out, "acks %llu\n", (unsigned long long)stats->acks);
+    fprintf(out, "blocked_usec %lld\n", (long long)stats->blocked_usec);
+    fprintf(out, "queue_full %llu\n", (unsigned long long)stats->queue_full);
+    fprintf(out, "resent_lines %llu\n",
+            (unsigned long long)stats->resent_lines);
+    fprintf(out, "line_errors %llu\n", (unsigned long long)stats->line_errors);
+    fprintf(out, "busy_replies %llu\n",
+            (unsigned long long)stats->busy_replies);
+    fprintf(out, "position_reports %llu\n",
+            (unsigned long long)stats->position_reports);
+    fprintf(out, "position_corrections %llu\n",
+            (unsigned long long)stats->position_corrections);
+    fprintf(out, "position_lag_um %lld\n", (long long)stats->position_lag_um);
+    fprintf(out, "max_position_lag_um %lld\n",
+            (long long)stats->max_position_lag_um);
+    WriteHistogram("input_delay", &stats->input_delay, out);
+    WriteHistogram("latency", &stats->latency, out);
+    WriteHistogram("send", &stats->send, out);
+    WriteHistogram("round_trip", &stats->round_trip, out);
+    WriteHistogram("queue_delay", &stats->queue_delay, out);
+    WriteHistogram("tick_lateness", &stats->tick_lateness, out);
+}
+
+bool JogStatsWriteFile(const struct JogStats *stats, const char *filename) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) return false;
+    JogStatsWrite(stats, out);
+    if (fclose(out) != 0) return false;
+    return rename(tmp, filename) == 0;
+}
@@ -0,0 +1,92 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Durations are sorted into buckets with a relative width of 1/16, so the
+// resolution is about 6% from a microsecond up to half an hour.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_BUCKETS  ((32 - HISTOGRAM_SUB_BITS) << HISTOGRAM_SUB_BITS)
+
+// Histogram of durations with constant memory use and constant time to add.
+struct Histogram {
+    uint64_t count;
+    int64_t sum_usec;
+    int64_t min_usec;
+    int64_t max_usec;
+    uint32_t bucket[HISTOGRAM_BUCKETS];
+};
+
+void HistogramAdd(struct Histogram *histogram, int64_t usec);
+
+// Duration below which "percent" of the samples are; resolution is one
+// bucket. Returns -1 if there are no samples.
+int64_t HistogramPercentile(const struct Histogram *histogram, double percent);
+
+// What happened in a jog session. Times are taken at each stage from stick
+// movement to the machine acknowledging the resulting segment.
+struct JogStats {
+    int64_t start_usec;
+    int64_t start_cpu_usec;
+
+    uint64_t events;          // Joystick events handled.
+    uint64_t dropped_events;  // ... lost, as we didn't read them in time.
+    uint64_t segments;        // Jog segments sent.
+    uint64_t bytes;           // ... and their size.
+    uint64_t encoder_bytes;          // Moves as sent, in compact G-code.
+    uint64_t encoder_verbose_bytes;  // ... as they'd be written in full.
+    uint64_t limit_hits;      // Machine limits reached.
+    uint64_t late_ticks;      // Segment timer expired more than once.
+    uint64_t acks;            // Commands acknowledged by the machine.
+    int64_t blocked_usec;     // Time waiting for room to send.
+    uint64_t queue_full;      // Ticks skipped as the send queue was full.
+    uint64_t resent_lines;    // Lines the machine asked for again (-N).
+    uint64_t line_errors;     // ... as it received them corrupted.
+    uint64_t busy_replies;    // Machine told it is busy with a command.
+    uint64_t position_reports;      // Positions reported by the machine.
+    uint64_t position_corrections;  // ... that corrected our idea of it.
+    int64_t position_lag_um;        // Commanded to last reported position.
+    int64_t max_position_lag_um;
+
+    struct Histogram input_delay;  // Kernel event time until we read it.
+    struct Histogram latency;      // Stick movement to its segment sent.
+    struct Histogram send;         // Creating and sending a segment.
+    struct Histogram round_trip;   // Command sent to acknowledged.
+    struct Histogram queue_delay;  // Segment queued until sent (with -T).
+    struct Histogram tick_lateness;  // Segment tick due until handled.
+};
+
+void JogStatsStart(struct JogStats *stats);
+
+// Account for a segment of "bytes" length, that took "send_usec" to create
+// and send, "latency_usec" after the stick movement it reflects (-1: not
+// triggered by a stick movement).
+void JogStatsSegment(struct JogStats *stats, int bytes, int64_t latency_usec,
+                     int64_t send_usec);
+
+// Print summary with rates, latency percentiles and CPU usage.
+void JogStatsReport(const struct JogStats *stats, FILE *out);
+
+// Print how late segment ticks were handled, and if the 99th percentile
+// is within "target_usec".
+void JogStatsJitterReport(const struct JogStats *stats, int64_t target_usec,
+                          FILE *out);
+
+// Write all counters and histogram percentiles, one "<name> <value>" per
+// line, to be read by scripts.
+void JogStatsWrite(const struct JogStats *stats, FILE *out);
+
+// Write to "filename", replacing it at once, so that readers never see a
+// partial file. Returns false on error.
+bool JogStatsWriteFile(const struct JogStats *stats, const char *filename);
+
+// CPU time (user and system) used by this process so far.
+int64_t ProcessCpuUsec(void);
+
+#endif  // STATS_H
@@ -0,0 +1,158 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#include "teach-in.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gcode-encoder.h"
+
+struct TeachIn {
+    struct Vector *points;
+    int count;
+    int capacity;
+};
+
+struct TeachIn *new_TeachIn(void) {
+    return (struct TeachIn *)calloc(1, sizeof(struct TeachIn));
+}
+
+void delete_TeachIn(struct TeachIn **teach_in) {
+    free((*teach_in)->points);
+    free(*teach_in);
+    *teach_in = NULL;
+}
+
+void TeachInClear(struct TeachIn *teach_in) { teach_in->count = 0; }
+
+void TeachInAdd(struct TeachIn *teach_in, const struct Vector *pos) {
+    if (teach_in->count > 0 &&
+        memcmp(&teach_in->points[teach_in->count - 1], pos, sizeof(*pos)) ==
+          0) {
+        return;
+    }
+    if (teach_in->count == teach_in->capacity) {
+        const int capacity =
+          teach_in->capacity ? 2 * teach_in->capacity : 1024;
+        struct Vector *grown = (struct Vector *)realloc(
+          teach_in->points, capacity * sizeof(struct Vector));
+        if (grown == NULL) return;
+        teach_in->points = grown;
+        teach_in->capacity = capacity;
+    }
+    teach_in->points[teach_in->count++] = *pos;
+}
+
+int TeachInPoints(const struct TeachIn *teach_in) { return teach_in->count; }
+
+static float Dot(const struct Vector *a, const struct Vector *b) {
+    return a->axis[AXIS_X] * b->axis[AXIS_X] +
+           a->axis[AXIS_Y] * b->axis[AXIS_Y] +
+           a->axis[AXIS_Z] * b->axis[AXIS_Z];
+}
+
+static struct Vector Difference(const struct Vector *a,
+                                const struct Vector *b) {
+    struct Vector result;
+    for (int i = AXIS_X; i < NUM_AXIS; ++i) {
+        result.axis[i] = a->axis[i] - b->axis[i];
+    }
+    return result;
+}
+
+// Distance of "p" from the segment "start" to "end".
+static float SegmentDistance(const struct Vector *p, const struct Vector *start,
+                             const struct Vector *end) {
+    const struct Vector segment = Difference(end, start);
+    struct Vector offset = Difference(p, start);
+    const float length_squared = Dot(&segment, &segment);
+    if (length_squared > 0) {
+        float t = Dot(&offset, &segment) / length_squared;
+        if (t < 0) t = 0;
+        if (t > 1) t = 1;
+        for (int a = AXIS_X; a < NUM_AXIS; ++a) {
+            offset.axis[a] -= t * segment.axis[a];
+        }
+    }
+    return sqrtf(Dot(&offset, &offset));
+}
+
+int TeachInSimplify(struct TeachIn *teach_in, float tolerance_mm) {
+    const int n = teach_in->count;
+    if (n < 3) return n;
+    struct Vector *const points = teach_in->points;
+    bool *keep = (bool *)calloc(n, sizeof(bool));
+    // Ranges still to look at; each splits into at most two.
+    int *ranges = (int *)malloc(2 * n * sizeof(int));
+    if (keep == NULL || ranges == NULL) {
+        free(keep);
+        free(ranges);
+        return n;
+    }
+    keep[0] = keep[n - 1] = true;
+    int top = 0;
+    ranges[top++] = 0;
+    ranges[top++] = n - 1;
+    while (top > 0) {
+        const int last = ranges[--top];
+        const int first = ranges[--top];
+        int farthest = -1;
+        float max_distance = tolerance_mm;
+        for (int i = first + 1; i < last; ++i) {
+            const float d =
+              SegmentDistance(&points[i], &points[first], &points[last]);
+            if (d > max_distance) {
+                max_distance = d;
+                farthest = i;
+            }
+        }
+        if (farthest < 0) continue;  // All within tolerance.
+        keep[farthest] = true;
+        ranges[top++] = first;
+        ranges[top++] = farthest;
+        ranges[top++] = farthest;
+        ranges[top++] = last;
+    }
+    int kept = 0;
+    for (int i = 0; i < n; ++i) {
+        if (keep[i]) points[kept++] = points[i];
+    }
+    teach_in->count = kept;
+    free(keep);
+    free(ranges);
+    return kept;
+}
+
+bool TeachInWriteGCode(const struct TeachIn *teach_in, const char *filename,
+                       float feedrate_xy, float feedrate_z, int decimals) {
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) return false;
+    fprintf(out, "; Taught-in path, %d points.\nG21\nG90\n", teach_in->count);
+    struct GCodeEncoder encoder;
+    GCodeEncoderInit(&encoder, decimals);
+    char line[128];
+    for (int i = 0; i < teach_in->count; ++i) {
+        float feedrate = feedrate_xy;
+        if (i > 0) {
+            const struct Vector move =
+              Difference(&teach_in->points[i], &teach_in->points[i - 1]);
+            const float dz = fabsf(move.axis[AXIS_Z]);
+            const float length = sqrtf(Dot(&move, &move));
+            if (dz > 0 && feedrate_z * length / dz < feedrate) {
+                feedrate = feedrate_z * length / dz;
+            }
+        }
+        if (GCodeEncodeMove(&encoder, &teach_in->points[i], feedrate * 60,
+                            line, sizeof(line)) > 0) {
+            fputs(line, out);
+        }
+    }
+    if (fclose(out) != 0) return false;
+    return rename(tmp, filename) == 0;
+}
@@ -0,0 +1,40 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+ * (c) 2014 Henner Zeller <h.zeller@acm.org>
+ */
+
+#ifndef TEACH_IN_H
+#define TEACH_IN_H
+
+#include <stdbool.h>
+
+#include "machine-jog.h"
+
+// Records the path the machine is jogged along, to be saved as G-code and
+// played back later. Before saving, the path is reduced to the fewest
+// segments that stay within a tolerance of it.
+struct TeachIn;
+
+struct TeachIn *new_TeachIn(void);
+void delete_TeachIn(struct TeachIn **teach_in);
+
+// Forget the path recorded so far.
+void TeachInClear(struct TeachIn *teach_in);
+
+// Add the next position of the path. Repeated positions are skipped.
+void TeachInAdd(struct TeachIn *teach_in, const struct Vector *pos);
+
+// Number of points of the path.
+int TeachInPoints(const struct TeachIn *teach_in);
+
+// Drop all points that are closer than "tolerance_mm" to the segment
+// between the points kept around them (Ramer-Douglas-Peucker). Reversals
+// are kept, as they are far from that segment. Returns the points left.
+int TeachInSimplify(struct TeachIn *teach_in, float tolerance_mm);
+
+// Write the path as absolute G1 moves with "decimals" digits. Moves go at
+// "feedrate_xy" (mm/s), slowed down where needed to keep Z within
+// "feedrate_z". The file is replaced at once. Returns false on error.
+bool TeachInWriteGCode(const struct TeachIn *teach_in, const char *filename,
+                       float feedrate_xy, float feedrate_z, int decimals);
+
+#endif  // TEACH_IN_H